@@ -60,6 +60,7 @@ public class pHash
 		public int pgsize;
 		public HashType hash_type;
 		public HashCB hashdist;
+		private IntPtr nbcalcs;
 
 		[UnmanagedFunctionPointer(CallingConvention.Cdecl)]
   		public delegate float HashCB(ref DP a, ref DP b);
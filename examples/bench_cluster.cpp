@@ -0,0 +1,144 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include "pHash.h"
+
+/* clusters a set of random 64-bit hashes grouped around cluster centers, in both
+   modes, and checks the result against all pairs when the set is small */
+
+static ulong64 random_hash(){
+    return ((ulong64)lrand48() << 42) ^ ((ulong64)lrand48() << 21) ^ (ulong64)lrand48();
+}
+
+/* hash a few bits away from one of nbcenters cluster centers */
+static ulong64 clustered_hash(const ulong64 *centers, int nbcenters){
+    ulong64 hash = centers[lrand48()%nbcenters];
+    int nbflips = lrand48()%8;
+    for (int i=0;i<nbflips;i++){
+	hash ^= 1ULL << (lrand48()%64);
+    }
+    return hash;
+}
+
+static double elapsed_ms(struct timeval &start, struct timeval &end){
+    return (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+}
+
+static int root(int *parent, int x){
+    while (parent[x] != x)
+	x = parent[x];
+    return x;
+}
+
+/* number of points labelled differently from an all pairs clustering */
+static int check_clusters(const ulong64 *hashes, int count, int threshold, ClusterMode mode,
+			  const int *labels){
+    int *ref = (int*)malloc(count*sizeof(int));
+    int *parent = (int*)malloc(count*sizeof(int));
+    int nbclusters = 0;
+    for (int i=0;i<count;i++)
+	parent[i] = i;
+    for (int i=0;i<count;i++){
+	for (int j=0;j<i;j++){
+	    if (ph_hamming_distance(hashes[i], hashes[j]) > threshold)
+		continue;
+	    if (mode == PH_CLUSTER_COMPONENTS){
+		int a = root(parent, i), b = root(parent, j);
+		if (a != b)
+		    parent[(a > b) ? a : b] = (a > b) ? b : a;
+	    } else if (parent[j] == j){
+		parent[i] = j;   /* first leader within the threshold */
+		break;
+	    }
+	}
+    }
+    int nbwrong = 0;
+    for (int i=0;i<count;i++){
+	int r = root(parent, i);
+	ref[i] = (r == i) ? nbclusters++ : ref[r];
+	if (ref[i] != labels[i])
+	    nbwrong++;
+    }
+    free(ref);
+    free(parent);
+    return nbwrong;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2){
+	printf("usage: %s nbhashes [threshold] [threads] [recall]\n", argv[0]);
+	return -1;
+    }
+    int count = atoi(argv[1]);
+    int threshold = (argc > 2) ? atoi(argv[2]) : 4;
+    int threads = (argc > 3) ? atoi(argv[3]) : 0;
+    double recall = (argc > 4) ? atof(argv[4]) : 1.0;
+    if (count <= 0)
+	return -1;
+
+    srand48(1);
+    int nbcenters = count/20 + 1;
+    ulong64 *centers = (ulong64*)malloc(nbcenters*sizeof(ulong64));
+    ulong64 *hashes = (ulong64*)malloc(count*sizeof(ulong64));
+    int *labels = (int*)malloc(count*sizeof(int));
+    if (!centers || !hashes || !labels){
+	printf("out of memory\n");
+	return -1;
+    }
+    for (int i=0;i<nbcenters;i++)
+	centers[i] = random_hash();
+    /* one in ten hashes is not near any other */
+    for (int i=0;i<count;i++)
+	hashes[i] = (lrand48()%10) ? clustered_hash(centers, nbcenters) : random_hash();
+
+    printf("%d hashes, threshold %d, recall %.2f\n", count, threshold, recall);
+    printf("%-12s %10s %10s %8s\n", "mode", "clusters", "ms", "wrong");
+    for (int m=0;m<2;m++){
+	ClusterMode mode = (m == 0) ? PH_CLUSTER_COMPONENTS : PH_CLUSTER_LEADER;
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	int nbclusters = ph_cluster_hashes(hashes, count, threshold, labels, mode, threads, recall);
+	gettimeofday(&end, NULL);
+	if (nbclusters < 0){
+	    printf("unable to cluster hashes\n");
+	    return -1;
+	}
+	printf("%-12s %10d %10.1f ", (m == 0) ? "components" : "leader", nbclusters,
+	       elapsed_ms(start, end));
+	if (count <= 20000)
+	    printf("%8d\n", check_clusters(hashes, count, threshold, mode, labels));
+	else
+	    printf("%8s\n", "-");
+    }
+
+    free(centers);
+    free(hashes);
+    free(labels);
+    return 0;
+}
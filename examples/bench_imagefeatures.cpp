@@ -0,0 +1,106 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include "pHash.h"
+
+/* times the dct hash, the MH hash and the radon digest of each image in a directory
+   taken separately and through one ph_image_features call, and checks they agree */
+
+static double elapsed_ms(struct timeval &start, struct timeval &end){
+    return (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2){
+	printf("usage: %s dirname\n", argv[0]);
+	return -1;
+    }
+    int nbfiles = 0;
+    char **files = ph_readfilenames(argv[1], nbfiles);
+    if (!files){
+	printf("unable to read files from %s\n", argv[1]);
+	return -1;
+    }
+
+    const int kinds = PH_HASH_DCT | PH_HASH_MH | PH_HASH_RADON;
+    double separate_ms = 0.0, combined_ms = 0.0;
+    int nbhashed = 0, nbdiffer = 0;
+    for (int i=0;i<nbfiles;i++){
+	struct timeval start, mid, end;
+	ulong64 dct_hash;
+	uint8_t *mh_hash = NULL;
+	int mh_length = 0;
+	Digest digest;
+	digest.coeffs = NULL;
+	ImageFeatures features;
+	int ret;
+	try {
+	    gettimeofday(&start, NULL);
+	    ret = ph_dct_imagehash(files[i], dct_hash);
+	    mh_hash = ph_mh_imagehash(files[i], mh_length);
+	    if (ph_image_digest(files[i], 3.5, 1.0, digest) != EXIT_SUCCESS)
+		ret = -1;
+	    gettimeofday(&mid, NULL);
+	    if (ph_image_features(files[i], kinds, features) < 0)
+		ret = -1;
+	    gettimeofday(&end, NULL);
+	} catch (CImgException &ex){
+	    ret = -1;
+	}
+	if (ret == 0 && mh_hash){
+	    separate_ms += elapsed_ms(start, mid);
+	    combined_ms += elapsed_ms(mid, end);
+	    if (dct_hash != features.dct_hash || mh_length != features.mh_length
+		|| memcmp(mh_hash, features.mh_hash, mh_length) != 0
+		|| digest.size != features.digest.size
+		|| memcmp(digest.coeffs, features.digest.coeffs, digest.size) != 0)
+		nbdiffer++;
+	    nbhashed++;
+	    ph_free_image_features(features);
+	} else {
+	    printf("unable to hash %s\n", files[i]);
+	}
+	free(mh_hash);
+	free(digest.coeffs);
+	free(files[i]);
+    }
+    free(files);
+    if (nbhashed == 0){
+	printf("no images hashed\n");
+	return -1;
+    }
+
+    printf("%d images, dct + mh + radon\n", nbhashed);
+    printf("%-10s %12s\n", "calls", "ms/image");
+    printf("%-10s %12.2f\n", "separate", separate_ms/nbhashed);
+    printf("%-10s %12.2f\n", "combined", combined_ms/nbhashed);
+    printf("speedup %.2fx, %d images with differing hashes\n", separate_ms/combined_ms, nbdiffer);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include "pHash.h"
+
+using namespace cimg_library;
+
+/* times ph_mh_imagehash against the dense 2D correlation it replaced, and
+   counts the hash bits on which the two differ */
+
+static double elapsed_ms(struct timeval &start, struct timeval &end){
+    return (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+}
+
+/* the MH hash as computed with CImg::get_correlate and per block crops */
+static uint8_t* dense_mh_imagehash(const char *filename, float alpha, float lvl){
+    uint8_t *hash = (uint8_t*)malloc(72*sizeof(uint8_t));
+    CImg<uint8_t> src(filename);
+    CImg<uint8_t> img;
+    if (src.spectrum() == 3){
+	img = src.get_RGBtoYCbCr().channel(0).blur(1.0).resize(512,512,1,1,5).get_equalize(256);
+    } else{
+	img = src.channel(0).get_blur(1.0).resize(512,512,1,1,5).get_equalize(256);
+    }
+    int sigma = (int)4*pow((float)alpha,(float)lvl);
+    CImg<float> kernel(2*sigma+1,2*sigma+1,1,1,0);
+    cimg_forXY(kernel,X,Y){
+	float xpos = pow(alpha,-lvl)*(X-sigma);
+	float ypos = pow(alpha,-lvl)*(Y-sigma);
+	float A = xpos*xpos + ypos*ypos;
+	kernel.atXY(X,Y) = (2-A)*exp(-A/2);
+    }
+    CImg<float> fresp = img.get_correlate(kernel);
+    fresp.normalize(0,1.0);
+    CImg<float> blocks(31,31,1,1,0);
+    for (int rindex=0;rindex < 31;rindex++){
+	for (int cindex=0;cindex < 31;cindex++){
+	    blocks(rindex,cindex) = fresp.get_crop(rindex*16,cindex*16,rindex*16+16-1,cindex*16+16-1).sum();
+	}
+    }
+    int bit_index = 0;
+    unsigned char hashbyte = 0;
+    for (int rindex=0;rindex < 31-2;rindex+=4){
+	for (int cindex=0;cindex < 31-2;cindex+=4){
+	    CImg<float> subsec = blocks.get_crop(cindex,rindex, cindex+2, rindex+2).unroll('x');
+	    float ave = subsec.mean();
+	    cimg_forX(subsec, I){
+		hashbyte <<= 1;
+		if (subsec(I) > ave)
+		    hashbyte |= 0x01;
+		bit_index++;
+		if ((bit_index%8) == 0){
+		    hash[bit_index/8 - 1] = hashbyte;
+		    hashbyte = 0x00;
+		}
+	    }
+	}
+    }
+    return hash;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2){
+	printf("usage: %s dirname [alpha] [level]\n", argv[0]);
+	return -1;
+    }
+    float alpha = (argc > 2) ? atof(argv[2]) : 2.0f;
+    float lvl = (argc > 3) ? atof(argv[3]) : 1.0f;
+    int nbfiles = 0;
+    char **files = ph_readfilenames(argv[1], nbfiles);
+    if (!files){
+	printf("unable to read files from %s\n", argv[1]);
+	return -1;
+    }
+
+    double dense_ms = 0.0, fast_ms = 0.0;
+    int nbhashed = 0, nbdiffbits = 0;
+    for (int i=0;i<nbfiles;i++){
+	struct timeval start, mid, end;
+	int N;
+	uint8_t *dense = NULL, *fast = NULL;
+	try {
+	    gettimeofday(&start, NULL);
+	    dense = dense_mh_imagehash(files[i], alpha, lvl);
+	    gettimeofday(&mid, NULL);
+	    fast = ph_mh_imagehash(files[i], N, alpha, lvl);
+	    gettimeofday(&end, NULL);
+	} catch (CImgException &ex){
+	    printf("unable to hash %s\n", files[i]);
+	}
+	if (dense && fast){
+	    dense_ms += elapsed_ms(start, mid);
+	    fast_ms += elapsed_ms(mid, end);
+	    for (int j=0;j<72;j++)
+		nbdiffbits += ph_bitcount8(dense[j]^fast[j]);
+	    nbhashed++;
+	}
+	free(dense);
+	free(fast);
+	free(files[i]);
+    }
+    free(files);
+    if (nbhashed == 0){
+	printf("no images hashed\n");
+	return -1;
+    }
+
+    printf("%d images, alpha %.2f level %.2f\n", nbhashed, alpha, lvl);
+    printf("%-8s %12s\n", "filter", "ms/image");
+    printf("%-8s %12.2f\n", "dense", dense_ms/nbhashed);
+    printf("%-8s %12.2f\n", "fast", fast_ms/nbhashed);
+    printf("speedup %.1fx, %d differing hash bits of %d\n", dense_ms/fast_ms, nbdiffbits, 72*8*nbhashed);
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include "pHash.h"
+
+/* builds the same set of random 64-bit hashes into trees of each supported
+   branch factor and reports the tree height and query cost of each */
+
+static int nb_calcs;
+
+float distancefunc(DP *pa, DP *pb){
+    nb_calcs++;
+    float d = ph_hamming_distance(*((ulong64*)pa->hash),*((ulong64*)pb->hash));
+    return d;
+}
+
+static ulong64 random_hash(){
+    return ((ulong64)lrand48() << 42) ^ ((ulong64)lrand48() << 21) ^ (ulong64)lrand48();
+}
+
+/* hash a few bits away from one of nbcenters cluster centers */
+static ulong64 clustered_hash(const ulong64 *centers, int nbcenters){
+    ulong64 hash = centers[lrand48()%nbcenters];
+    int nbflips = 2 + lrand48()%10;
+    for (int i=0;i<nbflips;i++){
+	hash ^= 1ULL << (lrand48()%64);
+    }
+    return hash;
+}
+
+static double elapsed_ms(struct timeval &start, struct timeval &end){
+    return (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+}
+
+static void remove_db(const char *filename, int nbdbfiles){
+    char extfile[256];
+    snprintf(extfile, sizeof(extfile), "%s.mvp", filename);
+    unlink(extfile);
+    for (int i=1;i<=nbdbfiles;i++){
+	snprintf(extfile, sizeof(extfile), "%s%d.mvp", filename, i);
+	unlink(extfile);
+    }
+}
+
+int main(int argc, char **argv){
+    int nbpoints = 20000;
+    int nbqueries = 200;
+    float radius = 6.0f;
+    const char *filename = "benchmvptree";
+    if (argc >= 2){
+	nbpoints = atoi(argv[1]);
+    }
+    if (argc >= 3){
+	nbqueries = atoi(argv[2]);
+    }
+    if (argc >= 4){
+	radius = atof(argv[3]);
+    }
+    if (argc >= 5){
+	filename = argv[4];
+    }
+    if ((nbpoints <= 0) || (nbqueries <= 0)){
+        printf("usage: %s [nbpoints] [nbqueries] [radius] [dbname]\n", argv[0]);
+	return -1;
+    }
+
+    srand48(1);
+    int nbcenters = nbpoints/20 + 1;
+    ulong64 *centers = (ulong64*)malloc(nbcenters*sizeof(ulong64));
+    if (!centers){
+	printf("mem alloc error\n");
+	return -2;
+    }
+    for (int i=0;i<nbcenters;i++){
+	centers[i] = random_hash();
+    }
+
+    DP **points = (DP**)malloc(nbpoints*sizeof(DP*));
+    ulong64 *hashes = (ulong64*)malloc(nbpoints*sizeof(ulong64));
+    ulong64 *qhashes = (ulong64*)malloc(nbqueries*sizeof(ulong64));
+    DP **results = (DP**)malloc(nbpoints*sizeof(DP*));
+    if (!points || !hashes || !qhashes || !results){
+	printf("mem alloc error\n");
+	return -2;
+    }
+    for (int i=0;i<nbpoints;i++){
+	char id[32];
+	snprintf(id, sizeof(id), "point%d", i);
+	hashes[i] = clustered_hash(centers, nbcenters);
+	points[i] = ph_malloc_datapoint(UINT64ARRAY);
+	points[i]->id = strdup(id);
+	points[i]->hash = &hashes[i];
+	points[i]->hash_length = 1;
+    }
+    for (int i=0;i<nbqueries;i++){
+	qhashes[i] = clustered_hash(centers, nbcenters);
+    }
+
+    printf("nbpoints = %d, nbqueries = %d, radius = %f\n", nbpoints, nbqueries, radius);
+    printf(" bf  height  build(ms)  pages/query  calcs/query  found/query  usecs/query\n");
+    for (int bf=MinBranchFactor;bf<=MaxBranchFactor;bf++){
+	MVPFile mvpfile;
+	ph_mvp_init(&mvpfile);
+	mvpfile.filename = (char*)filename;
+	mvpfile.hashdist = distancefunc;
+	mvpfile.hash_type = UINT64ARRAY;
+	mvpfile.branchfactor = bf;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	MVPRetCode ret = ph_save_mvptree(&mvpfile, points, nbpoints);
+	gettimeofday(&end, NULL);
+	if (ret != PH_SUCCESS){
+	    printf("%3d unable to save tree, ret code %d\n", bf, ret);
+	    remove_db(filename, mvpfile.nbdbfiles);
+	    continue;
+	}
+	double build_ms = elapsed_ms(start, end);
+
+	ph_set_option(PH_STATS, 1);
+	long total_calcs = 0, total_found = 0;
+	for (int i=0;i<nbqueries;i++){
+	    DP *query = ph_malloc_datapoint(UINT64ARRAY);
+	    query->id = (char*)"query";
+	    query->hash = &qhashes[i];
+	    query->hash_length = 1;
+
+	    MVPFile mvpquery;
+	    ph_mvp_init(&mvpquery);
+	    mvpquery.filename = (char*)filename;
+	    mvpquery.hashdist = distancefunc;
+	    mvpquery.hash_type = UINT64ARRAY;
+
+	    int nbfound = 0;
+	    nb_calcs = 0;
+	    ret = ph_query_mvptree(&mvpquery, query, nbpoints, radius, radius, results, nbfound);
+	    if ((ret != PH_SUCCESS) && (ret != PH_ERRCAP)){
+		printf("%3d unable to query, ret code %d\n", bf, ret);
+	    }
+	    total_calcs += nb_calcs;
+	    total_found += nbfound;
+	    for (int j=0;j<nbfound;j++){
+		free(results[j]->id);
+		free(results[j]->hash);
+		ph_free_datapoint(results[j]);
+	    }
+	    ph_free_datapoint(query);
+	}
+	ph_stats stats = ph_get_stats(&mvpfile);
+	ph_set_option(PH_STATS, 0);
+
+	printf("%3d %7llu %10.1f %12.1f %12.1f %12.1f %12llu\n", bf, stats.height, build_ms,
+	       (double)stats.reads/nbqueries, (double)total_calcs/nbqueries,
+	       (double)total_found/nbqueries, stats.avg_atime);
+
+	remove_db(filename, mvpfile.nbdbfiles);
+    }
+
+    for (int i=0;i<nbpoints;i++){
+	free(points[i]->id);
+	ph_free_datapoint(points[i]);
+    }
+    free(points);
+    free(hashes);
+    free(qhashes);
+    free(results);
+    free(centers);
+
+    return 0;
+}
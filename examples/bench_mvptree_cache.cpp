@@ -0,0 +1,237 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include "pHash.h"
+
+/* query latency of an mvp tree with the os page cache dropped (cold) and
+   warm, with and without the query page cache and child prefetching. For
+   meaningful cold numbers the index should be several times larger than RAM. */
+
+float distancefunc(DP *pa, DP *pb){
+    float d = ph_hamming_distance(*((ulong64*)pa->hash),*((ulong64*)pb->hash));
+    return d;
+}
+
+static ulong64 random_hash(){
+    return ((ulong64)lrand48() << 42) ^ ((ulong64)lrand48() << 21) ^ (ulong64)lrand48();
+}
+
+/* hash a few bits away from one of nbcenters cluster centers */
+static ulong64 clustered_hash(const ulong64 *centers, int nbcenters){
+    ulong64 hash = centers[lrand48()%nbcenters];
+    int nbflips = 2 + lrand48()%10;
+    for (int i=0;i<nbflips;i++){
+	hash ^= 1ULL << (lrand48()%64);
+    }
+    return hash;
+}
+
+/* ask the os to drop the cached pages of all the db files */
+static void drop_os_cache(const char *filename){
+    char extfile[256];
+    for (int i=0;;i++){
+	if (i == 0){
+	    snprintf(extfile, sizeof(extfile), "%s.mvp", filename);
+	} else {
+	    snprintf(extfile, sizeof(extfile), "%s%d.mvp", filename, i);
+	}
+	int fd = open(extfile, O_RDONLY);
+	if (fd < 0){
+	    break;
+	}
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(fd);
+    }
+}
+
+static int cmp_double(const void *a, const void *b){
+    double da = *(const double*)a, db = *(const double*)b;
+    return (da < db) ? -1 : ((da > db) ? 1 : 0);
+}
+
+static void run_queries(const char *label, const char *filename, ulong64 *qhashes, int nbqueries,
+			float radius, DP **results, int capacity, double *usecs){
+    ph_set_option(PH_STATS, 1);
+    long total_found = 0;
+    for (int i=0;i<nbqueries;i++){
+	DP *query = ph_malloc_datapoint(UINT64ARRAY);
+	query->id = (char*)"query";
+	query->hash = &qhashes[i];
+	query->hash_length = 1;
+
+	MVPFile mvpquery;
+	ph_mvp_init(&mvpquery);
+	mvpquery.filename = (char*)filename;
+	mvpquery.hashdist = distancefunc;
+	mvpquery.hash_type = UINT64ARRAY;
+
+	int nbfound = 0;
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	MVPRetCode ret = ph_query_mvptree(&mvpquery, query, capacity, radius, radius, results, nbfound);
+	gettimeofday(&end, NULL);
+	if ((ret != PH_SUCCESS) && (ret != PH_ERRCAP)){
+	    printf("unable to query, ret code %d\n", ret);
+	}
+	usecs[i] = (end.tv_sec - start.tv_sec)*1000000.0 + (end.tv_usec - start.tv_usec);
+	total_found += nbfound;
+	for (int j=0;j<nbfound;j++){
+	    free(results[j]->id);
+	    free(results[j]->hash);
+	    ph_free_datapoint(results[j]);
+	}
+	ph_free_datapoint(query);
+    }
+    ph_stats stats = ph_get_stats(NULL);
+    ph_set_option(PH_STATS, 0);
+
+    double total = 0.0;
+    for (int i=0;i<nbqueries;i++){
+	total += usecs[i];
+    }
+    qsort(usecs, nbqueries, sizeof(double), cmp_double);
+    printf("%-20s %10.1f %10.1f %10.1f %12.1f %12.1f %8.1f\n", label, total/nbqueries,
+	   usecs[nbqueries/2], usecs[(nbqueries*99)/100], (double)stats.reads/nbqueries,
+	   (double)stats.cache_hits/nbqueries, (double)total_found/nbqueries);
+}
+
+int main(int argc, char **argv){
+    if (argc < 2){
+        printf("usage: %s dbname [nbpoints] [nbqueries] [cache MB] [radius]\n", argv[0]);
+	printf("       builds dbname from nbpoints random hashes first, unless nbpoints is 0\n");
+	return -1;
+    }
+    const char *filename = argv[1];
+    int nbpoints = 100000;
+    int nbqueries = 500;
+    int cache_mb = 256;
+    float radius = 6.0f;
+    if (argc >= 3){
+	nbpoints = atoi(argv[2]);
+    }
+    if (argc >= 4){
+	nbqueries = atoi(argv[3]);
+    }
+    if (argc >= 5){
+	cache_mb = atoi(argv[4]);
+    }
+    if (argc >= 6){
+	radius = atof(argv[5]);
+    }
+    if ((nbpoints < 0) || (nbqueries <= 0) || (cache_mb <= 0)){
+	printf("bad arguments\n");
+	return -1;
+    }
+
+    srand48(1);
+    int nbcenters = nbpoints/20 + 100;
+    ulong64 *centers = (ulong64*)malloc(nbcenters*sizeof(ulong64));
+    ulong64 *qhashes = (ulong64*)malloc(nbqueries*sizeof(ulong64));
+    const int capacity = 1000;
+    DP **results = (DP**)malloc(capacity*sizeof(DP*));
+    double *usecs = (double*)malloc(nbqueries*sizeof(double));
+    if (!centers || !qhashes || !results || !usecs){
+	printf("mem alloc error\n");
+	return -2;
+    }
+    for (int i=0;i<nbcenters;i++){
+	centers[i] = random_hash();
+    }
+
+    if (nbpoints > 0){
+	DP **points = (DP**)malloc(nbpoints*sizeof(DP*));
+	ulong64 *hashes = (ulong64*)malloc(nbpoints*sizeof(ulong64));
+	if (!points || !hashes){
+	    printf("mem alloc error\n");
+	    return -2;
+	}
+	for (int i=0;i<nbpoints;i++){
+	    char id[32];
+	    snprintf(id, sizeof(id), "point%d", i);
+	    hashes[i] = clustered_hash(centers, nbcenters);
+	    points[i] = ph_malloc_datapoint(UINT64ARRAY);
+	    points[i]->id = strdup(id);
+	    points[i]->hash = &hashes[i];
+	    points[i]->hash_length = 1;
+	}
+	MVPFile mvpfile;
+	ph_mvp_init(&mvpfile);
+	mvpfile.filename = (char*)filename;
+	mvpfile.hashdist = distancefunc;
+	mvpfile.hash_type = UINT64ARRAY;
+	mvpfile.branchfactor = 3;
+	printf("building %s from %d points\n", filename, nbpoints);
+	MVPRetCode ret = ph_save_mvptree(&mvpfile, points, nbpoints);
+	for (int i=0;i<nbpoints;i++){
+	    free(points[i]->id);
+	    ph_free_datapoint(points[i]);
+	}
+	free(points);
+	free(hashes);
+	if (ret != PH_SUCCESS){
+	    printf("unable to save tree, ret code %d\n", ret);
+	    return -3;
+	}
+    }
+    for (int i=0;i<nbqueries;i++){
+	qhashes[i] = clustered_hash(centers, nbcenters);
+    }
+
+    printf("nbqueries = %d, radius = %f, cache = %d MB\n", nbqueries, radius, cache_mb);
+    printf("%-20s %10s %10s %10s %12s %12s %8s\n", "", "ave usecs", "p50 usecs", "p99 usecs",
+	   "pages/query", "hits/query", "found");
+
+    ph_set_option(PH_CACHE_SIZE, 0);
+    ph_set_option(PH_PREFETCH, 0);
+    drop_os_cache(filename);
+    run_queries("no cache, cold", filename, qhashes, nbqueries, radius, results, capacity, usecs);
+    ph_set_option(PH_PREFETCH, 1);
+    drop_os_cache(filename);
+    run_queries("  + prefetch", filename, qhashes, nbqueries, radius, results, capacity, usecs);
+    run_queries("no cache, warm", filename, qhashes, nbqueries, radius, results, capacity, usecs);
+
+    ph_set_option(PH_CACHE_SIZE, cache_mb);
+    ph_set_option(PH_PREFETCH, 0);
+    drop_os_cache(filename);
+    run_queries("page cache, cold", filename, qhashes, nbqueries, radius, results, capacity, usecs);
+    ph_set_option(PH_CACHE_SIZE, cache_mb);
+    ph_set_option(PH_PREFETCH, 1);
+    drop_os_cache(filename);
+    run_queries("  + prefetch", filename, qhashes, nbqueries, radius, results, capacity, usecs);
+    run_queries("page cache, warm", filename, qhashes, nbqueries, radius, results, capacity, usecs);
+    ph_set_option(PH_CACHE_SIZE, 0);
+
+    free(centers);
+    free(qhashes);
+    free(results);
+    free(usecs);
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+#include "pHash.h"
+
+/* times the dct video hash of each file under each sampling mode, and how close the
+   hashes of the faster modes stay to those of decoding every frame */
+
+#ifdef HAVE_VIDEO_HASH
+static double elapsed_ms(struct timeval &start, struct timeval &end){
+    return (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2){
+	printf("usage: %s videofile ...\n", argv[0]);
+	return -1;
+    }
+    const int nbmodes = 3;
+    const VideoSampling modes[nbmodes] = { PH_VIDEO_EXACT, PH_VIDEO_NONREF, PH_VIDEO_KEYFRAMES };
+    const char *names[nbmodes] = { "exact", "nonref", "keyframes" };
+    double total_ms[nbmodes] = { 0.0, 0.0, 0.0 };
+    double total_sim[nbmodes] = { 0.0, 0.0, 0.0 };
+    int nbhashed = 0;
+
+    for (int i=1;i<argc;i++){
+	ulong64 *hashes[nbmodes];
+	int lengths[nbmodes];
+	double ms[nbmodes];
+	bool ok = true;
+	for (int m=0;m<nbmodes;m++){
+	    struct timeval start, end;
+	    gettimeofday(&start, NULL);
+	    hashes[m] = ph_dct_videohash(argv[i], lengths[m], 0, modes[m]);
+	    gettimeofday(&end, NULL);
+	    ms[m] = elapsed_ms(start, end);
+	    ok = ok && hashes[m];
+	}
+	if (ok){
+	    printf("%s\n", argv[i]);
+	    for (int m=0;m<nbmodes;m++){
+		double sim = ph_dct_videohash_dist(hashes[0], lengths[0], hashes[m], lengths[m], 21);
+		printf("  %-10s %10.1f ms  %5.1fx  %4d keyframes  similarity %.3f\n",
+		       names[m], ms[m], ms[0]/ms[m], lengths[m], sim);
+		total_ms[m] += ms[m];
+		total_sim[m] += sim;
+	    }
+	    nbhashed++;
+	} else {
+	    printf("unable to hash %s\n", argv[i]);
+	}
+	for (int m=0;m<nbmodes;m++)
+	    free(hashes[m]);
+    }
+
+    if (nbhashed == 0)
+	return -1;
+    printf("%d files\n", nbhashed);
+    for (int m=0;m<nbmodes;m++){
+	printf("  %-10s %10.1f ms  %5.1fx  mean similarity %.3f\n",
+	       names[m], total_ms[m], total_ms[0]/total_ms[m], total_sim[m]/nbhashed);
+    }
+    return 0;
+}
+#else
+int main(int argc, char **argv){
+    printf("video hashing is not enabled\n");
+    return 0;
+}
+#endif
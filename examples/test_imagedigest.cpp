@@ -0,0 +1,77 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include "pHash.h"
+
+/* checks that digests with an out of range number of coefficients are refused, with
+   the digest left empty, and that an image digest in range succeeds */
+
+static int check_refused(const char *what, int ret, const Digest &digest){
+    if (ret == EXIT_SUCCESS || digest.coeffs != NULL || digest.size != 0){
+	printf("FAIL: %s was accepted\n", what);
+	return 1;
+    }
+    printf("ok: %s refused\n", what);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int failures = 0;
+
+    double values[180];
+    for (int i=0;i<180;i++)
+	values[i] = (double)((i*37)%101);
+    Features features;
+    features.features = values;
+    features.size = 180;
+    Digest digest;
+
+    failures += check_refused("ph_dct with 0 coefficients", ph_dct(features, digest, 0), digest);
+    failures += check_refused("ph_dct with MaxDigestCoeffs+1 coefficients",
+			      ph_dct(features, digest, MaxDigestCoeffs+1), digest);
+    if (ph_dct(features, digest, 40) != EXIT_SUCCESS || digest.size != 40){
+	printf("FAIL: ph_dct with 40 coefficients\n");
+	failures++;
+    }
+    free(digest.coeffs);
+
+    if (argc > 1){
+	failures += check_refused("ph_image_digest with 0 coefficients",
+				  ph_image_digest(argv[1], 1.0, 1.0, digest, 180, 0), digest);
+	failures += check_refused("ph_image_digest with MaxDigestCoeffs+1 coefficients",
+				  ph_image_digest(argv[1], 1.0, 1.0, digest, 180, MaxDigestCoeffs+1), digest);
+	if (ph_image_digest(argv[1], 1.0, 1.0, digest, 180, 40) != EXIT_SUCCESS || digest.size != 40){
+	    printf("FAIL: ph_image_digest of %s with 40 coefficients\n", argv[1]);
+	    failures++;
+	}
+	free(digest.coeffs);
+    }
+
+    printf("%d failures\n", failures);
+    return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+/*
+
+    pHash, the open source perceptual hash library
+    Copyright (C) 2009 Aetilius, Inc.
+    All rights reserved.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Evan Klinger - eklinger@phash.org
+    D Grant Starkweather - dstarkweather@phash.org
+
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <math.h>
+#include "pHash.h"
+
+
+float distancefunc(DP *pa, DP *pb){
+    float d = ph_hamming_distance(*((ulong64*)pa->hash), *((ulong64*)pb->hash));
+    return d;
+}
+
+/* compute dct hashes for all the image files in a directory */
+DP** read_hashes(const char *dir_name, int &count){
+    int nbfiles = 0;
+    count = 0;
+    char **files = ph_readfilenames(dir_name,nbfiles);
+    if (!files){
+	return NULL;
+    }
+    DP **hashlist = (DP**)malloc(nbfiles*sizeof(DP*));
+    if (!hashlist){
+	return NULL;
+    }
+    for (int i=0;i<nbfiles;i++){
+	ulong64 tmphash;
+	if (ph_dct_imagehash(files[i], tmphash) < 0){
+	    printf("unable to get hash for %s\n", files[i]);
+	    free(files[i]);
+	    continue;
+	}
+	hashlist[count] = ph_malloc_datapoint(UINT64ARRAY);
+	hashlist[count]->hash = malloc(sizeof(ulong64));
+	*((ulong64*)hashlist[count]->hash) = tmphash;
+	hashlist[count]->hash_length = 1;
+	hashlist[count]->id = files[i];
+	count++;
+    }
+    free(files);
+    return hashlist;
+}
+
+void free_hashes(DP **hashlist, int count){
+    for (int i=0;i<count;i++){
+	free(hashlist[i]->id);
+	free(hashlist[i]->hash);
+	ph_free_datapoint(hashlist[i]);
+    }
+    free(hashlist);
+}
+
+int main(int argc, char **argv){
+    if (argc < 4){
+	printf("not enough input args\n");
+        printf("usage: %s sampledir querydir dbname [radius] [threshold] [knearest]\n", argv[0]);
+	return -1;
+    }
+
+    const char *sample_dir = argv[1]; /* dir of images representative of the data */
+    const char *query_dir = argv[2];  /* dir of images representative of the queries */
+    const char *filename = argv[3];   /* name of db the parameters are tuned for */
+
+    float radius = 21.0f;
+    float threshold = 21.0f;
+    int knearest = 50;
+    if (argc >= 5){
+	radius = atof(argv[4]);
+    }
+    if (argc >= 6){
+	threshold = atof(argv[5]);
+    }
+    if (argc >= 7){
+	knearest = atoi(argv[6]);
+    }
+
+    MVPFile mvpfile;
+    ph_mvp_init(&mvpfile);
+    mvpfile.filename = strdup(filename);
+    mvpfile.hashdist = distancefunc;
+    mvpfile.hash_type = UINT64ARRAY;
+
+    int nbpoints = 0, nbqueries = 0;
+    DP **points = read_hashes(sample_dir, nbpoints);
+    DP **queries = read_hashes(query_dir, nbqueries);
+    if (!points || !queries){
+	printf("unable to read files from directory\n");
+	return -2;
+    }
+    printf("sample size = %d, nb queries = %d\n", nbpoints, nbqueries);
+    printf("radius = %f, threshold = %f, knearest = %d\n", radius, threshold, knearest);
+
+    MVPTuneResult *results = NULL;
+    int nbresults = 0;
+    MVPRetCode ret = ph_mvp_tune(&mvpfile, points, nbpoints, queries, nbqueries, radius, threshold,
+				 knearest, NULL, &results, nbresults, 1);
+    if (ret != PH_SUCCESS){
+	printf("unable to tune, ret code %d\n", ret);
+	return -3;
+    }
+
+    printf(" bf  pl   lc  pgsize  calcs/query  msecs/query\n");
+    for (int i=0;i<nbresults;i++){
+	if (results[i].retcode != PH_SUCCESS){
+	    continue;
+	}
+	printf("%3d %3d %4d %7ld %12.1f %12.3f\n", results[i].branchfactor, results[i].pathlength,
+	       results[i].leafcapacity, (long)results[i].pgsize, results[i].avg_calcs, results[i].avg_msecs);
+    }
+    printf("best: branchfactor = %d, pathlength = %d, leafcapacity = %d, pgsize = %ld\n",
+	   mvpfile.branchfactor, mvpfile.pathlength, mvpfile.leafcapacity, (long)mvpfile.pgsize);
+
+    free(results);
+    free_hashes(points, nbpoints);
+    free_hashes(queries, nbqueries);
+    free(mvpfile.filename);
+
+    return 0;
+}
@@ -261,65 +261,44 @@ float* ph_readaudio(const char *filename, int sr, int channels, float *sigbuf, i
     return ph_readaudio2(filename, sr, sigbuf, buflen, nbsecs);
 }
 
-uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames){
-
-   int frame_length = 4096;//2^12
-   int nfft = frame_length;
-   int nfft_half = 2048;
-   int start = 0;
-   int end = start + frame_length - 1;
-   int overlap = (int)(31*frame_length/32);
-   int advance = frame_length - overlap;
-   int index = 0;
-   nb_frames = (int)(floor(N/advance) - floor(frame_length/advance) + 1);
-   double window[frame_length];
+/* hamming window of p0 samples */
+static void* ph_hamming_build(double p0, double /* p1 */){
+   int frame_length = (int)p0;
+   double *window = (double*)malloc(frame_length*sizeof(double));
+   if (!window)
+       return NULL;
    for (int i = 0;i<frame_length;i++){
-       //hamming window
        window[i] = 0.54 - 0.46*cos(2*M_PI*i/(frame_length-1));
    }
-   
-   double frame[frame_length];
-   //fftw_complex *pF;
-   //fftw_plan p;
-   //pF = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*nfft);
-   complex double *pF = (complex double*)malloc(sizeof(complex double)*nfft);
+   return window;
+}
 
-   double magnF[nfft_half];
-   double maxF = 0.0;
-   double maxB = 0.0;
-  
+const int BarkFilters = 33;
+const int BarkFFTHalf = 2048;
+const int BarkBins = BarkFFTHalf/2 + 1;
+
+/* weights of the BarkFilters bark filters over the first BarkBins fft bins, for
+   sample rate p0, stored a filter at a time */
+static void* ph_bark_build(double p0, double /* p1 */){
+   int sr = (int)p0;
+   int nfft_half = BarkFFTHalf;
    double minfreq = 300;
    double maxfreq = 3000;
    double minbark = 6*asinh(minfreq/600.0);
    double maxbark = 6*asinh(maxfreq/600.0);
    double nyqbark = maxbark - minbark;
-   int nfilts = 33;
+   int nfilts = BarkFilters;
    double stepbarks = nyqbark/(nfilts - 1);
-   int nb_barks = (int)(floor(nfft_half/2 + 1));
+   int nb_barks = BarkBins;
    double barkwidth = 1.06;    
-
-   double freqs[nb_barks];
    double binbarks[nb_barks];
-   double curr_bark[nfilts];
-   double prev_bark[nfilts];
-   for (int i=0;i< nfilts;i++){
-       prev_bark[i] = 0.0;
-   }
-   uint32_t *hash = (uint32_t*)malloc(nb_frames*sizeof(uint32_t));
    double lof,hif;
 
+   double *wts = (double*)malloc(nfilts*nb_barks*sizeof(double));
+   if (!wts)
+       return NULL;
    for (int i=0; i < nb_barks;i++){
        binbarks[i] = 6*asinh(i*sr/nfft_half/600.0);
-       freqs[i] = i*sr/nfft_half;
-   }
-   double **wts = new double*[nfilts];
-   for (int i=0;i<nfilts;i++){
-      wts[i] = new double[nfft_half];
-   }
-   for (int i=0;i<nfilts;i++){
-       for (int j=0;j<nfft_half;j++){
-	   wts[i][j] = 0.0;
-       }
    }
   
    //calculate wts for each filter
@@ -332,9 +311,55 @@ uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames){
            double m = std::min(lof,hif);
            m = std::min(0.0,m);
            m = pow(10,m);
-           wts[i][j] = m;
+           wts[i*nb_barks + j] = m;
        }
    }
+   return wts;
+}
+
+uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames){
+
+   int frame_length = 4096;//2^12
+   int nfft = frame_length;
+   int nfft_half = BarkFFTHalf;
+   int start = 0;
+   int end = start + frame_length - 1;
+   int overlap = (int)(31*frame_length/32);
+   int advance = frame_length - overlap;
+   int index = 0;
+   nb_frames = (int)(floor(N/advance) - floor(frame_length/advance) + 1);
+   bool window_owned, wts_owned;
+   const double *window = (const double*)ph_kernel_get(PH_KERNEL_HAMMING, frame_length, 0, ph_hamming_build, window_owned);
+   const double *wts = (const double*)ph_kernel_get(PH_KERNEL_BARK, sr, 0, ph_bark_build, wts_owned);
+   
+   double frame[frame_length];
+   //fftw_complex *pF;
+   //fftw_plan p;
+   //pF = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*nfft);
+   complex double *pF = (complex double*)malloc(sizeof(complex double)*nfft);
+
+   double magnF[nfft_half];
+   double maxF = 0.0;
+   double maxB = 0.0;
+  
+   int nfilts = BarkFilters;
+   int nb_barks = BarkBins;
+
+   double curr_bark[nfilts];
+   double prev_bark[nfilts];
+   for (int i=0;i< nfilts;i++){
+       prev_bark[i] = 0.0;
+   }
+   uint32_t *hash = (uint32_t*)malloc(nb_frames*sizeof(uint32_t));
+   if (!window || !wts || !pF || !hash){
+       free(pF);
+       free(hash);
+       if (window_owned)
+	   free((double*)window);
+       if (wts_owned)
+	   free((double*)wts);
+       return NULL;
+   }
 
    //p = fftw_plan_dft_r2c_1d(frame_length,frame,pF,FFTW_ESTIMATE);
 
@@ -346,7 +371,9 @@ uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames){
        }
        //fftw_execute(p);
        if (fft(frame, frame_length, pF) < 0){
-	   return NULL;
+	   free(hash);
+	   hash = NULL;
+	   break;
        }
        for (int i=0; i < nfft_half;i++){
 	   //magnF[i] = sqrt(pF[i][0]*pF[i][0] +  pF[i][1]*pF[i][1] );
@@ -358,8 +385,10 @@ uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames){
 
        for (int i=0;i<nfilts;i++){
 	   curr_bark[i] = 0;
-	   for (int j=0;j < nfft_half;j++){
-	       curr_bark[i] += wts[i][j]*magnF[j];
+	   /* the weights past the first nb_barks bins are 0 */
+	   const double *w = wts + i*nb_barks;
+	   for (int j=0;j < nb_barks;j++){
+	       curr_bark[i] += w[j]*magnF[j];
 	   }
            if (curr_bark[i] > maxB)
 	       maxB = curr_bark[i];
@@ -388,10 +417,10 @@ uint32_t* ph_audiohash(float *buf, int N, int sr, int &nb_frames){
    //fftw_destroy_plan(p);
    //fftw_free(pF);
    free(pF);
-   for (int i=0;i<nfilts;i++){
-       delete [] wts[i];
-   }
-   delete [] wts;
+   if (window_owned)
+       free((double*)window);
+   if (wts_owned)
+       free((double*)wts);
    return hash;
 }
 
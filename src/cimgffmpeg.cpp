@@ -25,15 +25,107 @@
 #ifdef HAVE_VIDEO_HASH
 #include "config.h"
 #include "cimgffmpeg.h"
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+static pthread_once_t av_once = PTHREAD_ONCE_INIT;
+#else
+static int av_once = 0;
+#endif
+
+static void vfinfo_register(){
+    av_log_set_level(AV_LOG_QUIET);
+    av_register_all();
+}
+
+/* register the formats and codecs, once for the process */
+static void vfinfo_init(){
+#ifdef HAVE_PTHREAD
+    pthread_once(&av_once, vfinfo_register);
+#else
+    if (!av_once){
+	vfinfo_register();
+	av_once = 1;
+    }
+#endif
+}
+
 void vfinfo_close(VFInfo  *vfinfo){
     if (vfinfo->pFormatCtx != NULL){
-	avcodec_close(vfinfo->pCodecCtx);
+	if (vfinfo->pCodecCtx != NULL)
+	    avcodec_close(vfinfo->pCodecCtx);
 	vfinfo->pCodecCtx = NULL;
 	avformat_close_input(&vfinfo->pFormatCtx);
 	vfinfo->pFormatCtx = NULL;
 	vfinfo->width = -1;
 	vfinfo->height = -1;
     }
+    if (vfinfo->pSwsCtx != NULL){
+	sws_freeContext(vfinfo->pSwsCtx);
+	vfinfo->pSwsCtx = NULL;
+    }
+}
+
+int vfinfo_open(VFInfo *st_info){
+    vfinfo_init();
+    st_info->current_index = 0;
+    st_info->videoStream = -1;
+    st_info->pCodecCtx = NULL;
+    st_info->pCodec = NULL;
+
+    // Open video file
+    if(avformat_open_input(&st_info->pFormatCtx, st_info->filename, NULL, NULL)!=0)
+	return -1 ; // Couldn't open file
+	 
+    // Retrieve stream information
+    if(av_find_stream_info(st_info->pFormatCtx)<0)
+	return -1; // Couldn't find stream information
+
+    // Find the video stream
+    for(unsigned int i=0; i<st_info->pFormatCtx->nb_streams; i++)
+    {
+	if(st_info->pFormatCtx->streams[i]->codec->codec_type==CODEC_TYPE_VIDEO) 
+	{
+	    st_info->videoStream=i;
+	    break;
+	}
+    }
+    if(st_info->videoStream==-1)
+	return -1; //no video stream
+
+    // Get a pointer to the codec context for the video stream
+    st_info->pCodecCtx = st_info->pFormatCtx->streams[st_info->videoStream]->codec;
+    if (st_info->pCodecCtx == NULL)
+	return -1;
+
+    // Find the decoder
+    st_info->pCodec = avcodec_find_decoder(st_info->pCodecCtx->codec_id);
+    if(st_info->pCodec==NULL) 
+	return -1 ; // Codec not found
+
+    int threads = st_info->threads;
+    if (threads <= 0)
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+    st_info->pCodecCtx->thread_count = (threads > 0) ? threads : 1;
+    st_info->pCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    // Open codec
+    if(avcodec_open(st_info->pCodecCtx, st_info->pCodec)<0)
+	return -1; // Could not open codec
+
+    st_info->height = (st_info->height<=0) ? st_info->pCodecCtx->height : st_info->height;
+    st_info->width  = (st_info->width<= 0) ? st_info->pCodecCtx->width : st_info->width;
+    return 0;
+}
+
+/* the converter to the target size and format - frames only change format at full size,
+   and are averaged over areas when shrunk to thumbnails */
+static SwsContext* vfinfo_scaler(VFInfo *st_info, PixelFormat ffmpeg_pixfmt){
+    int src_width = st_info->pCodecCtx->width, src_height = st_info->pCodecCtx->height;
+    int flags = (st_info->width < src_width || st_info->height < src_height) ? SWS_AREA : SWS_FAST_BILINEAR;
+    st_info->pSwsCtx = sws_getCachedContext(st_info->pSwsCtx, src_width, src_height, st_info->pCodecCtx->pix_fmt,
+					    st_info->width, st_info->height, ffmpeg_pixfmt, flags, NULL, NULL, NULL);
+    return st_info->pSwsCtx;
 }
 
 int ReadFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList, unsigned int low_index, unsigned int hi_index)
@@ -48,53 +140,8 @@ int ReadFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList, unsigned int low_
 	st_info->next_index = low_index;
 
 	if (st_info->pFormatCtx == NULL){
-	    st_info->current_index= 0;
-
-        av_log_set_level(AV_LOG_QUIET);
-	    av_register_all();
-	
-	    // Open video file
-	    if(avformat_open_input(&st_info->pFormatCtx, st_info->filename, NULL, NULL)!=0)
-		return -1 ; // Couldn't open file
-	 
-	    // Retrieve stream information
-	    if(av_find_stream_info(st_info->pFormatCtx)<0)
-		return -1; // Couldn't find stream information
-	
-	    //dump_format(pFormatCtx,0,NULL,0);//debugging function to print infomation about format
-	
-	    unsigned int i;
-	    // Find the video stream
-	    for(i=0; i<st_info->pFormatCtx->nb_streams; i++)
-	    {
-		if(st_info->pFormatCtx->streams[i]->codec->codec_type==CODEC_TYPE_VIDEO) 
-	        {
-		    st_info->videoStream=i;
-		    break;
-		}
-	    }
-	    if(st_info->videoStream==-1)
-		return -1; //no video stream
-	
-	
-	    // Get a pointer to the codec context for the video stream
-	    st_info->pCodecCtx = st_info->pFormatCtx->streams[st_info->videoStream]->codec;
-	    if (st_info->pCodecCtx == NULL){
+	    if (vfinfo_open(st_info) < 0)
 		return -1;
-	    }
-
-	    // Find the decoder
-	    st_info->pCodec = avcodec_find_decoder(st_info->pCodecCtx->codec_id);
-	    if(st_info->pCodec==NULL) 
-	    {
-	  	return -1 ; // Codec not found
-	    }
-	    // Open codec
-	    if(avcodec_open(st_info->pCodecCtx, st_info->pCodec)<0)
-		return -1; // Could not open codec
-
-	    st_info->height = (st_info->height<=0) ? st_info->pCodecCtx->height : st_info->height;
-	    st_info->width  = (st_info->width<= 0) ? st_info->pCodecCtx->width : st_info->width;
 	}
 
         AVFrame *pFrame;
@@ -125,7 +172,13 @@ int ReadFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList, unsigned int low_
 	AVPacket packet;
 	int result = 1;
 	CImg<uint8_t> next_image;
-	SwsContext *c = sws_getContext(st_info->pCodecCtx->width, st_info->pCodecCtx->height, st_info->pCodecCtx->pix_fmt, st_info->width, st_info->height, ffmpeg_pixfmt , SWS_BICUBIC, NULL, NULL, NULL);
+	SwsContext *c = vfinfo_scaler(st_info, ffmpeg_pixfmt);
+	if (c == NULL){
+	    av_free(buffer);
+	    av_free(pConvertedFrame);
+	    av_free(pFrame);
+	    return -1;
+	}
 	while ((result>=0)&&(size<st_info->nb_retrieval)&&(st_info->current_index<=hi_index)){  
 	  result =  av_read_frame(st_info->pFormatCtx, &packet);
           if (result < 0)
@@ -172,8 +225,6 @@ int ReadFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList, unsigned int low_
 	pConvertedFrame = NULL;
 	av_free(pFrame);
 	pFrame = NULL;
-	sws_freeContext(c);
-	c = NULL;
 
 	return size; 
 }
@@ -189,58 +240,9 @@ int NextFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList)
 
 	if (st_info->pFormatCtx == NULL)
 	{
-	        st_info->current_index = 0;
+		if (vfinfo_open(st_info) < 0)
+			return -1;
 		st_info->next_index = 0;
-		av_register_all();
-		st_info->videoStream = -1;
-		//st_info->pFormatCtx = (AVFormatContext*)malloc(sizeof(AVFormatContext));
-		//st_info->pCodecCtx = (AVCodecContext*)malloc(sizeof(AVCodecContext));
-		//st_info->pCodec = (AVCodec*)malloc(sizeof(AVCodec));
-
-		av_log_set_level(AV_LOG_QUIET);
-		// Open video file
-		if(avformat_open_input(&(st_info->pFormatCtx),st_info->filename,NULL,NULL)!=0){
-			return -1 ; // Couldn't open file
-		}
-	 
-		// Retrieve stream information
-		if(av_find_stream_info(st_info->pFormatCtx)<0){
-			return -1; // Couldn't find stream information
-		}
-
-		unsigned int i;
-
-		// Find the video stream
-		for(i=0; i< st_info->pFormatCtx->nb_streams; i++)
-		{
-			if(st_info->pFormatCtx->streams[i]->codec->codec_type==CODEC_TYPE_VIDEO) 
-			{
-				st_info->videoStream=i;
-				break;
-			}
-		}
-
-		if(st_info->videoStream==-1){
-		    return -1; //no video stream
-		}
-	
-		// Get a pointer to the codec context for the video stream
-		st_info->pCodecCtx = st_info->pFormatCtx->streams[st_info->videoStream]->codec;
-
-		// Find the decoder
-		st_info->pCodec = avcodec_find_decoder(st_info->pCodecCtx->codec_id);
-		if(st_info->pCodec==NULL) 
-		{
-			return -1 ; // Codec not found
-		}
-		// Open codec
-		if(avcodec_open(st_info->pCodecCtx, st_info->pCodec)<0){
-		    return -1; // Could not open codec
-		}
-		
-		st_info->width = (st_info->width<=0) ? st_info->pCodecCtx->width : st_info->width;
-		st_info->height = (st_info->height<=0) ? st_info->pCodecCtx->height : st_info->height;
-		
 	} 
 
 	AVFrame *pFrame;
@@ -270,7 +272,13 @@ int NextFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList)
 	AVPacket packet;
 	int result = 1;
 	CImg<uint8_t> next_image;
-	SwsContext *c = sws_getContext(st_info->pCodecCtx->width, st_info->pCodecCtx->height, st_info->pCodecCtx->pix_fmt, st_info->width, st_info->height, ffmpeg_pixfmt , SWS_BICUBIC, NULL, NULL, NULL);
+	SwsContext *c = vfinfo_scaler(st_info, ffmpeg_pixfmt);
+	if (c == NULL){
+	    av_free(buffer);
+	    av_free(pConvertedFrame);
+	    av_free(pFrame);
+	    return -1;
+	}
 	while ((result >= 0) && (size < st_info->nb_retrieval))
 	{
 
@@ -315,8 +323,6 @@ int NextFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList)
 	pConvertedFrame = NULL;
 	av_free(pFrame);
 	pFrame = NULL;
-	sws_freeContext(c);
-	c = NULL;
 	if (result < 0)
 	{
 		avcodec_close(st_info->pCodecCtx);
@@ -330,11 +336,182 @@ int NextFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList)
 	return size; 
 }
 
+float vfinfo_fps(const VFInfo *st_info)
+{
+	if (st_info->pFormatCtx == NULL || st_info->videoStream < 0)
+	    return -1;
+	AVRational rate = st_info->pFormatCtx->streams[st_info->videoStream]->r_frame_rate;
+	if (rate.den == 0)
+	    return -1;
+	return rate.num/rate.den;
+}
+
+/* frame number of a timestamp of the video stream, and back */
+static long vfinfo_frame_of(const VFInfo *st_info, int64_t ts)
+{
+	AVStream *st = st_info->pFormatCtx->streams[st_info->videoStream];
+	AVRational frame_time = { st->r_frame_rate.den, st->r_frame_rate.num };
+	if (st->start_time != AV_NOPTS_VALUE)
+	    ts -= st->start_time;
+	return (long)av_rescale_q(ts, st->time_base, frame_time);
+}
+
+static int64_t vfinfo_timestamp_of(const VFInfo *st_info, long frame)
+{
+	AVStream *st = st_info->pFormatCtx->streams[st_info->videoStream];
+	AVRational frame_time = { st->r_frame_rate.den, st->r_frame_rate.num };
+	int64_t ts = av_rescale_q(frame, frame_time, st->time_base);
+	if (st->start_time != AV_NOPTS_VALUE)
+	    ts += st->start_time;
+	return ts;
+}
+
+int ScanFrames(VFInfo *st_info, int thumb_width, int thumb_height, vf_frame_callback callback, void *arg)
+{
+	PixelFormat ffmpeg_pixfmt;
+	if (st_info->pixelformat == 0)
+	    ffmpeg_pixfmt = PIX_FMT_GRAY8;
+	else 
+	    ffmpeg_pixfmt = PIX_FMT_RGB24;
+	int nb_channels = (ffmpeg_pixfmt == PIX_FMT_GRAY8) ? 1 : 3;
+
+	if (st_info->pFormatCtx == NULL)
+	{
+		if (vfinfo_open(st_info) < 0)
+			return -1;
+		st_info->next_index = 0;
+	}
+	bool thumbs = (thumb_width > 0 && thumb_height > 0);
+
+	AVFrame *pFrame = avcodec_alloc_frame();
+	AVFrame *pConvertedFrame = avcodec_alloc_frame();
+	AVFrame *pThumbFrame = avcodec_alloc_frame();
+	uint8_t *buffer = (uint8_t*)av_malloc(avpicture_get_size(ffmpeg_pixfmt, st_info->width, st_info->height));
+	uint8_t *thumb_buffer = (thumbs) ? (uint8_t*)av_malloc(avpicture_get_size(ffmpeg_pixfmt, thumb_width, thumb_height)) : NULL;
+	SwsContext *c = vfinfo_scaler(st_info, ffmpeg_pixfmt);
+	SwsContext *thumb_c = NULL;
+	if (thumbs)
+	    thumb_c = sws_getContext(st_info->pCodecCtx->width, st_info->pCodecCtx->height, st_info->pCodecCtx->pix_fmt,
+				     thumb_width, thumb_height, ffmpeg_pixfmt, SWS_AREA, NULL, NULL, NULL);
+	int size = -1;
+	if (pFrame && pConvertedFrame && pThumbFrame && buffer && c && (!thumbs || (thumb_buffer && thumb_c)))
+	{
+	    avpicture_fill((AVPicture *)pConvertedFrame,buffer,ffmpeg_pixfmt,st_info->width,st_info->height);
+	    if (thumbs)
+		avpicture_fill((AVPicture *)pThumbFrame,thumb_buffer,ffmpeg_pixfmt,thumb_width,thumb_height);
+
+	    /* the decoder drops the frames that are not needed, and keyframes are only sent
+	       for the samples; frames carry the index of their packet through the decoder */
+	    bool exact = (st_info->sampling == VF_SAMPLE_EXACT);
+	    bool keyframes = (st_info->sampling == VF_SAMPLE_KEYFRAMES);
+	    if (st_info->sampling == VF_SAMPLE_NONREF)
+		st_info->pCodecCtx->skip_frame = AVDISCARD_NONREF;
+	    else if (keyframes)
+		st_info->pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+	    long pick = st_info->next_index;
+	    bool seekable = keyframes;
+
+	    int frameFinished;
+	    AVPacket packet;
+	    int result = 1;
+	    int ret = 0;
+	    bool draining = false;
+	    CImg<uint8_t> next_image, next_thumb;
+	    size = 0;
+	    while (ret >= 0)
+	    {
+		if (!draining)
+		{
+		    result = av_read_frame(st_info->pFormatCtx, &packet); 
+		    if (result < 0)
+		    {
+			/* collect the frames still held by the decoder threads, up to one per thread, and
+			   when not every frame is decoded they may be most of the last seconds */
+			draining = true;
+			av_init_packet(&packet);
+			packet.data = NULL;
+			packet.size = 0;
+			packet.stream_index = st_info->videoStream;
+		    }
+		}
+		if(packet.stream_index == st_info->videoStream) {
+		    bool decode = true;
+		    if (!exact && !draining)
+		    {
+			int64_t ts = (packet.pts != AV_NOPTS_VALUE) ? packet.pts : packet.dts;
+			long index = (ts != AV_NOPTS_VALUE) ? vfinfo_frame_of(st_info, ts) : st_info->current_index;
+			st_info->current_index = index + 1;
+			if (keyframes)
+			{
+			    decode = (packet.flags & AV_PKT_FLAG_KEY) && index >= pick;
+			    if (decode)
+			    {
+				while (pick <= index)
+				    pick += st_info->step;
+				/* jump to the first keyframe at or after the next sample, reading on when the
+				   input cannot seek */
+				if (seekable && pick > index + 1
+				    && av_seek_frame(st_info->pFormatCtx, st_info->videoStream, vfinfo_timestamp_of(st_info, pick), 0) < 0)
+				    seekable = false;
+			    }
+			}
+			st_info->pCodecCtx->reordered_opaque = index;
+		    }
+		    frameFinished = 0;
+		    if (decode)
+			avcodec_decode_video(st_info->pCodecCtx, pFrame, &frameFinished,
+					     packet.data,packet.size);
+		    if(frameFinished) {
+			long index = (exact) ? st_info->current_index : (long)pFrame->reordered_opaque;
+			if (index >= st_info->next_index)
+			{
+			    while (st_info->next_index <= index)
+				st_info->next_index += st_info->step;
+			    sws_scale(c, pFrame->data, pFrame->linesize, 0, st_info->pCodecCtx->height, pConvertedFrame->data, pConvertedFrame->linesize);
+			    next_image.assign(pConvertedFrame->data[0],nb_channels,st_info->width,st_info->height,1,true);
+			    next_image.permute_axes("yzcx");
+			    if (thumbs){
+				sws_scale(thumb_c, pFrame->data, pFrame->linesize, 0, st_info->pCodecCtx->height, pThumbFrame->data, pThumbFrame->linesize);
+				next_thumb.assign(pThumbFrame->data[0],nb_channels,thumb_width,thumb_height,1,true);
+				next_thumb.permute_axes("yzcx");
+			    }
+			    ret = callback(index, next_image, next_thumb, arg);
+			    size++;
+			}
+			if (exact)
+			    st_info->current_index++;
+		    } else if (draining)
+			break;
+		}
+		if (!draining)
+		    av_free_packet(&packet);
+	    }
+	    if (result < 0)
+	    {
+		avcodec_close(st_info->pCodecCtx);
+		avformat_close_input(&st_info->pFormatCtx);
+		st_info->pCodecCtx = NULL;
+		st_info->pFormatCtx = NULL;
+		st_info->pCodec = NULL;
+		st_info->width = -1;
+		st_info->height = -1;
+	    }
+	}
+
+	av_free(buffer);
+	av_free(thumb_buffer);
+	av_free(pConvertedFrame);
+	av_free(pThumbFrame);
+	av_free(pFrame);
+	if (thumb_c)
+	    sws_freeContext(thumb_c);
+	return size;
+}
+
 int GetNumberStreams(const char *file)
 {
-	 AVFormatContext *pFormatCtx;
-	 av_log_set_level(AV_LOG_QUIET);
-	 av_register_all();
+	 AVFormatContext *pFormatCtx = NULL;
+	 vfinfo_init();
 	// Open video file
 	if (avformat_open_input(&pFormatCtx, file, NULL, NULL))
 	  return -1 ; // Couldn't open file
@@ -350,9 +527,8 @@ int GetNumberStreams(const char *file)
 long GetNumberVideoFrames(const char *file)
 {
     long nb_frames = 0L;
-	AVFormatContext *pFormatCtx;
-    av_log_set_level(AV_LOG_QUIET);
-	av_register_all();
+	AVFormatContext *pFormatCtx = NULL;
+	vfinfo_init();
 	// Open video file
 	if (avformat_open_input(&pFormatCtx, file, NULL, NULL))
 	  return -1 ; // Couldn't open file
@@ -393,7 +569,8 @@ long GetNumberVideoFrames(const char *file)
 float fps(const char *filename)
 {
         float result = 0;
-	AVFormatContext *pFormatCtx;
+	AVFormatContext *pFormatCtx = NULL;
+	vfinfo_init();
 	
 	// Open video file
 	if (avformat_open_input(&pFormatCtx, filename, NULL, NULL))
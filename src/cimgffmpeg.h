@@ -42,6 +42,13 @@ extern "C" {
 
 using namespace cimg_library;
 
+/* which frames ScanFrames decodes, the same values as VideoSampling of pHash.h */
+enum {
+    VF_SAMPLE_EXACT = 0,   /* every frame, the sampled frames are exactly every step-th */
+    VF_SAMPLE_NONREF,      /* reference frames only, a sample falls on the next decoded frame */
+    VF_SAMPLE_KEYFRAMES,   /* one keyframe per sample, the first at or after it, seeking past the rest */
+};
+
 typedef struct vf_info {
     int step;
     int nb_retrieval;
@@ -53,16 +60,36 @@ typedef struct vf_info {
     AVFormatContext *pFormatCtx;
     AVCodecContext *pCodecCtx;
     AVCodec *pCodec;
+    SwsContext *pSwsCtx;   /* converter of decoded frames, NULL until first used */
+    int threads;           /* decoder threads, 0 for the number of cpus */
+    int sampling;          /* VF_SAMPLE_*, frames decoded by ScanFrames */
     const char *filename;
 } VFInfo;
 
 void vfinfo_close(VFInfo  *vfinfo);
 
+/* open the file and the decoder of its first video stream, with frame and slice threads,
+   returns < 0 for error */
+int vfinfo_open(VFInfo *st_info);
+
+/* frames per second of the open video, < 0 for error */
+float vfinfo_fps(const VFInfo *st_info);
+
+/* called by ScanFrames with each sampled frame and its thumbnail, stops the scan by returning < 0.
+   Both share buffers of the decoder, and are only valid during the call. */
+typedef int (*vf_frame_callback)(long index, CImg<uint8_t> &frame, CImg<uint8_t> &thumb, void *arg);
+
 int ReadFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList, unsigned int low_index, unsigned int hi_index);
 
 
 int NextFrames(VFInfo *st_info, CImgList<uint8_t> *pFrameList);
 
+/* decode the rest of the video in one pass, passing every step-th frame to callback, at
+   width x height and as a thumb_width x thumb_height thumbnail (none when 0); returns the
+   number of frames passed, < 0 for error. Unless sampling is VF_SAMPLE_EXACT, frames are
+   indexed by their timestamps and some samples may be merged into the next decoded frame. */
+int ScanFrames(VFInfo *st_info, int thumb_width, int thumb_height, vf_frame_callback callback, void *arg);
+
 
 int GetNumberStreams(const char *file);
 
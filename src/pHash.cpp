@@ -24,12 +24,17 @@
 
 #include "config.h"
 #include "pHash.h"
+#include <sys/time.h>
 #undef HAVE_VIDEO_HASH
 
 #ifdef HAVE_VIDEO_HASH
 #include "cimgffmpeg.h"
 #endif
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 
@@ -72,28 +77,135 @@ const char* ph_about(){
 	snprintf(phash_version, sizeof(phash_version), phash_project, PACKAGE_STRING);
 	return phash_version;
 }
+
+/* kernels, windows and bases shared by the hashing functions. Each is built once for its
+   kind and parameters and kept for the life of the process. Entries are only ever pushed
+   onto the front of the list, so lookups walk it without the lock; the lock is taken to
+   build, so no kernel is built twice. */
+typedef struct ph_kernel_entry {
+    int kind;
+    double p0, p1;
+    void *data;
+    struct ph_kernel_entry *next;
+} KernelEntry;
+
+static KernelEntry *kernelCache = NULL;
+/* entries kept of each kind, so that many kernels of one kind (e.g. MH scales) do not
+   crowd out the others; a full kind builds uncached kernels for its callers */
+static const int KernelCacheSize[PH_KERNEL_BARK+1] = { 16, 4, 64, 16, 16 };
+static int kernelCacheCount[PH_KERNEL_BARK+1];
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t kernelCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void* ph_kernel_find(int kind, double p0, double p1){
+    for (KernelEntry *e = __atomic_load_n(&kernelCache, __ATOMIC_ACQUIRE);e;e = e->next){
+	if (e->kind == kind && e->p0 == p0 && e->p1 == p1)
+	    return e->data;
+    }
+    return NULL;
+}
+
+const void* ph_kernel_get(KernelKind kind, double p0, double p1, ph_kernel_builder build, bool &owned){
+    owned = false;
+    void *data = ph_kernel_find(kind, p0, p1);
+    if (data || !build)
+	return data;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&kernelCacheLock);
+#endif
+    data = ph_kernel_find(kind, p0, p1);
+    if (!data && kind >= 0 && kind <= PH_KERNEL_BARK && kernelCacheCount[kind] < KernelCacheSize[kind]){
+	KernelEntry *e = (KernelEntry*)malloc(sizeof(KernelEntry));
+	void *built = (e) ? build(p0, p1) : NULL;
+	if (built){
+	    e->kind = kind;
+	    e->p0 = p0;
+	    e->p1 = p1;
+	    e->data = built;
+	    e->next = kernelCache;
+	    __atomic_store_n(&kernelCache, e, __ATOMIC_RELEASE);
+	    kernelCacheCount[kind]++;
+	    data = built;
+	} else {
+	    free(e);
+	}
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&kernelCacheLock);
+#endif
+    if (!data){
+	data = build(p0, p1);
+	owned = (data != NULL);
+    }
+    return data;
+}
 #ifdef HAVE_IMAGE_HASH
-int ph_radon_projections(const CImg<uint8_t> &img,int N,Projections &projs){
+/* radon line tables - for one image size and number of angles, the source pixel of every
+   cell of the projection map, line by line, as the projection walks the lines. The last
+   few tables are kept and shared between threads, so that images of the same size skip
+   the per pixel line geometry. */
+typedef struct ph_radon_table {
+    int width, height, N, D;
+    int *line_start;    /* N+1 indexes into offs and xs */
+    int *nb_safe;       /* cells of each line at offsets that can be read 4 bytes at a time, these come first */
+    int *offs;          /* source pixel offset of each cell */
+    int *xs;            /* position of each cell along its line */
+    int *nb_pix;        /* pixels counted for each line, a cell written twice counts twice */
+    int cached;         /* set once before the table is shared */
+    int refs;
+    unsigned long last_used;
+} RadonTable;
+
+static const int RadonCacheSize = 8;
+static RadonTable *radonCache[RadonCacheSize];
+static unsigned long radonClock = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t radonCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-    int width = img.width();
-    int height = img.height();
+static void ph_radon_table_free(RadonTable *t){
+    if (!t)
+	return;
+    free(t->line_start);
+    free(t->nb_safe);
+    free(t->offs);
+    free(t->xs);
+    free(t->nb_pix);
+    free(t);
+}
+
+/* walk the lines of the projection, as it was done pixel by pixel, into a table */
+static RadonTable* ph_radon_table_build(int width, int height, int N){
     int D = (width > height)?width:height;
     float x_center = (float)width/2;
     float y_center = (float)height/2;
     int x_off = (int)std::floor(x_center + ROUNDING_FACTOR(x_center));
     int y_off = (int)std::floor(y_center + ROUNDING_FACTOR(y_center));
 
-    projs.R = new CImg<uint8_t>(N,D,1,1,0);
-    projs.nb_pix_perline = (int*)calloc(N,sizeof(int));
-
-    if (!projs.R || !projs.nb_pix_perline)
-	return EXIT_FAILURE;
-
-    projs.size = N;
-
-    CImg<uint8_t> *ptr_radon_map = projs.R;
-    int *nb_per_line = projs.nb_pix_perline;
+    RadonTable *t = (RadonTable*)calloc(1, sizeof(RadonTable));
+    int *map = (int*)malloc((size_t)N*D*sizeof(int));
+    if (!t || !map){
+	free(t);
+	free(map);
+	return NULL;
+    }
+    t->width = width;
+    t->height = height;
+    t->N = N;
+    t->D = D;
+    t->line_start = (int*)malloc((N+1)*sizeof(int));
+    t->nb_safe = (int*)malloc(N*sizeof(int));
+    t->nb_pix = (int*)calloc(N,sizeof(int));
+    if (!t->line_start || !t->nb_safe || !t->nb_pix){
+	free(map);
+	ph_radon_table_free(t);
+	return NULL;
+    }
+    for (size_t i=0;i<(size_t)N*D;i++)
+	map[i] = -1;
 
+    int *nb_per_line = t->nb_pix;
     for (int k=0;k<N/4+1;k++){
         double theta = k*cimg::PI/N;
         double alpha = std::tan(theta);
@@ -101,11 +213,11 @@ int ph_radon_projections(const CImg<uint8_t> &img,int N,Projections &projs){
 	    double y = alpha*(x-x_off);
             int yd = (int)std::floor(y + ROUNDING_FACTOR(y));
             if ((yd + y_off >= 0)&&(yd + y_off < height) && (x < width)){
-		*ptr_radon_map->data(k,x) = img(x,yd + y_off);
+		map[k*D + x] = x + (yd + y_off)*width;
                 nb_per_line[k] += 1;
 	    }
             if ((yd + x_off >= 0) && (yd + x_off < width) && (k != N/4) && (x < height)){
-		*ptr_radon_map->data(N/2-k,x) = img(yd + x_off,x);
+		map[(N/2-k)*D + x] = (yd + x_off) + x*width;
                 nb_per_line[N/2-k] += 1;
 	    }
 	}
@@ -118,67 +230,361 @@ int ph_radon_projections(const CImg<uint8_t> &img,int N,Projections &projs){
 	    double y = alpha*(x-x_off);
             int yd = (int)std::floor(y + ROUNDING_FACTOR(y));
             if ((yd + y_off >= 0)&&(yd + y_off < height) && (x < width)){
-		*ptr_radon_map->data(k,x) = img(x,yd + y_off);
+		map[k*D + x] = x + (yd + y_off)*width;
                 nb_per_line[k] += 1;
 	    }
             if ((y_off - yd >= 0)&&(y_off - yd<width)&&(2*y_off-x>=0)&&(2*y_off-x<height)&&(k!=3*N/4)){
-		*ptr_radon_map->data(k-j,x) = img(-yd+y_off,-(x-y_off)+y_off);
+		map[(k-j)*D + x] = (-yd+y_off) + (-(x-y_off)+y_off)*width;
                 nb_per_line[k-j] += 1;
 	    }
-            
 	}
         j += 2;
     }
 
+    /* keep the cells written, those near the end of the image last */
+    int nbcells = 0;
+    for (size_t i=0;i<(size_t)N*D;i++)
+	nbcells += (map[i] >= 0);
+    t->offs = (int*)malloc((nbcells+1)*sizeof(int));
+    t->xs = (int*)malloc((nbcells+1)*sizeof(int));
+    if (!t->offs || !t->xs){
+	free(map);
+	ph_radon_table_free(t);
+	return NULL;
+    }
+    int last_safe = width*height - 4;
+    int pos = 0;
+    for (int k=0;k<N;k++){
+	const int *line = map + (size_t)k*D;
+	t->line_start[k] = pos;
+	for (int x=0;x<D;x++){
+	    if (line[x] >= 0 && line[x] <= last_safe){
+		t->offs[pos] = line[x];
+		t->xs[pos++] = x;
+	    }
+	}
+	t->nb_safe[k] = pos - t->line_start[k];
+	for (int x=0;x<D;x++){
+	    if (line[x] >= 0 && line[x] > last_safe){
+		t->offs[pos] = line[x];
+		t->xs[pos++] = x;
+	    }
+	}
+    }
+    t->line_start[N] = pos;
+    free(map);
+    return t;
+}
+
+/* the line table for an image size, built if it is not cached - release it with ph_radon_table_release */
+static RadonTable* ph_radon_table_get(int width, int height, int N){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&radonCacheLock);
+#endif
+    RadonTable *t = NULL;
+    for (int i=0;i<RadonCacheSize;i++){
+	RadonTable *c = radonCache[i];
+	if (c && c->width == width && c->height == height && c->N == N){
+	    t = c;
+	    t->refs++;
+	    t->last_used = ++radonClock;
+	    break;
+	}
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&radonCacheLock);
+#endif
+    if (t)
+	return t;
+
+    t = ph_radon_table_build(width, height, N);
+    if (!t)
+	return NULL;
+    t->refs = 1;
+
+    /* take the slot of the least recently used table that is not in use */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&radonCacheLock);
+#endif
+    int slot = -1;
+    for (int i=0;i<RadonCacheSize;i++){
+	RadonTable *c = radonCache[i];
+	if (!c){
+	    slot = i;
+	    break;
+	}
+	if (c->refs == 0 && (slot < 0 || c->last_used < radonCache[slot]->last_used))
+	    slot = i;
+    }
+    if (slot >= 0){
+	ph_radon_table_free(radonCache[slot]);
+	t->cached = 1;
+	t->last_used = ++radonClock;
+	radonCache[slot] = t;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&radonCacheLock);
+#endif
+    return t;
+}
+
+static void ph_radon_table_release(RadonTable *t){
+    if (!t)
+	return;
+    if (!t->cached){
+	ph_radon_table_free(t);
+	return;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&radonCacheLock);
+#endif
+    t->refs--;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&radonCacheLock);
+#endif
+}
+
+/* sum and sum of squares of the pixels of line k */
+static void ph_radon_line_sums(const RadonTable *t, const uint8_t *pixels, int k,
+			       ulong64 &sum, ulong64 &sum_sqd){
+    const int *offs = t->offs + t->line_start[k];
+    int n = t->line_start[k+1] - t->line_start[k];
+    int i = 0;
+    ulong64 s = 0, s2 = 0;
+#ifdef __AVX2__
+    /* gather 8 pixels at a time, as the low byte of 32 bit reads - the squares are
+       summed in 32 bit lanes for at most 32768 rounds before they are widened */
+    const __m256i lowbyte = _mm256_set1_epi32(0xff);
+    int nb_safe = t->nb_safe[k];
+    while (i + 8 <= nb_safe){
+	int end = i + 8*32768;
+	if (end > nb_safe)
+	    end = nb_safe;
+	__m256i vs = _mm256_setzero_si256();
+	__m256i vs2 = _mm256_setzero_si256();
+	for (;i + 8 <= end;i += 8){
+	    __m256i idx = _mm256_loadu_si256((const __m256i*)(offs + i));
+	    __m256i v = _mm256_and_si256(_mm256_i32gather_epi32((const int*)pixels, idx, 1), lowbyte);
+	    vs = _mm256_add_epi32(vs, v);
+	    vs2 = _mm256_add_epi32(vs2, _mm256_mullo_epi32(v, v));
+	}
+	uint32_t lanes[8], lanes2[8];
+	_mm256_storeu_si256((__m256i*)lanes, vs);
+	_mm256_storeu_si256((__m256i*)lanes2, vs2);
+	for (int l=0;l<8;l++){
+	    s += lanes[l];
+	    s2 += lanes2[l];
+	}
+    }
+#endif
+    for (;i<n;i++){
+	uint32_t v = pixels[offs[i]];
+	s += v;
+	s2 += v*v;
+    }
+    sum = s;
+    sum_sqd = s2;
+}
+
+/* normalized feature vector from the line sums - the same arithmetic as ph_feature_vector */
+static void ph_radon_features(const double *line_sums, const double *line_sums_sqd,
+			      const int *nb_perline, int N, double *feat_v){
+    double sum = 0.0;
+    double sum_sqd = 0.0;
+    for (int k=0; k < N; k++){
+	double line_sum = line_sums[k];
+	double line_sum_sqd = line_sums_sqd[k];
+	int nb_pixels = nb_perline[k];
+	feat_v[k] = (line_sum_sqd/nb_pixels) - (line_sum*line_sum)/(nb_pixels*nb_pixels);
+	sum += feat_v[k];
+	sum_sqd += feat_v[k]*feat_v[k];
+    }
+    double mean = sum/N;
+    double var  = sqrt((sum_sqd/N) - (sum*sum)/(N*N));
+
+    for (int i=0;i<N;i++){
+	feat_v[i] = (feat_v[i] - mean)/var;
+    }
+}
+
+/* buffers for the digests made on one thread, grown to the largest number of angles seen */
+typedef struct ph_radon_workspace {
+    int N;
+    double *line_sums;      /* N sums, then N sums of squares */
+    double *features;       /* N */
+    CImg<uint8_t> gray;     /* luma of the image being hashed */
+} RadonWorkspace;
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t radonWorkspaceKey;
+static pthread_once_t radonWorkspaceOnce = PTHREAD_ONCE_INIT;
+
+static void ph_radon_workspace_free(void *p){
+    RadonWorkspace *ws = (RadonWorkspace*)p;
+    free(ws->line_sums);
+    free(ws->features);
+    delete ws;
+}
+
+static void ph_radon_workspace_key(){
+    pthread_key_create(&radonWorkspaceKey, ph_radon_workspace_free);
+}
+#else
+static RadonWorkspace *radonWorkspace = NULL;
+#endif
+
+/* the workspace of the calling thread, with room for N angles */
+static RadonWorkspace* ph_radon_workspace(int N){
+#ifdef HAVE_PTHREAD
+    pthread_once(&radonWorkspaceOnce, ph_radon_workspace_key);
+    RadonWorkspace *ws = (RadonWorkspace*)pthread_getspecific(radonWorkspaceKey);
+#else
+    RadonWorkspace *ws = radonWorkspace;
+#endif
+    if (!ws){
+	ws = new RadonWorkspace;
+	ws->N = 0;
+	ws->line_sums = NULL;
+	ws->features = NULL;
+#ifdef HAVE_PTHREAD
+	if (pthread_setspecific(radonWorkspaceKey, ws) != 0){
+	    delete ws;
+	    return NULL;
+	}
+#else
+	radonWorkspace = ws;
+#endif
+    }
+    if (ws->N < N){
+	double *line_sums = (double*)realloc(ws->line_sums, 2*N*sizeof(double));
+	if (!line_sums)
+	    return NULL;
+	ws->line_sums = line_sums;
+	double *features = (double*)realloc(ws->features, N*sizeof(double));
+	if (!features)
+	    return NULL;
+	ws->features = features;
+	ws->N = N;
+    }
+    return ws;
+}
+
+/* feature vector straight from the image, without the projection map
+   line_sums - room for 2*N sums */
+static int ph_radon_feature_vector(const CImg<uint8_t> &img, int N, double *feat_v, double *line_sums){
+    RadonTable *t = ph_radon_table_get(img.width(), img.height(), N);
+    if (!t)
+	return -1;
+    double *line_sums_sqd = line_sums + N;
+    const uint8_t *pixels = img.data();
+    for (int k=0;k<N;k++){
+	ulong64 s, s2;
+	ph_radon_line_sums(t, pixels, k, s, s2);
+	line_sums[k] = (double)s;
+	line_sums_sqd[k] = (double)s2;
+    }
+    ph_radon_features(line_sums, line_sums_sqd, t->nb_pix, N, feat_v);
+    ph_radon_table_release(t);
+    return 0;
+}
+
+int ph_radon_projections(const CImg<uint8_t> &img,int N,Projections &projs){
+
+    int width = img.width();
+    int height = img.height();
+    int D = (width > height)?width:height;
+
+    projs.R = new CImg<uint8_t>(N,D,1,1,0);
+    projs.nb_pix_perline = (int*)calloc(N,sizeof(int));
+
+    if (!projs.R || !projs.nb_pix_perline)
+	return EXIT_FAILURE;
+
+    projs.size = N;
+
+    RadonTable *t = ph_radon_table_get(width, height, N);
+    if (!t)
+	return EXIT_FAILURE;
+
+    CImg<uint8_t> *ptr_radon_map = projs.R;
+    const uint8_t *pixels = img.data();
+    memcpy(projs.nb_pix_perline, t->nb_pix, N*sizeof(int));
+    for (int k=0;k<N;k++){
+	for (int i=t->line_start[k];i<t->line_start[k+1];i++){
+	    *ptr_radon_map->data(k,t->xs[i]) = pixels[t->offs[i]];
+	}
+    }
+    ph_radon_table_release(t);
+
     return EXIT_SUCCESS;
 
 }
 int ph_feature_vector(const Projections &projs, Features &fv)
 {
 
-    CImg<uint8_t> *ptr_map = projs.R;
-    CImg<uint8_t> projection_map = *ptr_map;
+    const CImg<uint8_t> &projection_map = *projs.R;
     int *nb_perline = projs.nb_pix_perline;
     int N = projs.size;
     int D = projection_map.height();
 
     fv.features = (double*)malloc(N*sizeof(double));
     fv.size = N;
-    if (!fv.features)
+    RadonWorkspace *ws = ph_radon_workspace(N);
+    if (!fv.features || !ws)
 	return EXIT_FAILURE;
 
-    double *feat_v = fv.features;
-    double sum = 0.0;
-    double sum_sqd = 0.0;
-    for (int k=0; k < N; k++){
-	double line_sum = 0.0;
-        double line_sum_sqd = 0.0;
-        int nb_pixels = nb_perline[k];
-	for (int i=0;i<D;i++){
-	    line_sum += projection_map(k,i);
-    	    line_sum_sqd += projection_map(k,i)*projection_map(k,i);
-	}
-	feat_v[k] = (line_sum_sqd/nb_pixels) - (line_sum*line_sum)/(nb_pixels*nb_pixels);
-        sum += feat_v[k];
-        sum_sqd += feat_v[k]*feat_v[k];
+    /* the map is N wide, sum it a row at a time */
+    double *line_sums = ws->line_sums;
+    double *line_sums_sqd = ws->line_sums + N;
+    for (int k=0;k<N;k++){
+	line_sums[k] = 0.0;
+	line_sums_sqd[k] = 0.0;
     }
-    double mean = sum/N;
-    double var  = sqrt((sum_sqd/N) - (sum*sum)/(N*N));
-
-    for (int i=0;i<N;i++){
-    	feat_v[i] = (feat_v[i] - mean)/var;
+    for (int i=0;i<D;i++){
+	const uint8_t *row = projection_map.data(0,i);
+	for (int k=0;k<N;k++){
+	    line_sums[k] += row[k];
+	    line_sums_sqd[k] += row[k]*row[k];
+	}
     }
+    ph_radon_features(line_sums, line_sums_sqd, nb_perline, N, fv.features);
 
     return EXIT_SUCCESS;
 } 
-int ph_dct(const Features &fv,Digest &digest)
+/* cosine table of the dct, cos(PI*(2n+1)k/2N) for n < N and k < nb_coeffs, stored
+   with k fastest */
+static void* ph_dct_table_build(double p0, double p1){
+    int N = (int)p0, nb_coeffs = (int)p1;
+    double *cosines = (double*)malloc((size_t)N*nb_coeffs*sizeof(double));
+    if (!cosines)
+	return NULL;
+    for (int n=0;n<N;n++){
+	for (int k=0;k<nb_coeffs;k++){
+	    cosines[n*nb_coeffs + k] = cos((cimg::PI*(2*n+1)*k)/(2*N));
+	}
+    }
+    return cosines;
+}
+
+int ph_dct(const Features &fv,Digest &digest,int nb_coeffs)
 {
     int N = fv.size;
-    const int nb_coeffs = 40;
+    digest.coeffs = NULL;
+    digest.size = 0;
+    if (N <= 0 || nb_coeffs <= 0 || nb_coeffs > MaxDigestCoeffs)
+	return EXIT_FAILURE;
+
+    bool owned;
+    const double *cosines = (const double*)ph_kernel_get(PH_KERNEL_DCT_TABLE, N, nb_coeffs, ph_dct_table_build, owned);
+    if (!cosines)
+	return EXIT_FAILURE;
 
     digest.coeffs = (uint8_t*)malloc(nb_coeffs*sizeof(uint8_t));
-    if (!digest.coeffs)
+    if (!digest.coeffs){
+	if (owned)
+	    free((double*)cosines);
 	return EXIT_FAILURE;
+    }
 
     digest.size = nb_coeffs;
 
@@ -186,19 +592,28 @@ int ph_dct(const Features &fv,Digest &digest)
 
     uint8_t *D = digest.coeffs;
 
+    /* all the coefficients are summed together, each still in order of n, so the
+       inner loop runs over independent sums */
     double D_temp[nb_coeffs];
+    for (int k=0;k<nb_coeffs;k++)
+	D_temp[k] = 0.0;
+    for (int n=0;n<N;n++){
+	const double *c = cosines + n*nb_coeffs;
+	double r = R[n];
+	for (int k=0;k<nb_coeffs;k++){
+	    D_temp[k] += r*c[k];
+	}
+    }
+    if (owned)
+	free((double*)cosines);
+
     double max = 0.0;
     double min = 0.0;
     for (int k = 0;k<nb_coeffs;k++){
-	double sum = 0.0;
-        for (int n=0;n<N;n++){
-	    double temp = R[n]*cos((cimg::PI*(2*n+1)*k)/(2*N));
-            sum += temp;
-	}
         if (k == 0)
-	    D_temp[k] = sum/sqrt((double)N);
+	    D_temp[k] = D_temp[k]/sqrt((double)N);
         else
-            D_temp[k] = sum*SQRT_TWO/sqrt((double)N);
+            D_temp[k] = D_temp[k]*SQRT_TWO/sqrt((double)N);
         if (D_temp[k] > max)
             max = D_temp[k];
         if (D_temp[k] < min)
@@ -214,53 +629,205 @@ int ph_dct(const Features &fv,Digest &digest)
     return EXIT_SUCCESS;
 }
 
+/* mean centered coefficients of a digest, returns their sum of squares
+   xc - room for x.size values, repeated once more after the first x.size when twice is set */
+static double ph_digest_center(const Digest &x, double *xc, bool twice){
+    int N = x.size;
+    double sum = 0.0;
+    for (int i=0;i<N;i++)
+	sum += x.coeffs[i];
+    double mean = sum/N;
+    double den = 0.0;
+    for (int i=0;i<N;i++){
+	xc[i] = x.coeffs[i] - mean;
+	den += xc[i]*xc[i];
+    }
+    if (twice)
+	memcpy(xc + N, xc, N*sizeof(double));
+    return den;
+}
+
+/* peak of the circular cross correlation of centered series xc and yc, with yy holding
+   yc twice over so that lag d reads N values from yy+N-d, norm is sqrt(denx*deny) */
+static double ph_crosscorr_peak(const double *xc, const double *yy, int N, double norm){
+    if (norm == 0.0)
+	return 0.0;
+    double max = 0.0;
+    for (int d=0;d<N;d++){
+	const double *yd = yy + N - d;
+	double num0 = 0.0, num1 = 0.0, num2 = 0.0, num3 = 0.0;
+	int i = 0;
+	for (;i+4<=N;i+=4){
+	    num0 += xc[i]*yd[i];
+	    num1 += xc[i+1]*yd[i+1];
+	    num2 += xc[i+2]*yd[i+2];
+	    num3 += xc[i+3]*yd[i+3];
+	}
+	for (;i<N;i++)
+	    num0 += xc[i]*yd[i];
+	double r = ((num0 + num1) + (num2 + num3))/norm;
+	if (r > max)
+	    max = r;
+    }
+    return max;
+}
+
 int ph_crosscorr(const Digest &x,const Digest &y,double &pcc,double threshold){
 
     int N = y.size;
-    int result = 0;
+    if (N <= 0 || N > MaxDigestCoeffs || x.size != N || !x.coeffs || !y.coeffs)
+	return -1;
+
+    double xc[N];
+    double yy[2*N];
+    double denx = ph_digest_center(x, xc, false);
+    double deny = ph_digest_center(y, yy, true);
+    pcc = ph_crosscorr_peak(xc, yy, N, sqrt(denx*deny));
+
+    return (pcc > threshold) ? 1 : 0;
+}
+
+int ph_crosscorr_many(const Digest &x, const Digest *ys, int count, double *pcc, double threshold){
 
-    uint8_t *x_coeffs = x.coeffs;
-    uint8_t *y_coeffs = y.coeffs;
+    int N = x.size;
+    if (N <= 0 || N > MaxDigestCoeffs || !x.coeffs || count < 0 || (count > 0 && (!ys || !pcc)))
+	return -1;
 
-    double *r = new double[N];
-    double sumx = 0.0;
-    double sumy = 0.0;
-    for (int i=0;i < N;i++){
-	sumx += x_coeffs[i];
-        sumy += y_coeffs[i];
+    double xc[N];
+    double yy[2*N];
+    double denx = ph_digest_center(x, xc, false);
+    int nbmatches = 0;
+    for (int j=0;j<count;j++){
+	if (ys[j].size != N || !ys[j].coeffs){
+	    pcc[j] = 0.0;
+	    continue;
+	}
+	double deny = ph_digest_center(ys[j], yy, true);
+	pcc[j] = ph_crosscorr_peak(xc, yy, N, sqrt(denx*deny));
+	if (pcc[j] > threshold)
+	    nbmatches++;
     }
-    double meanx = sumx/N;
-    double meany = sumy/N;
-    double max = 0;
+    return nbmatches;
+}
+
+int ph_prepare_digest(const Digest &digest, PreparedDigest &prepared){
+    prepared.size = 0;
+    prepared.coeffs = NULL;
+    int N = digest.size;
+    if (N <= 0 || N > MaxDigestCoeffs || !digest.coeffs)
+	return -1;
+    float *coeffs = (float*)malloc(N*sizeof(float));
+    if (!coeffs)
+	return -1;
+
+    double xc[N];
+    double den = ph_digest_center(digest, xc, false);
+    double scale = (den > 0.0) ? 1.0/sqrt(den) : 0.0;
+    for (int i=0;i<N;i++)
+	coeffs[i] = (float)(xc[i]*scale);
+    prepared.size = N;
+    prepared.coeffs = coeffs;
+    return 0;
+}
+
+void ph_free_prepared_digest(PreparedDigest &prepared){
+    free((float*)prepared.coeffs);
+    prepared.coeffs = NULL;
+    prepared.size = 0;
+}
+
+/* peak over the lags of the dot product of unit norm series x and y rotated by the lag */
+static double ph_prepared_peak(const float *x, const float *y, int N){
+    float yy[2*N];
+    memcpy(yy, y, N*sizeof(float));
+    memcpy(yy + N, y, N*sizeof(float));
+    float max = 0.0f;
     for (int d=0;d<N;d++){
-        double num = 0.0;
-        double denx = 0.0;
-        double deny = 0.0;
-	for (int i=0;i<N;i++){
-	    num  += (x_coeffs[i]-meanx)*(y_coeffs[(N+i-d)%N]-meany);
-            denx += pow((x_coeffs[i]-meanx),2);
-            deny += pow((y_coeffs[(N+i-d)%N]-meany),2);
-	}
-        r[d] = num/sqrt(denx*deny);
-        if (r[d] > max)
-	    max = r[d];
-    }
-    delete[] r;
-    pcc = max;
-    if (max > threshold)
-	    result = 1;
+	const float *yd = yy + N - d;
+	float num0 = 0.0f, num1 = 0.0f, num2 = 0.0f, num3 = 0.0f;
+	int i = 0;
+	for (;i+4<=N;i+=4){
+	    num0 += x[i]*yd[i];
+	    num1 += x[i+1]*yd[i+1];
+	    num2 += x[i+2]*yd[i+2];
+	    num3 += x[i+3]*yd[i+3];
+	}
+	for (;i<N;i++)
+	    num0 += x[i]*yd[i];
+	float r = (num0 + num1) + (num2 + num3);
+	if (r > max)
+	    max = r;
+    }
+    return max;
+}
 
-    return result;
+int ph_crosscorr_prepared(const PreparedDigest &x, const PreparedDigest &y, double &pcc, double threshold){
+    int N = x.size;
+    if (N <= 0 || N > MaxDigestCoeffs || y.size != N || !x.coeffs || !y.coeffs)
+	return -1;
+    pcc = ph_prepared_peak(x.coeffs, y.coeffs, N);
+    return (pcc > threshold) ? 1 : 0;
+}
+
+int ph_crosscorr_prepared_many(const PreparedDigest &x, const float *coeffs, int count, double *pcc,
+			       double threshold){
+    int N = x.size;
+    if (N <= 0 || N > MaxDigestCoeffs || !x.coeffs || count < 0 || (count > 0 && (!coeffs || !pcc)))
+	return -1;
+    int nbmatches = 0;
+    for (int j=0;j<count;j++){
+	pcc[j] = ph_prepared_peak(x.coeffs, coeffs + (size_t)j*N, N);
+	if (pcc[j] > threshold)
+	    nbmatches++;
+    }
+    return nbmatches;
+}
+
+int ph_save_prepared_digests(const char *filename, const PreparedDigest *digests, int count,
+			     const ulong64 *ids, const char *const *names){
+    if (!filename || count <= 0 || !digests)
+	return -1;
+    int N = digests[0].size;
+    if (N <= 0 || N > MaxDigestCoeffs)
+	return -1;
+    float *coeffs = (float*)malloc((size_t)count*N*sizeof(float));
+    if (!coeffs)
+	return -1;
+    for (int j=0;j<count;j++){
+	if (digests[j].size != N || !digests[j].coeffs){
+	    free(coeffs);
+	    return -1;
+	}
+	memcpy(coeffs + (size_t)j*N, digests[j].coeffs, N*sizeof(float));
+    }
+    int ret = ph_phx_save(filename, coeffs, N*sizeof(float), ids, names, count);
+    free(coeffs);
+    return ret;
+}
+
+int ph_phx_prepared_digest(const PHXFile *phx, ulong64 i, PreparedDigest &prepared){
+    prepared.size = 0;
+    prepared.coeffs = NULL;
+    if (!phx || i >= phx->count || phx->hash_width % sizeof(float) != 0
+	|| phx->hash_width > MaxDigestCoeffs*sizeof(float))
+	return -1;
+    prepared.size = phx->hash_width/sizeof(float);
+    prepared.coeffs = (const float*)(phx->hashes + i*phx->hash_width);
+    return 0;
 }
 
 #ifdef max
 #undef max
 #endif
 
-int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double gamma,Digest &digest, int N){
+int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double /* gamma */,Digest &digest, int N, int nb_coeffs){
     
-    int result = EXIT_FAILURE;
-    CImg<uint8_t> graysc;
+    digest.coeffs = NULL;
+    digest.size = 0;
+    RadonWorkspace *ws = ph_radon_workspace(N);
+    if (!ws)
+	return EXIT_FAILURE;
+    CImg<uint8_t> &graysc = ws->gray;
     if (img.spectrum() >= 3){
 	graysc = img.get_RGBtoYCbCr().channel(0);
     }
@@ -268,44 +835,33 @@ int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double gamma,Digest
 	graysc = img;
     }
     else {
-	return result;
+	return EXIT_FAILURE;
     }
 	
  
     graysc.blur((float)sigma);
  
-    (graysc/graysc.max()).pow(gamma);
-     
-    Projections projs;
-    if (ph_radon_projections(graysc,N,projs) < 0)
-	goto cleanup;
- 
     Features features;
-    if (ph_feature_vector(projs,features) < 0)
-	goto cleanup;
+    features.features = ws->features;
+    features.size = N;
+    if (ph_radon_feature_vector(graysc,N,features.features,ws->line_sums) < 0)
+	return EXIT_FAILURE;
     
-    if (ph_dct(features,digest) < 0)
-        goto cleanup;
+    if (ph_dct(features,digest,nb_coeffs) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
  
-    result = EXIT_SUCCESS;
-
-cleanup:
-    free(projs.nb_pix_perline);
-    free(features.features);
-
-    delete projs.R;
-    return result;
+    return EXIT_SUCCESS;
 }
 
 #define max(a,b) (((a)>(b))?(a):(b))
 
-int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest, int N){
+int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest, int N, int nb_coeffs){
     
     CImg<uint8_t> *src = new CImg<uint8_t>(file);
 	int res = -1;
 	if(src)
 	{
-    		int result = _ph_image_digest(*src,sigma,gamma,digest,N);
+    		int result = _ph_image_digest(*src,sigma,gamma,digest,N,nb_coeffs);
 		delete src;
     		res = result;
 	}
@@ -315,12 +871,13 @@ int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest
 int _ph_compare_images(const CImg<uint8_t> &imA,const CImg<uint8_t> &imB,double &pcc, double sigma, double gamma,int N,double threshold){
 
     int result = 0;
-    Digest digestA;
-    if (_ph_image_digest(imA,sigma,gamma,digestA,N) < 0)
+    Digest digestA, digestB;
+    digestA.coeffs = NULL;
+    digestB.coeffs = NULL;
+    if (_ph_image_digest(imA,sigma,gamma,digestA,N) != EXIT_SUCCESS)
 	goto cleanup;
 
-    Digest digestB;
-    if (_ph_image_digest(imB,sigma,gamma,digestB,N) < 0)
+    if (_ph_image_digest(imB,sigma,gamma,digestB,N) != EXIT_SUCCESS)
 	goto cleanup;
 
     if (ph_crosscorr(digestA,digestB,pcc,threshold) < 0)
@@ -348,50 +905,381 @@ int ph_compare_images(const char *file1, const char *file2,double &pcc, double s
     return res;
 }
 
-CImg<float>* ph_dct_matrix(const int N){
-    CImg<float> *ptr_matrix = new CImg<float>(N,N,1,1,1/sqrt((float)N));
-    const float c1 = sqrt(2.0/N); 
-    for (int x=0;x<N;x++){
-	for (int y=1;y<N;y++){
-	    *ptr_matrix->data(x,y) = c1*cos((cimg::PI/2/N)*y*(2*x+1));
-	}
-    }
-    return ptr_matrix;
-}
-
-int ph_dct_imagehash(const char* file,ulong64 &hash){
-
-    if (!file){
+/* digest an image file, with coeffs left NULL when it cannot be loaded or digested */
+static int ph_image_digest_file(const char *file, double sigma, double gamma, int N, Digest &digest){
+    digest.id = NULL;
+    digest.coeffs = NULL;
+    digest.size = 0;
+    if (!file)
 	return -1;
-    }
     CImg<uint8_t> src;
     try {
 	src.load(file);
     } catch (CImgIOException ex){
 	return -1;
     }
-    CImg<float> meanfilter(7,7,1,1,1);
-    CImg<float> img;
-    if (src.spectrum() == 3){
-        img = src.RGBtoYCbCr().channel(0).get_convolve(meanfilter);
-    } else if (src.spectrum() == 4){
-	int width = img.width();
-        int height = img.height();
-        int depth = img.depth();
-	img = src.crop(0,0,0,0,width-1,height-1,depth-1,2).RGBtoYCbCr().channel(0).get_convolve(meanfilter);
-    } else {
-	img = src.channel(0).get_convolve(meanfilter);
+    if (_ph_image_digest(src,sigma,gamma,digest,N) != EXIT_SUCCESS){
+	free(digest.coeffs);
+	digest.coeffs = NULL;
+	digest.size = 0;
+	return -1;
     }
+    return 0;
+}
 
-    img.resize(32,32);
-    CImg<float> *C  = ph_dct_matrix(32);
-    CImg<float> Ctransp = C->get_transpose();
-
-    CImg<float> dctImage = (*C)*img*Ctransp;
-
-    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');;
-   
-    float median = subsec.median();
+/* a batch of images shared by the digest threads, each thread takes the next image in turn */
+typedef struct ph_digest_job {
+    char **files;
+    int count;
+    int next;
+    int nbdone;
+    double sigma;
+    double gamma;
+    int N;
+    Digest *digests;
+    ph_digest_callback callback;
+    void *arg;
+    /* compare mode: prepared digest of each file against the query */
+    DigestCache *cache;
+    const PreparedDigest *query;
+    double *pcc;
+    double threshold;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} DigestJob;
+
+static void *ph_digest_thread(void *p){
+    DigestJob *job = (DigestJob*)p;
+    int i;
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count){
+	if (job->cache){
+	    PreparedDigest prepared;
+	    double pcc = 0.0;
+	    if (ph_digest_cache_get(job->cache, job->files[i], prepared) == 0
+		&& ph_crosscorr_prepared(*(job->query), prepared, pcc, job->threshold) == 1){
+		__sync_fetch_and_add(&job->nbdone, 1);
+	    }
+	    job->pcc[i] = pcc;
+	    continue;
+	}
+	Digest digest;
+	if (ph_image_digest_file(job->files[i], job->sigma, job->gamma, job->N, digest) == 0){
+	    digest.id = strdup(job->files[i]);
+	    __sync_fetch_and_add(&job->nbdone, 1);
+	}
+	if (job->callback){
+#ifdef HAVE_PTHREAD
+	    pthread_mutex_lock(&job->lock);
+#endif
+	    job->callback(i, digest.coeffs ? &digest : NULL, job->arg);
+#ifdef HAVE_PTHREAD
+	    pthread_mutex_unlock(&job->lock);
+#endif
+	}
+	if (job->digests){
+	    job->digests[i] = digest;
+	} else {
+	    free(digest.id);
+	    free(digest.coeffs);
+	}
+    }
+    return NULL;
+}
+
+/* run the job over the files, returns the number of files done */
+static int ph_digest_run(DigestJob *job, int threads){
+    job->next = 0;
+    job->nbdone = 0;
+    int num_threads = 1;
+#ifdef HAVE_PTHREAD
+    num_threads = (threads > 0) ? threads : ph_num_threads();
+#endif
+    if (num_threads > job->count){
+	num_threads = job->count;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&job->lock, NULL);
+    if (num_threads > 1){
+	pthread_t thds[num_threads];
+	int started[num_threads];
+	for (int n=1;n<num_threads;n++){
+	    started[n] = (pthread_create(&thds[n], NULL, ph_digest_thread, job) == 0);
+	}
+	/* the caller is worker 0, and also picks up files left by threads that failed to start */
+	ph_digest_thread(job);
+	for (int n=1;n<num_threads;n++){
+	    if (started[n]){
+		pthread_join(thds[n], NULL);
+	    }
+	}
+    } else {
+	ph_digest_thread(job);
+    }
+    pthread_mutex_destroy(&job->lock);
+#else
+    ph_digest_thread(job);
+#endif
+    return job->nbdone;
+}
+
+int ph_image_digests(char *files[], int count, Digest *digests, ph_digest_callback callback, void *arg,
+		     double sigma, double gamma, int N, int threads){
+    if (!files || count <= 0 || (!digests && !callback))
+	return -1;
+    DigestJob job;
+    memset(&job, 0, sizeof(job));
+    job.files = files;
+    job.count = count;
+    job.sigma = sigma;
+    job.gamma = gamma;
+    job.N = N;
+    job.digests = digests;
+    job.callback = callback;
+    job.arg = arg;
+    return ph_digest_run(&job, threads);
+}
+
+/* FNV-1a hash of a file name, for the digest cache slots */
+static ulong64 ph_digest_cache_hash(const char *file){
+    ulong64 h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char*)file;*c;c++){
+	h ^= *c;
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* slot of file in the cache table, or the empty slot where it goes */
+static int ph_digest_cache_slot(const DigestCache *cache, const char *file){
+    int mask = cache->capacity - 1;
+    int slot = (int)(ph_digest_cache_hash(file) & mask);
+    while (cache->files[slot] && strcmp(cache->files[slot], file) != 0){
+	slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+int ph_digest_cache_init(DigestCache *cache, double sigma, double gamma, int N){
+    if (!cache || N <= 0)
+	return -1;
+    cache->sigma = sigma;
+    cache->gamma = gamma;
+    cache->N = N;
+    cache->count = 0;
+    cache->capacity = 64;
+    cache->files = (char**)calloc(cache->capacity, sizeof(char*));
+    cache->digests = (PreparedDigest*)calloc(cache->capacity, sizeof(PreparedDigest));
+    if (!cache->files || !cache->digests){
+	free(cache->files);
+	free(cache->digests);
+	cache->files = NULL;
+	cache->digests = NULL;
+	return -1;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+    return 0;
+}
+
+void ph_digest_cache_free(DigestCache *cache){
+    if (!cache || !cache->files)
+	return;
+    for (int i=0;i<cache->capacity;i++){
+	if (cache->files[i]){
+	    free(cache->files[i]);
+	    ph_free_prepared_digest(cache->digests[i]);
+	}
+    }
+    free(cache->files);
+    free(cache->digests);
+    cache->files = NULL;
+    cache->digests = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&cache->lock);
+#endif
+}
+
+/* double the table, called with the lock held */
+static int ph_digest_cache_grow(DigestCache *cache){
+    DigestCache grown = *cache;
+    grown.capacity = 2*cache->capacity;
+    grown.files = (char**)calloc(grown.capacity, sizeof(char*));
+    grown.digests = (PreparedDigest*)calloc(grown.capacity, sizeof(PreparedDigest));
+    if (!grown.files || !grown.digests){
+	free(grown.files);
+	free(grown.digests);
+	return -1;
+    }
+    for (int i=0;i<cache->capacity;i++){
+	if (cache->files[i]){
+	    int slot = ph_digest_cache_slot(&grown, cache->files[i]);
+	    grown.files[slot] = cache->files[i];
+	    grown.digests[slot] = cache->digests[i];
+	}
+    }
+    free(cache->files);
+    free(cache->digests);
+    cache->files = grown.files;
+    cache->digests = grown.digests;
+    cache->capacity = grown.capacity;
+    return 0;
+}
+
+int ph_digest_cache_get(DigestCache *cache, const char *file, PreparedDigest &prepared){
+    prepared.coeffs = NULL;
+    prepared.size = 0;
+    if (!cache || !cache->files || !file)
+	return -1;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&cache->lock);
+#endif
+    int slot = ph_digest_cache_slot(cache, file);
+    if (cache->files[slot])
+	prepared = cache->digests[slot];
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&cache->lock);
+#endif
+    if (prepared.coeffs)
+	return 0;
+
+    /* digest outside the lock, so other files can be looked up meanwhile */
+    Digest digest;
+    if (ph_image_digest_file(file, cache->sigma, cache->gamma, cache->N, digest) < 0)
+	return -1;
+    PreparedDigest made;
+    int ret = ph_prepare_digest(digest, made);
+    free(digest.coeffs);
+    if (ret < 0)
+	return -1;
+    char *name = strdup(file);
+    if (!name){
+	ph_free_prepared_digest(made);
+	return -1;
+    }
+
+    ret = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&cache->lock);
+#endif
+    slot = ph_digest_cache_slot(cache, file);
+    if (!cache->files[slot] && 2*(cache->count + 1) > cache->capacity){
+	if (ph_digest_cache_grow(cache) < 0)
+	    ret = -1;
+	slot = ph_digest_cache_slot(cache, file);
+    }
+    if (cache->files[slot]){
+	/* another thread got there first, its digest is kept */
+	prepared = cache->digests[slot];
+	ph_free_prepared_digest(made);
+	free(name);
+    } else if (ret == 0){
+	cache->files[slot] = name;
+	cache->digests[slot] = made;
+	cache->count++;
+	prepared = made;
+    } else {
+	ph_free_prepared_digest(made);
+	free(name);
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&cache->lock);
+#endif
+    return ret;
+}
+
+int ph_compare_images_cached(DigestCache *cache, const char *file1, const char *file2, double &pcc,
+			     double threshold){
+    PreparedDigest x, y;
+    if (ph_digest_cache_get(cache, file1, x) < 0 || ph_digest_cache_get(cache, file2, y) < 0)
+	return -1;
+    return ph_crosscorr_prepared(x, y, pcc, threshold);
+}
+
+int ph_compare_image_many(DigestCache *cache, const char *file, char *files[], int count, double *pcc,
+			  double threshold, int threads){
+    if (count < 0 || (count > 0 && (!files || !pcc)))
+	return -1;
+    PreparedDigest query;
+    if (ph_digest_cache_get(cache, file, query) < 0)
+	return -1;
+    if (count == 0)
+	return 0;
+    DigestJob job;
+    memset(&job, 0, sizeof(job));
+    job.files = files;
+    job.count = count;
+    job.cache = cache;
+    job.query = &query;
+    job.pcc = pcc;
+    job.threshold = threshold;
+    return ph_digest_run(&job, threads);
+}
+
+CImg<float>* ph_dct_matrix(const int N){
+    CImg<float> *ptr_matrix = new CImg<float>(N,N,1,1,1/sqrt((float)N));
+    const float c1 = sqrt(2.0/N); 
+    for (int x=0;x<N;x++){
+	for (int y=1;y<N;y++){
+	    *ptr_matrix->data(x,y) = c1*cos((cimg::PI/2/N)*y*(2*x+1));
+	}
+    }
+    return ptr_matrix;
+}
+
+/* the dct matrix of ph_dct_matrix followed by its transpose */
+static void* ph_dct_matrix_build(double p0, double /* p1 */){
+    int N = (int)p0;
+    float *matrices = (float*)malloc(2*(size_t)N*N*sizeof(float));
+    if (!matrices)
+	return NULL;
+    CImg<float> *C = ph_dct_matrix(N);
+    float *transp = matrices + N*N;
+    for (int y=0;y<N;y++){
+	for (int x=0;x<N;x++){
+	    matrices[y*N + x] = (*C)(x,y);
+	    transp[x*N + y] = (*C)(x,y);
+	}
+    }
+    delete C;
+    return matrices;
+}
+
+int _ph_dct_imagehash(const CImg<uint8_t> &src,ulong64 &hash){
+
+    CImg<float> meanfilter(7,7,1,1,1);
+    CImg<float> img;
+    if (src.spectrum() == 3){
+        img = src.get_RGBtoYCbCr().channel(0).get_convolve(meanfilter);
+    } else if (src.spectrum() == 4){
+	int width = src.width();
+        int height = src.height();
+        int depth = src.depth();
+	CImg<uint8_t> rgb(src);
+	img = rgb.crop(0,0,0,0,width-1,height-1,depth-1,2).RGBtoYCbCr().channel(0).get_convolve(meanfilter);
+    } else {
+	img = src.get_channel(0).get_convolve(meanfilter);
+    }
+
+    img.resize(32,32);
+    bool owned;
+    const float *matrices = (const float*)ph_kernel_get(PH_KERNEL_DCT_MATRIX, 32, 0, ph_dct_matrix_build, owned);
+    if (!matrices)
+	return -1;
+    CImg<float> C, Ctransp;
+    C.assign(matrices,32,32);
+    Ctransp.assign(matrices + 32*32,32,32);
+    if (owned)
+	free((float*)matrices);
+
+    CImg<float> dctImage = C*img*Ctransp;
+
+    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');;
+   
+    float median = subsec.median();
     ulong64 one = 0x0000000000000001;
     hash = 0x0000000000000000;
     for (int i=0;i< 64;i++){
@@ -400,12 +1288,24 @@ int ph_dct_imagehash(const char* file,ulong64 &hash){
 	    hash |= one;
 	one = one << 1;
     }
-  
-    delete C;
 
     return 0;
 }
 
+int ph_dct_imagehash(const char* file,ulong64 &hash){
+
+    if (!file){
+	return -1;
+    }
+    CImg<uint8_t> src;
+    try {
+	src.load(file);
+    } catch (CImgIOException ex){
+	return -1;
+    }
+    return _ph_dct_imagehash(src, hash);
+}
+
 #ifdef HAVE_PTHREAD
 void *ph_image_thread(void *p)
 {
@@ -417,8 +1317,10 @@ void *ph_image_thread(void *p)
 		int ret = ph_dct_imagehash(dp->id, hash);
                 dp->hash = (ulong64*)malloc(sizeof(hash));
 		memcpy(dp->hash, &hash, sizeof(hash));
-                dp->hash_length = 1;
+                dp->hash_length = (ret < 0) ? 0 : 1;
+                dp->hash_type = UINT64ARRAY;
         }
+        return NULL;
 }
 
 DP** ph_dct_image_hashes(char *files[], int count, int threads)
@@ -446,23 +1348,23 @@ DP** ph_dct_image_hashes(char *files[], int count, int threads)
         {
                 hashes[i] = (DP *)malloc(sizeof(DP));
                 hashes[i]->id = strdup(files[i]);
+                hashes[i]->path = NULL;
 	}
 
 	pthread_t thds[num_threads];
 
-        int rem = count % num_threads;
         int start = 0;
         int off = 0;
         slice *s = new slice[num_threads];
         for(int n = 0; n < num_threads; ++n)
         {
-                off = (int)floor((count/(float)num_threads) + (rem>0?num_threads-(count % num_threads):0));
+                /* the first count%num_threads slices take one extra file */
+                off = count/num_threads + ((n < count%num_threads) ? 1 : 0);
 
                 s[n].hash_p = &hashes[start];
                 s[n].n = off;
                 s[n].hash_params = NULL;
                 start += off;
-                --rem;
                 pthread_create(&thds[n], NULL, ph_image_thread, &s[n]);
         }
 	for(int i = 0; i < num_threads; ++i)
@@ -474,6 +1376,47 @@ DP** ph_dct_image_hashes(char *files[], int count, int threads)
         return hashes;
 
 }
+
+int ph_dct_image_hashes_phx(char *files[], int count, const char *phxfile, int threads)
+{
+        if (!files || count <= 0 || !phxfile)
+                return -1;
+
+        DP **hashes = ph_dct_image_hashes(files, count, threads);
+        if (!hashes)
+                return -1;
+
+        ulong64 *hashcol = (ulong64*)malloc(count*sizeof(ulong64));
+        ulong64 *ids = (ulong64*)malloc(count*sizeof(ulong64));
+        const char **names = (const char**)malloc(count*sizeof(char*));
+        int nbsaved = 0;
+        if (hashcol && ids && names){
+                for (int i=0;i<count;i++){
+                        if (hashes[i]->hash_length == 0)
+                                continue;
+                        hashcol[nbsaved] = *(ulong64*)hashes[i]->hash;
+                        ids[nbsaved] = (ulong64)i;
+                        names[nbsaved] = hashes[i]->id;
+                        nbsaved++;
+                }
+                if (ph_phx_save(phxfile, hashcol, sizeof(ulong64), ids, names, nbsaved) < 0)
+                        nbsaved = -1;
+        } else {
+                nbsaved = -1;
+        }
+
+        free(hashcol);
+        free(ids);
+        free(names);
+        for (int i=0;i<count;i++){
+                free(hashes[i]->id);
+                free(hashes[i]->hash);
+                free(hashes[i]);
+        }
+        free(hashes);
+
+        return nbsaved;
+}
 #endif
 
 
@@ -482,230 +1425,474 @@ DP** ph_dct_image_hashes(char *files[], int count, int threads)
 #if defined(HAVE_VIDEO_HASH) && defined(HAVE_IMAGE_HASH)
 
 
-CImgList<uint8_t>* ph_getKeyFramesFromVideo(const char *filename){
+/* Shot boundaries and keyframes of a video in one decoding pass. Every step-th frame
+   gets a 64-bin histogram and a 32x32 thumbnail. A frame is a boundary when its
+   histogram distance is the largest of its neighbours within S and stands out from
+   those within L. A sampled frame is known to be a boundary or not once the frame L
+   samples after it arrives, so only the last 2L+1 distances and L+1 thumbnails are
+   kept, plus the thumbnail of the least changed frame of the current shot. That frame
+   becomes the shot's keyframe when the shot ends, and is passed on right away. */
+static const int KeyframeS = 10;
+static const int KeyframeL = 50;
+static const int KeyframeRing = 2*KeyframeL+1;
+
+typedef int (*ph_keyframe_callback)(CImg<uint8_t> &keyframe, void *arg);
+
+typedef struct ph_keyframe_scan {
+    float dist[KeyframeRing];  /* distance of sampled frame i at i%KeyframeRing */
+    long nbdist;
+    CImg<float> prev;
+    CImg<uint8_t> thumbs[KeyframeL+1];
+    long start;          /* last boundary */
+    long best;           /* least changed frame since start */
+    float best_dist;
+    CImg<uint8_t> best_thumb;
+    ph_keyframe_callback keyframe;
+    void *arg;
+    int ret;             /* < 0 once the callback stopped the scan */
+} KeyframeScan;
+
+static void ph_keyframe_init(KeyframeScan *scan, ph_keyframe_callback keyframe, void *arg){
+    scan->nbdist = 0;
+    scan->prev.assign(64,1,1,1,0);
+    scan->start = 0;
+    scan->best = 0;
+    scan->best_dist = 0.0;
+    scan->keyframe = keyframe;
+    scan->arg = arg;
+    scan->ret = 0;
+}
 
-    long N =  GetNumberVideoFrames(filename);
+/* whether sampled frame k of nbframes is a shot boundary, nbframes need only be known
+   to be past k+L */
+static bool ph_keyframe_boundary(const float *dist, long k, long nbframes){
+    int alpha1 = 3;
+    int alpha2 = 2;
+    long s_begin = (k-KeyframeS >= 0) ? k-KeyframeS : 0;
+    long s_end   = (k+KeyframeS < nbframes) ? k+KeyframeS : nbframes-1;
+    long l_begin = (k-KeyframeL >= 0) ? k-KeyframeL : 0;
+    long l_end   = (k+KeyframeL < nbframes) ? k+KeyframeL : nbframes-1;
+
+    /* get global average */
+    float ave_global, sum_global = 0.0, dev_global = 0.0;
+    for (long i=l_begin;i<=l_end;i++){
+	sum_global += dist[i%KeyframeRing];
+    }
+    ave_global = sum_global/((float)(l_end-l_begin+1));
 
-    if (N < 0){
-	return NULL;
+    /*get global deviation */
+    for (long i=l_begin;i<=l_end;i++){
+	float dev = ave_global - dist[i%KeyframeRing];
+	dev = (dev >= 0) ? dev : -1*dev;
+	dev_global += dev;
     }
-    
-    float frames_per_sec = 0.5*fps(filename);
-    if (frames_per_sec < 0){
-	return NULL;
+    dev_global = dev_global/((float)(l_end-l_begin+1));
+
+    /* global threshold */
+    float T_global = ave_global + alpha1*dev_global;
+
+    /* get local maximum */
+    long localmaxpos = s_begin;
+    for (long i=s_begin;i<=s_end;i++){
+	if (dist[i%KeyframeRing] > dist[localmaxpos%KeyframeRing])
+	    localmaxpos = i;
+    }
+    /* get 2nd local maximum */
+    long localmaxpos2 = s_begin;
+    float localmax2 = 0;
+    for (long i=s_begin;i<=s_end;i++){
+	if (i == localmaxpos)
+	    continue;
+	if (dist[i%KeyframeRing] > localmax2){
+	    localmaxpos2 = i;
+	    localmax2 = dist[i%KeyframeRing];
+	}
     }
+    float T_local = alpha2*dist[localmaxpos2%KeyframeRing];
+    float Thresh = (T_global >= T_local) ? T_global : T_local;
 
-    int step = (int)(frames_per_sec + ROUNDING_FACTOR(frames_per_sec));
-    long nbframes = (long)(N/step);
+    float d = dist[k%KeyframeRing];
+    return ((d == dist[localmaxpos%KeyframeRing])&&(d > Thresh));
+}
 
-    float *dist = (float*)malloc((nbframes)*sizeof(float));
-    if (!dist){
-	return NULL;
+/* sampled frame k, now known to be a boundary or not */
+static void ph_keyframe_decide(KeyframeScan *scan, long k, bool boundary){
+    float d = scan->dist[k%KeyframeRing];
+    if (boundary){
+	/* the shot ends at k, a shot of no inner frames takes its end frame */
+	if (scan->ret >= 0){
+	    if (k == scan->start + 1)
+		scan->ret = scan->keyframe(scan->thumbs[k%(KeyframeL+1)], scan->arg);
+	    else
+		scan->ret = scan->keyframe(scan->best_thumb, scan->arg);
+	}
+	scan->start = k;
+    } else if (k == scan->start + 1 || d < scan->best_dist){
+	scan->best = k;
+	scan->best_dist = d;
+	scan->best_thumb = scan->thumbs[k%(KeyframeL+1)];
+    }
+}
+
+/* the next sampled frame and its 32x32 thumbnail, copied since the frames of ScanFrames
+   share the decoder's buffers */
+static int ph_keyframe_add(KeyframeScan *scan, const CImg<uint8_t> &frame, const CImg<uint8_t> &thumb){
+    long j = scan->nbdist++;
+    CImg<float> hist = frame.get_histogram(64,0,255);
+    float d = 0.0, dist = 0.0;
+    cimg_forX(hist,X){
+	d =  hist(X) - scan->prev(X);
+	d = (d>=0) ? d : -d;
+	dist += d;
+	scan->prev(X) = hist(X);
+    }
+    scan->dist[j%KeyframeRing] = dist;
+    scan->thumbs[j%(KeyframeL+1)] = thumb;
+
+    long k = j - KeyframeL;
+    if (k >= 1)
+	ph_keyframe_decide(scan, k, ph_keyframe_boundary(scan->dist, k, j+1));
+    return scan->ret;
+}
+
+/* the last frames are decided against the end of the video, the last one ends a shot */
+static int ph_keyframe_end(KeyframeScan *scan){
+    long nbframes = scan->nbdist;
+    if (nbframes == 0)
+	return -1;
+    long k = nbframes - KeyframeL;
+    for (k = (k >= 1) ? k : 1;k < nbframes-1;k++){
+	ph_keyframe_decide(scan, k, ph_keyframe_boundary(scan->dist, k, nbframes));
+    }
+    if (nbframes > 1)
+	ph_keyframe_decide(scan, nbframes-1, true);
+    else if (scan->ret >= 0)
+	scan->ret = scan->keyframe(scan->thumbs[0], scan->arg);
+    return scan->ret;
+}
+
+static int ph_keyframe_frame(long index, CImg<uint8_t> &frame, CImg<uint8_t> &thumb, void *arg){
+    return ph_keyframe_add((KeyframeScan*)arg, frame, thumb);
+}
+
+#ifdef HAVE_PTHREAD
+/* a video is hashed by two stages in their own threads - decoding, and the histograms,
+   shot boundaries and dct hashes of the keyframes - passing the sampled frames through
+   a short queue, so the decoder never waits for the rest and memory stays bounded */
+static const int VideoQueueLength = 8;
+
+typedef struct ph_frame_queue {
+    CImg<uint8_t> frames[VideoQueueLength];
+    CImg<uint8_t> thumbs[VideoQueueLength];
+    int head;
+    int count;
+    bool closed;         /* the decoder is done */
+    bool stopped;        /* no more frames wanted */
+    int ret;             /* of ScanFrames */
+    VFInfo *st_info;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} FrameQueue;
+
+/* ScanFrames callback of the decoding stage, waits for room in the queue */
+static int ph_frame_queue_push(long index, CImg<uint8_t> &frame, CImg<uint8_t> &thumb, void *arg){
+    FrameQueue *q = (FrameQueue*)arg;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == VideoQueueLength && !q->stopped)
+	pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->stopped){
+	pthread_mutex_unlock(&q->lock);
+	return -1;
+    }
+    /* copied, the frames share the decoder's buffers */
+    int tail = (q->head + q->count) % VideoQueueLength;
+    q->frames[tail] = frame;
+    q->thumbs[tail] = thumb;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* the next frame in the queue, false once the decoder is done and the queue empty */
+static bool ph_frame_queue_pop(FrameQueue *q, CImg<uint8_t> &frame, CImg<uint8_t> &thumb){
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+	pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count == 0){
+	pthread_mutex_unlock(&q->lock);
+	return false;
+    }
+    frame.swap(q->frames[q->head]);
+    thumb.swap(q->thumbs[q->head]);
+    q->head = (q->head + 1) % VideoQueueLength;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+static void *ph_frame_decode_thread(void *p){
+    FrameQueue *q = (FrameQueue*)p;
+    q->ret = ScanFrames(q->st_info, 32, 32, ph_frame_queue_push, q);
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* ScanFrames into scan with the decoder in its own thread, or in this one if it cannot start */
+static int ph_keyframe_pipeline(VFInfo *st_info, KeyframeScan *scan){
+    FrameQueue *q = new FrameQueue;
+    q->head = 0;
+    q->count = 0;
+    q->closed = false;
+    q->stopped = false;
+    q->ret = -1;
+    q->st_info = st_info;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+
+    int ret;
+    pthread_t decoder;
+    if (pthread_create(&decoder, NULL, ph_frame_decode_thread, q) == 0){
+	CImg<uint8_t> frame, thumb;
+	while (ph_frame_queue_pop(q, frame, thumb)){
+	    if (ph_keyframe_add(scan, frame, thumb) < 0){
+		pthread_mutex_lock(&q->lock);
+		q->stopped = true;
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+		break;
+	    }
+	}
+	pthread_join(decoder, NULL);
+	ret = q->ret;
+    } else {
+	ret = ScanFrames(st_info, 32, 32, ph_keyframe_frame, scan);
     }
-    CImg<float> prev(64,1,1,1,0);
+
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    delete q;
+    return ret;
+}
+#endif
+
+/* decode the sampled frames of a video into scan, < 0 for error */
+static int ph_keyframe_scan_video(const char *filename, int threads, VideoSampling sampling, KeyframeScan *scan){
 
     VFInfo st_info;
     st_info.filename = filename;
     st_info.nb_retrieval = 100;
-    st_info.step = step;
     st_info.pixelformat = 0;
     st_info.pFormatCtx = NULL;
+    st_info.pCodecCtx = NULL;
+    st_info.pCodec = NULL;
+    st_info.pSwsCtx = NULL;
+    st_info.threads = threads;
+    st_info.sampling = sampling;
     st_info.width = -1;
     st_info.height = -1;
+    if (vfinfo_open(&st_info) < 0){
+	vfinfo_close(&st_info);
+	return -1;
+    }
 
-    CImgList<uint8_t> *pframelist = new CImgList<uint8_t>();
-    if (!pframelist){
-	return NULL;
+    float frames_per_sec = 0.5*vfinfo_fps(&st_info);
+    if (frames_per_sec < 0){
+	vfinfo_close(&st_info);
+	return -1;
     }
-    int nbread = 0;
-    int k=0;
-    do {
-	nbread = NextFrames(&st_info, pframelist);
-	if (nbread < 0){
-	    delete pframelist;
-	    free(dist);
-	    return NULL;
-	}
-	unsigned int i = 0;
-        while ((i < pframelist->size()) && (k < nbframes)){
-	    CImg<uint8_t> current = pframelist->at(i++);
-	    CImg<float> hist = current.get_histogram(64,0,255);
-            float d = 0.0;
-	    dist[k] = 0.0;
-	    cimg_forX(hist,X){
-		d =  hist(X) - prev(X);
-		d = (d>=0) ? d : -d;
-		dist[k] += d;
-		prev(X) = hist(X);
-	    }
-            k++;
-	}
-        pframelist->clear();
-    } while ((nbread >= st_info.nb_retrieval)&&(k < nbframes));
+    int step = (int)(frames_per_sec + ROUNDING_FACTOR(frames_per_sec));
+    st_info.step = (step > 0) ? step : 1;
+    st_info.next_index = 0;
+
+#ifdef HAVE_PTHREAD
+    int ret = ph_keyframe_pipeline(&st_info, scan);
+#else
+    int ret = ScanFrames(&st_info, 32, 32, ph_keyframe_frame, scan);
+#endif
     vfinfo_close(&st_info);
+    if (ret < 0 && scan->ret >= 0)
+	return -1;
+    return 0;
+}
 
-    int S = 10;
-    int L = 50;
-    int alpha1 = 3;
-    int alpha2 = 2;
-    int s_begin, s_end;
-    int l_begin, l_end;
-    uint8_t *bnds = (uint8_t*)malloc(nbframes*sizeof(uint8_t));
-    if (!bnds){
-	delete pframelist;
-	free(dist);
+static int ph_keyframe_list_add(CImg<uint8_t> &keyframe, void *arg){
+    ((CImgList<uint8_t>*)arg)->push_back(keyframe);
+    return 0;
+}
+
+CImgList<uint8_t>* ph_getKeyFramesFromVideo(const char *filename, int threads, VideoSampling sampling){
+
+    CImgList<uint8_t> *keyframes = new CImgList<uint8_t>();
+    KeyframeScan *scan = new KeyframeScan;
+    ph_keyframe_init(scan, ph_keyframe_list_add, keyframes);
+    if (ph_keyframe_scan_video(filename, threads, sampling, scan) < 0 || ph_keyframe_end(scan) < 0){
+	delete scan;
+	delete keyframes;
 	return NULL;
     }
+    delete scan;
+    return keyframes;
+}
 
-    int nbboundaries = 0;
-    k = 1;
-    bnds[0] = 1;
-    do {
-	s_begin = (k-S >= 0) ? k-S : 0;
-	s_end   = (k+S < nbframes) ? k+S : nbframes-1;
-	l_begin = (k-L >= 0) ? k-L : 0;
-	l_end   = (k+L < nbframes) ? k+L : nbframes-1;
-
-	/* get global average */
-	float ave_global, sum_global = 0.0, dev_global = 0.0;
-	for (int i=l_begin;i<=l_end;i++){
-	    sum_global += dist[i];
-	}
-	ave_global = sum_global/((float)(l_end-l_begin+1));
-
-	/*get global deviation */
-	for (int i=l_begin;i<=l_end;i++){
-	    float dev = ave_global - dist[i];
-	    dev = (dev >= 0) ? dev : -1*dev;
-	    dev_global += dev;
-	}
-	dev_global = dev_global/((float)(l_end-l_begin+1));
-
-	/* global threshold */
-	float T_global = ave_global + alpha1*dev_global;
-
-	/* get local maximum */
-	int localmaxpos = s_begin;
-	for (int i=s_begin;i<=s_end;i++){
-	    if (dist[i] > dist[localmaxpos])
-		localmaxpos = i;
-	}
-        /* get 2nd local maximum */
-	int localmaxpos2 = s_begin;
-	float localmax2 = 0;
-	for (int i=s_begin;i<=s_end;i++){
-	    if (i == localmaxpos)
-		continue;
-	    if (dist[i] > localmax2){
-		localmaxpos2 = i;
-		localmax2 = dist[i];
-	    }
-	}
-        float T_local = alpha2*dist[localmaxpos2];
-	float Thresh = (T_global >= T_local) ? T_global : T_local;
+/* dct hash of a 32x32 keyframe */
+static ulong64 ph_dct_keyframe_hash(const CImg<uint8_t> &keyframe, const CImg<float> &C, const CImg<float> &Ctransp){
+    CImg<uint8_t> currentframe = keyframe;
+    currentframe.blur(1.0);
+    CImg<float> dctImage = C*(currentframe)*Ctransp;
+    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');
+    float med = subsec.median();
+    ulong64 hash = 0x0000000000000000;
+    ulong64 one  = 0x0000000000000001;
+    for (int j=0;j<64;j++){
+	if (subsec(j) > med)
+	    hash |= one;
+	one = one << 1;
+    }
+    return hash;
+}
 
-	if ((dist[k] == dist[localmaxpos])&&(dist[k] > Thresh)){
-	    bnds[k] = 1;
-	    nbboundaries++;
-	}
-	else {
-	    bnds[k] = 0;
-	}
-	k++;
-    } while ( k < nbframes-1);
-    bnds[nbframes-1]=1;
-    nbboundaries += 2;
+struct ph_video_hash_stream {
+    KeyframeScan scan;
+    CImg<float> C;
+    CImg<float> Ctransp;
+    int nbhashes;
+    ph_video_hash_callback callback;
+    void *arg;
+};
 
-    int start = 0;
-    int end = 0;
-    int nbselectedframes = 0;
-    do {
-	/* find next boundary */
-	do {end++;} while ((bnds[end]!=1)&&(end < nbframes));
-       
-	/* find min disparity within bounds */
-	int minpos = start+1;
-	for (int i=start+1; i < end;i++){
-	    if (dist[i] < dist[minpos])
-		minpos = i;
-	}
-	bnds[minpos] = 2;
-	nbselectedframes++;
-	start = end;
-    } while (start < nbframes-1);
-
-    st_info.nb_retrieval = 1;
-    st_info.width = 32;
-    st_info.height = 32;
-    k = 0;
-    do {
-	if (bnds[k]==2){
-	    if (ReadFrames(&st_info, pframelist, k*st_info.step,k*st_info.step + 1) < 0){
-		delete pframelist;
-		free(dist);
-		return NULL;
-	    }
-	}
-	k++;
-    } while (k < nbframes);
-    vfinfo_close(&st_info);
+static int ph_video_hash_keyframe(CImg<uint8_t> &keyframe, void *arg){
+    VideoHashStream *stream = (VideoHashStream*)arg;
+    ulong64 hash = ph_dct_keyframe_hash(keyframe, stream->C, stream->Ctransp);
+    return stream->callback(stream->nbhashes++, hash, stream->arg);
+}
+
+VideoHashStream* ph_video_hash_stream_new(ph_video_hash_callback callback, void *arg){
+    if (!callback)
+	return NULL;
+    bool owned;
+    const float *matrices = (const float*)ph_kernel_get(PH_KERNEL_DCT_MATRIX, 32, 0, ph_dct_matrix_build, owned);
+    if (!matrices)
+	return NULL;
+    VideoHashStream *stream = new VideoHashStream;
+    stream->C.assign(matrices,32,32);
+    stream->Ctransp.assign(matrices + 32*32,32,32);
+    if (owned)
+	free((float*)matrices);
+    stream->nbhashes = 0;
+    stream->callback = callback;
+    stream->arg = arg;
+    ph_keyframe_init(&stream->scan, ph_video_hash_keyframe, stream);
+    return stream;
+}
+
+int ph_video_hash_stream_push(VideoHashStream *stream, const CImg<uint8_t> &frame){
+    if (!stream || frame.is_empty())
+	return -1;
+    if (stream->scan.ret < 0)
+	return stream->scan.ret;
+    CImg<uint8_t> gray = (frame.spectrum() >= 3) ? frame.get_RGBtoYCbCr().channel(0) : frame.get_channel(0);
+    CImg<uint8_t> thumb = gray.get_resize(32,32,1,1,2);
+    return ph_keyframe_add(&stream->scan, gray, thumb);
+}
 
-    free(bnds);
-    bnds = NULL;
-    free(dist);
-    dist = NULL;
+int ph_video_hash_stream_end(VideoHashStream *stream){
+    if (!stream || stream->scan.nbdist == 0)
+	return -1;
+    ph_keyframe_end(&stream->scan);
+    return stream->nbhashes;
+}
+
+void ph_video_hash_stream_free(VideoHashStream *stream){
+    delete stream;
+}
 
-    return pframelist;
+int ph_dct_videohash_stream(const char *filename, ph_video_hash_callback callback, void *arg,
+			    int threads, VideoSampling sampling){
+    VideoHashStream *stream = ph_video_hash_stream_new(callback, arg);
+    if (!stream)
+	return -1;
+    int ret = ph_keyframe_scan_video(filename, threads, sampling, &stream->scan);
+    if (ret >= 0)
+	ret = ph_video_hash_stream_end(stream);
+    ph_video_hash_stream_free(stream);
+    return ret;
 }
 
+typedef struct ph_video_hash_array {
+    ulong64 *hashes;
+    int capacity;
+} VideoHashArray;
+
+static int ph_video_hash_append(int index, ulong64 hash, void *arg){
+    VideoHashArray *array = (VideoHashArray*)arg;
+    if (index == array->capacity){
+	int capacity = (array->capacity > 0) ? 2*array->capacity : 64;
+	ulong64 *hashes = (ulong64*)realloc(array->hashes, capacity*sizeof(ulong64));
+	if (!hashes)
+	    return -1;
+	array->hashes = hashes;
+	array->capacity = capacity;
+    }
+    array->hashes[index] = hash;
+    return 0;
+}
 
-ulong64* ph_dct_videohash(const char *filename, int &Length){
+ulong64* ph_dct_videohash(const char *filename, int &Length, int threads, VideoSampling sampling){
 
-    CImgList<uint8_t> *keyframes = ph_getKeyFramesFromVideo(filename);
-    if (keyframes == NULL)
+    VideoHashArray array;
+    array.hashes = NULL;
+    array.capacity = 0;
+    int count = ph_dct_videohash_stream(filename, ph_video_hash_append, &array, threads, sampling);
+    if (count <= 0 || count > array.capacity){
+	free(array.hashes);
 	return NULL;
-
-    Length = keyframes->size();
-
-    ulong64 *hash = (ulong64*)malloc(sizeof(ulong64)*Length);
-    CImg<float> *C = ph_dct_matrix(32);
-    CImg<float> Ctransp = C->get_transpose();
-    CImg<float> dctImage;
-    CImg<float> subsec;
-    CImg<uint8_t> currentframe;
-
-    for (unsigned int i=0;i < keyframes->size(); i++){
-	currentframe = keyframes->at(i);
-	currentframe.blur(1.0);
-	dctImage = (*C)*(currentframe)*Ctransp;
-	subsec = dctImage.crop(1,1,8,8).unroll('x');
-	float med = subsec.median();
-	hash[i] =     0x0000000000000000;
-	ulong64 one = 0x0000000000000001;
-	for (int j=0;j<64;j++){
-	    if (subsec(j) > med)
-		hash[i] |= one;
-	    one = one << 1;
-	}
-    }
-
-    keyframes->clear();
-    delete keyframes;
-    keyframes = NULL;
-    delete C;
-    C = NULL;
-    return hash;
+    }
+    Length = count;
+    return array.hashes;
 }
 
 #ifdef HAVE_PTHREAD
+/* files are taken in turn by the threads, the largest first */
+typedef struct ph_video_job {
+    DP **hashes;
+    int *order;
+    int count;
+    int next;
+    int num_threads;
+    VideoSampling sampling;
+} VideoJob;
+
+static int ph_video_size_cmp(const void *a, const void *b){
+    const off_t *sa = (const off_t*)a;
+    const off_t *sb = (const off_t*)b;
+    return (sa[0] > sb[0]) ? -1 : (sa[0] < sb[0]);
+}
+
 void *ph_video_thread(void *p)
 {
-        slice *s = (slice *)p;
-        for(int i = 0; i < s->n; ++i)
+        VideoJob *job = (VideoJob *)p;
+        int n;
+        while ((n = __sync_fetch_and_add(&job->next, 1)) < job->count)
         {
-                DP *dp = (DP *)s->hash_p[i];
+                DP *dp = job->hashes[job->order[n]];
+                /* the cpus go to the decoders of the files still being hashed, so the
+                   last files, or a single long one, are decoded by many threads */
+                int active = job->count - n;
+                if (active > job->num_threads)
+                        active = job->num_threads;
+                int decode_threads = ph_num_threads()/active;
+                if (decode_threads < 1)
+                        decode_threads = 1;
 		int N;
-		ulong64 *hash = ph_dct_videohash(dp->id, N);
+		ulong64 *hash = ph_dct_videohash(dp->id, N, decode_threads, job->sampling);
 		if(hash)
 		{
                 	dp->hash = hash;
@@ -716,89 +1903,516 @@ void *ph_video_thread(void *p)
 			dp->hash = NULL;
 			dp->hash_length = 0;
 		}
+                dp->hash_type = UINT64ARRAY;
         }
+        return NULL;
 }
 
-DP** ph_dct_video_hashes(char *files[], int count, int threads)
+DP** ph_dct_video_hashes(char *files[], int count, int threads, VideoSampling sampling)
 {
        	if(!files || count <= 0)
                 return NULL;
 
-        int num_threads;
-        if(threads > count)
-        {
+        int num_threads = (threads > 0) ? threads : ph_num_threads();
+        if(num_threads > count)
                 num_threads = count;
-        }
-	else if(threads > 0)
-        {
-                num_threads = threads;
-        }
-	else
-	{
-                num_threads = ph_num_threads();
-        }
 
 	DP **hashes = (DP**)malloc(count*sizeof(DP*));
+        off_t *sizes = (off_t*)malloc(2*count*sizeof(off_t));
+        int *order = (int*)malloc(count*sizeof(int));
+        if (!hashes || !sizes || !order)
+        {
+                free(hashes);
+                free(sizes);
+                free(order);
+                return NULL;
+        }
 
         for(int i = 0; i < count; ++i)
         {
                 hashes[i] = (DP *)malloc(sizeof(DP));
                 hashes[i]->id = strdup(files[i]);
+                struct stat st;
+                sizes[2*i] = (stat(files[i], &st) == 0) ? st.st_size : 0;
+                sizes[2*i+1] = i;
 	}
+        qsort(sizes, count, 2*sizeof(off_t), ph_video_size_cmp);
+        for(int i = 0; i < count; ++i)
+                order[i] = (int)sizes[2*i+1];
+        free(sizes);
 
-	pthread_t thds[num_threads];
+        VideoJob job;
+        job.hashes = hashes;
+        job.order = order;
+        job.count = count;
+        job.next = 0;
+        job.num_threads = num_threads;
+        job.sampling = sampling;
 
-        int rem = count % num_threads;
-        int start = 0;
-        int off = 0;
-        slice *s = new slice[num_threads];
-        for(int n = 0; n < num_threads; ++n)
+	pthread_t thds[num_threads];
+        int started[num_threads];
+        for(int n = 1; n < num_threads; ++n)
         {
-                off = (int)floor((count/(float)num_threads) + (rem>0?num_threads-(count % num_threads):0));
-
-                s[n].hash_p = &hashes[start];
-                s[n].n = off;
-                s[n].hash_params = NULL;
-                start += off;
-                --rem;
-                pthread_create(&thds[n], NULL, ph_video_thread, &s[n]);
+                started[n] = (pthread_create(&thds[n], NULL, ph_video_thread, &job) == 0);
         }
-	for(int i = 0; i < num_threads; ++i)
+        /* the caller is worker 0, and also picks up files left by threads that failed to start */
+        ph_video_thread(&job);
+	for(int i = 1; i < num_threads; ++i)
         {
-                pthread_join(thds[i], NULL);
+                if (started[i])
+                        pthread_join(thds[i], NULL);
         }
-	delete[] s;
+        free(order);
 
         return hashes;
 
 }
 #endif
 
-double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int threshold){
+/* Longest common subsequence of two keyframe hash sequences, keyframes matching when
+   within threshold bits, by the bit-parallel algorithm of Hyyro: bit j of V is cleared
+   at the columns where the LCS of the rows so far grows, so the LCS is the number of
+   cleared bits, and a row costs N2/64 word additions once its matches are known. A
+   band >= 0 only lets row i match columns within band of the scaled diagonal. Stops
+   once the rows left cannot lift the similarity, the LCS over the shorter length, to
+   min_similarity, returning the LCS they could reach.
+   V and M hold (N2+63)/64 words, M all zero. */
+static int ph_videohash_lcs(const ulong64 *hashA, int N1, const ulong64 *hashB, int N2, int threshold,
+			    int band, double min_similarity, ulong64 *V, ulong64 *M){
+    int den = (N1 <= N2) ? N1 : N2;
+    int words = (N2 + 63)/64;
+    ulong64 last = (N2 % 64) ? (1ULL << (N2 % 64)) - 1 : ~0ULL;
+    for (int w=0;w<words;w++){
+	V[w] = ~0ULL;
+    }
+    int lcs = 0;
+    for (int i=0;i<N1;i++){
+	int lo = 0, hi = N2-1;
+	if (band >= 0){
+	    long center = (long)i*N2/N1;
+	    lo = (center - band > 0) ? center - band : 0;
+	    hi = (center + band < N2-1) ? center + band : N2-1;
+	}
+	for (int j=lo;j<=hi;j++){
+	    if (ph_hamming_distance(hashA[i], hashB[j]) <= threshold)
+		M[j/64] |= 1ULL << (j%64);
+	}
+	/* V = (V + U) | (V - U), U = V & M, the sum carrying past the band */
+	ulong64 carry = 0;
+	for (int w=lo/64;w < words && (w <= hi/64 || carry);w++){
+	    ulong64 v = V[w];
+	    ulong64 u = v & M[w];
+	    ulong64 s = v + u;
+	    ulong64 c = (s < v);
+	    ulong64 t = s + carry;
+	    carry = c | (t < s);
+	    ulong64 nv = t | (v & ~u);
+	    ulong64 mask = (w == words-1) ? last : ~0ULL;
+	    lcs += ph_hamming_distance(v & mask, 0) - ph_hamming_distance(nv & mask, 0);
+	    V[w] = nv;
+	}
+	for (int w=lo/64;w<=hi/64;w++){
+	    M[w] = 0;
+	}
+	int reach = lcs + (N1-1-i);
+	if ((double)reach/(double)den < min_similarity)
+	    return reach;
+    }
+    return lcs;
+}
 
+double ph_dct_videohash_dist2(const ulong64 *hashA, int N1, const ulong64 *hashB, int N2, int threshold,
+			      int band, double min_similarity){
     int den = (N1 <= N2) ? N1 : N2;
-    int C[N1+1][N2+1];
+    if (!hashA || !hashB || den <= 0)
+	return 0.0;
+    int words = (N2 + 63)/64;
+    ulong64 *V = (ulong64*)malloc(2*words*sizeof(ulong64));
+    if (!V)
+	return -1.0;
+    ulong64 *M = V + words;
+    memset(M, 0, words*sizeof(ulong64));
+    int lcs = ph_videohash_lcs(hashA, N1, hashB, N2, threshold, band, min_similarity, V, M);
+    free(V);
+    return (double)lcs/(double)den;
+}
+
+double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int threshold){
+    return ph_dct_videohash_dist2(hashA, N1, hashB, N2, threshold);
+}
 
-    for (int i=0;i<N1+1;i++){
-	C[i][0] = 0;
+typedef struct ph_videohash_dist_job {
+    const ulong64 *query;
+    int N;
+    const ulong64 **hashes;
+    const int *lengths;
+    int count;
+    int next;
+    int words;           /* of the longest sequence */
+    int threshold;
+    int band;
+    double min_similarity;
+    double *similarities;
+} VideoDistJob;
+
+static void *ph_videohash_dist_thread(void *p){
+    VideoDistJob *job = (VideoDistJob*)p;
+    ulong64 *V = (ulong64*)malloc(2*job->words*sizeof(ulong64));
+    if (!V)
+	return NULL;
+    ulong64 *M = V + job->words;
+    memset(M, 0, job->words*sizeof(ulong64));
+    int i;
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count){
+	int N2 = job->lengths[i];
+	int den = (job->N <= N2) ? job->N : N2;
+	if (!job->hashes[i] || den <= 0){
+	    job->similarities[i] = 0.0;
+	    continue;
+	}
+	int lcs = ph_videohash_lcs(job->query, job->N, job->hashes[i], N2, job->threshold, job->band,
+				   job->min_similarity, V, M);
+	job->similarities[i] = (double)lcs/(double)den;
     }
-    for (int j=0;j<N2+1;j++){
-	C[0][j] = 0;
+    free(V);
+    return NULL;
+}
+
+int ph_dct_videohash_dist_many(const ulong64 *query, int N, const ulong64 **hashes, const int *lengths, int count,
+			       double *similarities, int threshold, int band, double min_similarity, int threads){
+    if (!query || N <= 0 || !hashes || !lengths || count <= 0 || !similarities)
+	return -1;
+    VideoDistJob job;
+    job.query = query;
+    job.N = N;
+    job.hashes = hashes;
+    job.lengths = lengths;
+    job.count = count;
+    job.next = 0;
+    job.words = 1;
+    job.threshold = threshold;
+    job.band = band;
+    job.min_similarity = min_similarity;
+    job.similarities = similarities;
+    for (int i=0;i<count;i++){
+	similarities[i] = -1.0;
+	if ((lengths[i] + 63)/64 > job.words)
+	    job.words = (lengths[i] + 63)/64;
     }
-    for (int i=1;i<N1+1;i++){
-	for (int j=1;j<N2+1;j++){
-	    int d = ph_hamming_distance(hashA[i-1],hashB[j-1]);
-	    if (d <= threshold){
-		C[i][j] = C[i-1][j-1] + 1;
-	    } else {
-		C[i][j] = ((C[i-1][j] >= C[i][j-1])) ? C[i-1][j] : C[i][j-1];
+
+    int num_threads = 1;
+#ifdef HAVE_PTHREAD
+    num_threads = (threads > 0) ? threads : ph_num_threads();
+#endif
+    if (num_threads > count){
+	num_threads = count;
+    }
+#ifdef HAVE_PTHREAD
+    if (num_threads > 1){
+	pthread_t thds[num_threads];
+	int started[num_threads];
+	for (int n=1;n<num_threads;n++){
+	    started[n] = (pthread_create(&thds[n], NULL, ph_videohash_dist_thread, &job) == 0);
+	}
+	/* the caller is worker 0, and also picks up sequences left by threads that failed to start */
+	ph_videohash_dist_thread(&job);
+	for (int n=1;n<num_threads;n++){
+	    if (started[n]){
+		pthread_join(thds[n], NULL);
 	    }
 	}
+    } else {
+	ph_videohash_dist_thread(&job);
+    }
+#else
+    ph_videohash_dist_thread(&job);
+#endif
+    int nbdone = 0;
+    for (int i=0;i<count;i++){
+	if (similarities[i] >= 0.0)
+	    nbdone++;
+    }
+    return (nbdone == count) ? 0 : -1;
+}
+
+int ph_video_index_init(VideoIndex *idx){
+    if (!idx)
+	return -1;
+    memset(idx, 0, sizeof(VideoIndex));
+    idx->starts = (uint32_t*)malloc(sizeof(uint32_t));
+    if (!idx->starts)
+	return -1;
+    idx->starts[0] = 0;
+    return 0;
+}
+
+void ph_video_index_free(VideoIndex *idx){
+    if (!idx)
+	return;
+    free(idx->ids);
+    free(idx->starts);
+    free(idx->hashes);
+    free(idx->owner);
+    free(idx->offsets);
+    free(idx->postings);
+    memset(idx, 0, sizeof(VideoIndex));
+}
+
+int ph_video_index_add(VideoIndex *idx, const ulong64 *hashes, int N, ulong64 id){
+    if (!idx || !idx->starts || !hashes || N <= 0 || N > INT_MAX - idx->nbhashes || idx->nbvideos == INT_MAX - 1)
+	return -1;
+    if (idx->nbvideos == idx->capacity){
+	int capacity = (idx->capacity > 0) ? idx->capacity : 1024;
+	capacity = (capacity > INT_MAX/2 - 1) ? INT_MAX - 1 : 2*capacity;
+	ulong64 *ids = (ulong64*)realloc(idx->ids, (size_t)capacity*sizeof(ulong64));
+	if (!ids)
+	    return -1;
+	idx->ids = ids;
+	uint32_t *starts = (uint32_t*)realloc(idx->starts, ((size_t)capacity+1)*sizeof(uint32_t));
+	if (!starts)
+	    return -1;
+	idx->starts = starts;
+	idx->capacity = capacity;
+    }
+    if (idx->nbhashes + N > idx->hash_capacity){
+	int capacity = (idx->hash_capacity > 0) ? idx->hash_capacity : 4096;
+	while (capacity < idx->nbhashes + N)
+	    capacity = (capacity > INT_MAX/2) ? idx->nbhashes + N : 2*capacity;
+	ulong64 *tmp = (ulong64*)realloc(idx->hashes, (size_t)capacity*sizeof(ulong64));
+	if (!tmp)
+	    return -1;
+	idx->hashes = tmp;
+	uint32_t *owner = (uint32_t*)realloc(idx->owner, (size_t)capacity*sizeof(uint32_t));
+	if (!owner)
+	    return -1;
+	idx->owner = owner;
+	idx->hash_capacity = capacity;
+    }
+    memcpy(idx->hashes + idx->nbhashes, hashes, N*sizeof(ulong64));
+    for (int i=0;i<N;i++){
+	idx->owner[idx->nbhashes + i] = idx->nbvideos;
+    }
+    idx->nbhashes += N;
+    idx->ids[idx->nbvideos++] = id;
+    idx->starts[idx->nbvideos] = idx->nbhashes;
+    return 0;
+}
+
+int ph_video_index_build(VideoIndex *idx){
+    if (!idx || !idx->starts)
+	return -1;
+    if (idx->nbindexed == idx->nbvideos)
+	return 0;
+    int count = idx->nbhashes;
+    uint32_t *offsets = (uint32_t*)calloc((size_t)VideoIndexBlocks*65537, sizeof(uint32_t));
+    uint32_t *postings = (uint32_t*)malloc(((size_t)VideoIndexBlocks*count + 1)*sizeof(uint32_t));
+    if (!offsets || !postings){
+	free(offsets);
+	free(postings);
+	return -1;
+    }
+
+    /* a counting sort of the keyframes on each block value, in keyframe order */
+    for (int b=0;b<VideoIndexBlocks;b++){
+	uint32_t *off = offsets + (size_t)b*65537;
+	uint32_t *post = postings + (size_t)b*count;
+	for (int k=0;k<count;k++){
+	    off[((idx->hashes[k] >> (16*b)) & 0xffff) + 1]++;
+	}
+	for (int v=0;v<65536;v++){
+	    off[v+1] += off[v];
+	}
+	for (int k=0;k<count;k++){
+	    int v = (idx->hashes[k] >> (16*b)) & 0xffff;
+	    post[off[v]++] = k;
+	}
+	for (int v=65536;v>0;v--){
+	    off[v] = off[v-1];
+	}
+	off[0] = 0;
     }
 
-    double result = (double)(C[N1][N2])/(double)(den);
+    free(idx->offsets);
+    free(idx->postings);
+    idx->offsets = offsets;
+    idx->postings = postings;
+    idx->nbindexed = idx->nbvideos;
+    return 0;
+}
+
+/* a keyframe match, voting for video along diagonal */
+typedef struct ph_video_vote {
+    uint32_t video;
+    int32_t diagonal;
+} VideoVote;
 
-    return result;
+static int ph_video_keyframe_cmp(const void *a, const void *b){
+    uint32_t ka = *(const uint32_t*)a, kb = *(const uint32_t*)b;
+    return (ka < kb) ? -1 : (ka > kb);
+}
+
+static int ph_video_vote_cmp(const void *a, const void *b){
+    const VideoVote *va = (const VideoVote*)a;
+    const VideoVote *vb = (const VideoVote*)b;
+    if (va->video != vb->video)
+	return (va->video < vb->video) ? -1 : 1;
+    return (va->diagonal < vb->diagonal) ? -1 : (va->diagonal > vb->diagonal);
+}
+
+static int ph_video_result_cmp(const void *a, const void *b){
+    const VideoResult *ra = (const VideoResult*)a;
+    const VideoResult *rb = (const VideoResult*)b;
+    if (ra->similarity != rb->similarity)
+	return (ra->similarity > rb->similarity) ? -1 : 1;
+    if (ra->votes != rb->votes)
+	return (ra->votes > rb->votes) ? -1 : 1;
+    return (ra->id < rb->id) ? -1 : (ra->id > rb->id);
+}
+
+static int ph_video_votes_cmp(const void *a, const void *b){
+    const VideoResult *ra = (const VideoResult*)a;
+    const VideoResult *rb = (const VideoResult*)b;
+    if (ra->votes != rb->votes)
+	return (ra->votes > rb->votes) ? -1 : 1;
+    return (ra->id < rb->id) ? -1 : (ra->id > rb->id);
+}
+
+int ph_video_index_query(const VideoIndex *idx, const ulong64 *hashes, int N, VideoResult *results, int maxresults,
+			 int threshold, int nbcandidates, double min_similarity, int band){
+    if (!idx || !idx->starts || !hashes || N <= 0 || !results || maxresults <= 0 || nbcandidates < 0)
+	return -1;
+
+    /* the matches of each query keyframe in the posting lists, each keyframe once. Exact
+       block matches find every keyframe within VideoIndexBlocks-1 bits, and beyond that the
+       neighbours one bit away are probed as well */
+    int nbprobes = (threshold < VideoIndexBlocks) ? 1 : 17;
+    int nbvotes = 0, capacity = 1024;
+    VideoVote *votes = (VideoVote*)malloc(capacity*sizeof(VideoVote));
+    uint32_t *found = (uint32_t*)malloc(VideoIndexBlocks*sizeof(uint32_t));
+    int found_capacity = VideoIndexBlocks;
+    int err = (!votes || !found);
+    for (int i=0;i<N && !err && idx->nbindexed > 0;i++){
+	int nbfound = 0;
+	for (int probe=0;probe<VideoIndexBlocks*nbprobes && !err;probe++){
+	    /* the block value itself, then the values one bit away */
+	    int b = probe/nbprobes;
+	    const uint32_t *off = idx->offsets + (size_t)b*65537;
+	    const uint32_t *post = idx->postings + (size_t)b*idx->starts[idx->nbindexed];
+	    int v = (hashes[i] >> (16*b)) & 0xffff;
+	    if (probe%nbprobes > 0)
+		v ^= 1 << (probe%nbprobes - 1);
+	    for (uint32_t j=off[v];j<off[v+1];j++){
+		if (ph_hamming_distance(hashes[i], idx->hashes[post[j]]) > threshold)
+		    continue;
+		if (nbfound == found_capacity){
+		    uint32_t *tmp = (uint32_t*)realloc(found, 2*found_capacity*sizeof(uint32_t));
+		    if (!tmp){
+			err = 1;
+			break;
+		    }
+		    found = tmp;
+		    found_capacity *= 2;
+		}
+		found[nbfound++] = post[j];
+	    }
+	}
+	qsort(found, nbfound, sizeof(uint32_t), ph_video_keyframe_cmp);
+	for (int j=0;j<nbfound && !err;j++){
+	    if (j > 0 && found[j] == found[j-1])
+		continue;
+	    if (nbvotes == capacity){
+		VideoVote *tmp = (VideoVote*)realloc(votes, 2*capacity*sizeof(VideoVote));
+		if (!tmp){
+		    err = 1;
+		    break;
+		}
+		votes = tmp;
+		capacity *= 2;
+	    }
+	    uint32_t video = idx->owner[found[j]];
+	    votes[nbvotes].video = video;
+	    votes[nbvotes].diagonal = (int32_t)(found[j] - idx->starts[video]) - i;
+	    nbvotes++;
+	}
+    }
+    free(found);
+
+    /* the votes of a video are those of its best stretch of VideoIndexDiagonal diagonals,
+       so matches scattered in time count for little */
+    int nbcands = 0;
+    VideoResult *cands = NULL;
+    if (!err){
+	qsort(votes, nbvotes, sizeof(VideoVote), ph_video_vote_cmp);
+	cands = (VideoResult*)malloc(((size_t)(nbvotes < idx->nbindexed ? nbvotes : idx->nbindexed)
+				      + idx->nbvideos - idx->nbindexed + 1)*sizeof(VideoResult));
+	err = (cands == NULL);
+    }
+    for (int i=0;i<nbvotes && !err;){
+	int end = i, best = 0;
+	for (int first=i;end < nbvotes && votes[end].video == votes[i].video;end++){
+	    while (votes[end].diagonal - votes[first].diagonal >= VideoIndexDiagonal)
+		first++;
+	    if (end - first + 1 > best)
+		best = end - first + 1;
+	}
+	cands[nbcands].id = votes[i].video;
+	cands[nbcands].votes = best;
+	cands[nbcands].similarity = 0.0;
+	nbcands++;
+	i = end;
+    }
+    free(votes);
+    if (err){
+	free(cands);
+	return -1;
+    }
+    qsort(cands, nbcands, sizeof(VideoResult), ph_video_votes_cmp);
+    if (nbcands > nbcandidates)
+	nbcands = nbcandidates;
+    /* videos added since the last build are always aligned */
+    for (int v=idx->nbindexed;v<idx->nbvideos;v++){
+	cands[nbcands].id = v;
+	cands[nbcands].votes = 0;
+	nbcands++;
+    }
+
+    /* full alignment of the candidates, id holding the video number until here */
+    int words = 1;
+    for (int c=0;c<nbcands;c++){
+	int len = idx->starts[cands[c].id+1] - idx->starts[cands[c].id];
+	if ((len + 63)/64 > words)
+	    words = (len + 63)/64;
+    }
+    ulong64 *V = (ulong64*)malloc(2*words*sizeof(ulong64));
+    if (!V){
+	free(cands);
+	return -1;
+    }
+    ulong64 *M = V + words;
+    memset(M, 0, words*sizeof(ulong64));
+    int nbresults = 0;
+    for (int c=0;c<nbcands;c++){
+	uint32_t video = (uint32_t)cands[c].id;
+	int len = idx->starts[video+1] - idx->starts[video];
+	int den = (N <= len) ? N : len;
+	int lcs = ph_videohash_lcs(hashes, N, idx->hashes + idx->starts[video], len, threshold, band,
+				   min_similarity, V, M);
+	double similarity = (double)lcs/(double)den;
+	if (similarity < min_similarity || similarity <= 0.0)
+	    continue;
+	cands[nbresults].id = idx->ids[video];
+	cands[nbresults].votes = cands[c].votes;
+	cands[nbresults].similarity = similarity;
+	nbresults++;
+    }
+    free(V);
+
+    qsort(cands, nbresults, sizeof(VideoResult), ph_video_result_cmp);
+    if (nbresults > maxresults)
+	nbresults = maxresults;
+    memcpy(results, cands, nbresults*sizeof(VideoResult));
+    free(cands);
+    return nbresults;
 }
 
 #endif
@@ -883,65 +2497,168 @@ DP** ph_read_imagehashes(const char *dirname,int pathlength, int &count){
 
 }
 
-CImg<float>* GetMHKernel(float alpha, float level){
-    int sigma = (int)4*pow((float)alpha,(float)level);
-    static CImg<float> *pkernel = NULL;
-    float xpos, ypos, A;
-    if (!pkernel){
-	pkernel = new CImg<float>(2*sigma+1,2*sigma+1,1,1,0);
-        cimg_forXY(*pkernel,X,Y){
-	    xpos = pow(alpha,-level)*(X-sigma);
-            ypos = pow(alpha,-level)*(Y-sigma);
-            A = xpos*xpos + ypos*ypos;
-            pkernel->atXY(X,Y) = (2-A)*exp(-A/2);
-	}
-    }
-    return pkernel;
+/* The MH kernel (2-A)exp(-A/2), with A = s^2(x^2+y^2), splits as u(x)g(y) + g(x)u(y),
+ * where g(x) = exp(-s^2x^2/2) and u(x) = (1-s^2x^2)g(x), so it is applied as 1D passes.
+ * The taps are g for x = -sigma..sigma followed by u. */
+static int ph_mh_sigma(float alpha, float level){
+    return (int)4*pow((float)alpha,(float)level);
 }
 
-uint8_t* ph_mh_imagehash(const char *filename, int &N,float alpha, float lvl){
-    if (filename == NULL){
+static void* ph_mh_kernel_build(double p0, double p1){
+    float alpha = (float)p0, level = (float)p1;
+    int sigma = ph_mh_sigma(alpha, level);
+    float *taps = (float*)malloc(2*(2*sigma+1)*sizeof(float));
+    if (!taps)
 	return NULL;
+    float *g = taps, *u = taps + 2*sigma + 1;
+    float scale = pow(alpha,-level);
+    for (int i=0;i<=2*sigma;i++){
+	float pos = scale*(i-sigma);
+	float A = pos*pos;
+	g[i] = exp(-A/2);
+	u[i] = (1-A)*g[i];
     }
-    uint8_t *hash = (unsigned char*)malloc(72*sizeof(uint8_t));
-    N = 72;
+    return taps;
+}
 
-    CImg<uint8_t> src(filename);
-    CImg<uint8_t> img;
+/* correlate the width x height image with the MH kernel of the given taps into resp,
+ * with the borders repeated as CImg::get_correlate does */
+static int ph_mh_filter(const uint8_t *img, int width, int height, const float *g, const float *u,
+			int sigma, float *resp){
+    int nbtaps = 2*sigma + 1;
+    float *hg = (float*)malloc((size_t)2*width*height*sizeof(float));
+    float *row = (float*)malloc((width + 2*sigma)*sizeof(float));
+    if (!hg || !row){
+	free(hg);
+	free(row);
+	return -1;
+    }
+    float *hu = hg + (size_t)width*height;
+
+    /* rows filtered by g and by u */
+    for (int y=0;y<height;y++){
+	const uint8_t *in = img + (size_t)y*width;
+	for (int x=-sigma;x<width+sigma;x++){
+	    int xx = (x < 0) ? 0 : ((x >= width) ? width - 1 : x);
+	    row[x+sigma] = in[xx];
+	}
+	float *__restrict outg = hg + (size_t)y*width;
+	float *__restrict outu = hu + (size_t)y*width;
+	for (int x=0;x<width;x++){
+	    outg[x] = 0.0f;
+	    outu[x] = 0.0f;
+	}
+	for (int t=0;t<nbtaps;t++){
+	    const float *__restrict r = row + t;
+	    float gt = g[t], ut = u[t];
+	    for (int x=0;x<width;x++){
+		outg[x] += gt*r[x];
+		outu[x] += ut*r[x];
+	    }
+	}
+    }
+
+    /* columns, u over the g filtered rows and g over the u filtered rows */
+    for (int y=0;y<height;y++){
+	float *__restrict out = resp + (size_t)y*width;
+	for (int x=0;x<width;x++){
+	    out[x] = 0.0f;
+	}
+	for (int t=0;t<nbtaps;t++){
+	    int yy = y + t - sigma;
+	    yy = (yy < 0) ? 0 : ((yy >= height) ? height - 1 : yy);
+	    const float *__restrict rg = hg + (size_t)yy*width;
+	    const float *__restrict ru = hu + (size_t)yy*width;
+	    float gt = g[t], ut = u[t];
+	    for (int x=0;x<width;x++){
+		out[x] += ut*rg[x] + gt*ru[x];
+	    }
+	}
+    }
+    free(row);
+    free(hg);
+    return 0;
+}
 
+static const int MHPlaneSize = 512;
+static const int MHHashLength = 72;
+
+/* the equalized MHPlaneSize x MHPlaneSize luma plane the MH hash is taken from */
+static void ph_mh_preprocess(const CImg<uint8_t> &src, CImg<uint8_t> &img){
     if (src.spectrum() == 3){
-	img = src.get_RGBtoYCbCr().channel(0).blur(1.0).resize(512,512,1,1,5).get_equalize(256);
+	img = src.get_RGBtoYCbCr().channel(0).blur(1.0).resize(MHPlaneSize,MHPlaneSize,1,1,5).get_equalize(256);
     } else{
-	img = src.channel(0).get_blur(1.0).resize(512,512,1,1,5).get_equalize(256);
-    }
-    src.clear();
-
-    CImg<float> *pkernel = GetMHKernel(alpha,lvl);
-    CImg<float> fresp =  img.get_correlate(*pkernel);
-    img.clear();
-    fresp.normalize(0,1.0);
-    CImg<float> blocks(31,31,1,1,0);
-    for (int rindex=0;rindex < 31;rindex++){
-		for (int cindex=0;cindex < 31;cindex++){
-			blocks(rindex,cindex) = fresp.get_crop(rindex*16,cindex*16,rindex*16+16-1,cindex*16+16-1).sum();
+	img = src.get_channel(0).blur(1.0).resize(MHPlaneSize,MHPlaneSize,1,1,5).get_equalize(256);
+    }
+}
+
+/* MH hash of the preprocessed plane at scale (alpha, lvl) into the MHHashLength bytes of hash */
+static int ph_mh_hash_plane(const uint8_t *plane, float alpha, float lvl, uint8_t *hash){
+    int sigma = ph_mh_sigma(alpha, lvl);
+    if (sigma < 0 || sigma > 256){
+	return -1;
+    }
+    bool owned;
+    const float *taps = (const float*)ph_kernel_get(PH_KERNEL_MH, alpha, lvl, ph_mh_kernel_build, owned);
+    const int width = MHPlaneSize, height = MHPlaneSize;
+    float *fresp = (float*)malloc(width*height*sizeof(float));
+    int ret = (taps && fresp) ? ph_mh_filter(plane, width, height, taps, taps + 2*sigma + 1, sigma, fresp) : -1;
+    if (owned)
+	free((float*)taps);
+    if (ret < 0){
+	free(fresp);
+	return -1;
+    }
+
+    /* normalize to [0,1] */
+    float m = fresp[0], M = fresp[0];
+    for (int i=1;i<width*height;i++){
+	if (fresp[i] < m)
+	    m = fresp[i];
+	if (fresp[i] > M)
+	    M = fresp[i];
+    }
+    for (int i=0;i<width*height;i++){
+	fresp[i] = (m == M) ? 0.0f : (fresp[i] - m)/(M - m);
+    }
+
+    /* sums of the 16x16 blocks, each summed in row order */
+    float blocks[31][31];
+    for (int by=0;by < 31;by++){
+	double sums[31];
+	for (int bx=0;bx < 31;bx++){
+	    sums[bx] = 0.0;
+	}
+	for (int y=by*16;y < by*16+16;y++){
+	    const float *r = fresp + y*width;
+	    for (int bx=0;bx < 31;bx++){
+		for (int x=bx*16;x < bx*16+16;x++){
+		    sums[bx] += r[x];
 		}
+	    }
+	}
+	for (int bx=0;bx < 31;bx++){
+	    blocks[by][bx] = (float)sums[bx];
+	}
     }
+    free(fresp);
+
     int hash_index;
-    int nb_ones = 0, nb_zeros = 0;
     int bit_index = 0;
     unsigned char hashbyte = 0;
     for (int rindex=0;rindex < 31-2;rindex+=4){
-		CImg<float> subsec;
 		for (int cindex=0;cindex < 31-2;cindex+=4){
-			subsec = blocks.get_crop(cindex,rindex, cindex+2, rindex+2).unroll('x');
-			float ave = subsec.mean();
-			cimg_forX(subsec, I){
+			float subsec[9];
+			double total = 0.0;
+			for (int I=0;I < 9;I++){
+				subsec[I] = blocks[rindex+I/3][cindex+I%3];
+				total += subsec[I];
+			}
+			float ave = total/9;
+			for (int I=0;I < 9;I++){
 				hashbyte <<= 1;
-				if (subsec(I) > ave){
+				if (subsec[I] > ave){
 					hashbyte |= 0x01;
-					nb_ones++;
-				} else {
-					nb_zeros++;
 				}
 				bit_index++;
 				if ((bit_index%8) == 0){
@@ -953,8 +2670,185 @@ uint8_t* ph_mh_imagehash(const char *filename, int &N,float alpha, float lvl){
 		}
 	}
 
+    return 0;
+}
+
+uint8_t* _ph_mh_imagehash(const CImg<uint8_t> &src, int &N, float alpha, float lvl){
+    N = 0;
+    uint8_t *hash = (uint8_t*)malloc(MHHashLength*sizeof(uint8_t));
+    if (!hash){
+	return NULL;
+    }
+    CImg<uint8_t> img;
+    ph_mh_preprocess(src, img);
+    if (ph_mh_hash_plane(img.data(), alpha, lvl, hash) < 0){
+	free(hash);
+	return NULL;
+    }
+    N = MHHashLength;
     return hash;
 }
+
+uint8_t* ph_mh_imagehash(const char *filename, int &N,float alpha, float lvl){
+    if (filename == NULL){
+	return NULL;
+    }
+    CImg<uint8_t> src(filename);
+    return _ph_mh_imagehash(src, N, alpha, lvl);
+}
+
+/* the scales of a multi-scale MH hash, each thread takes the next scale in turn */
+typedef struct ph_mh_scale_job {
+    const uint8_t *plane;
+    const float *alphas;
+    const float *levels;
+    int nbscales;
+    int next;
+    int nbfailed;
+    uint8_t *hashes;
+} MHScaleJob;
+
+static void *ph_mh_scale_thread(void *p){
+    MHScaleJob *job = (MHScaleJob*)p;
+    int i;
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nbscales){
+	if (ph_mh_hash_plane(job->plane, job->alphas[i], job->levels[i], job->hashes + i*MHHashLength) < 0)
+	    __sync_fetch_and_add(&job->nbfailed, 1);
+    }
+    return NULL;
+}
+
+uint8_t* _ph_mh_imagehashes(const CImg<uint8_t> &src, const float *alphas, const float *levels, int nbscales,
+			    int &N, int threads){
+    N = 0;
+    if (!alphas || !levels || nbscales <= 0){
+	return NULL;
+    }
+    uint8_t *hashes = (uint8_t*)malloc(nbscales*MHHashLength*sizeof(uint8_t));
+    if (!hashes){
+	return NULL;
+    }
+    CImg<uint8_t> img;
+    ph_mh_preprocess(src, img);
+
+    MHScaleJob job;
+    job.plane = img.data();
+    job.alphas = alphas;
+    job.levels = levels;
+    job.nbscales = nbscales;
+    job.next = 0;
+    job.nbfailed = 0;
+    job.hashes = hashes;
+    int num_threads = 1;
+#ifdef HAVE_PTHREAD
+    num_threads = (threads > 0) ? threads : ph_num_threads();
+#endif
+    if (num_threads > nbscales){
+	num_threads = nbscales;
+    }
+#ifdef HAVE_PTHREAD
+    if (num_threads > 1){
+	pthread_t thds[num_threads];
+	int started[num_threads];
+	for (int n=1;n<num_threads;n++){
+	    started[n] = (pthread_create(&thds[n], NULL, ph_mh_scale_thread, &job) == 0);
+	}
+	ph_mh_scale_thread(&job);
+	for (int n=1;n<num_threads;n++){
+	    if (started[n]){
+		pthread_join(thds[n], NULL);
+	    }
+	}
+    } else {
+	ph_mh_scale_thread(&job);
+    }
+#else
+    ph_mh_scale_thread(&job);
+#endif
+
+    if (job.nbfailed > 0){
+	free(hashes);
+	return NULL;
+    }
+    N = MHHashLength;
+    return hashes;
+}
+
+uint8_t* ph_mh_imagehashes(const char *filename, const float *alphas, const float *levels, int nbscales,
+			   int &N, int threads){
+    if (filename == NULL){
+	return NULL;
+    }
+    CImg<uint8_t> src(filename);
+    return _ph_mh_imagehashes(src, alphas, levels, nbscales, N, threads);
+}
+
+int _ph_image_features(const CImg<uint8_t> &src, int kinds, ImageFeatures &features, float alpha, float lvl,
+		       double sigma, double gamma, int N){
+    features.kinds = 0;
+    features.dct_hash = 0;
+    features.mh_hash = NULL;
+    features.mh_length = 0;
+    features.digest.id = NULL;
+    features.digest.coeffs = NULL;
+    features.digest.size = 0;
+
+    /* each hash takes the Y channel of a color image or the only channel of a gray
+       one, so that plane is made once; for other images each hash converts for itself */
+    CImg<uint8_t> luma;
+    const CImg<uint8_t> *img = &src;
+    if (src.spectrum() == 3){
+	luma = src.get_RGBtoYCbCr().channel(0);
+	img = &luma;
+    }
+
+    if (kinds & PH_HASH_DCT){
+	if (_ph_dct_imagehash(*img, features.dct_hash) == 0)
+	    features.kinds |= PH_HASH_DCT;
+    }
+    if (kinds & PH_HASH_MH){
+	features.mh_hash = _ph_mh_imagehash(*img, features.mh_length, alpha, lvl);
+	if (features.mh_hash)
+	    features.kinds |= PH_HASH_MH;
+    }
+    if (kinds & PH_HASH_RADON){
+	if (_ph_image_digest(*img, sigma, gamma, features.digest, N) == EXIT_SUCCESS)
+	    features.kinds |= PH_HASH_RADON;
+	else {
+	    free(features.digest.coeffs);
+	    features.digest.coeffs = NULL;
+	    features.digest.size = 0;
+	}
+    }
+    return (features.kinds == kinds) ? 0 : -1;
+}
+
+int ph_image_features(const char *file, int kinds, ImageFeatures &features, float alpha, float lvl,
+		      double sigma, double gamma, int N){
+    features.kinds = 0;
+    features.mh_hash = NULL;
+    features.digest.coeffs = NULL;
+    if (!file){
+	return -1;
+    }
+    CImg<uint8_t> src;
+    try {
+	src.load(file);
+    } catch (CImgIOException ex){
+	return -1;
+    }
+    return _ph_image_features(src, kinds, features, alpha, lvl, sigma, gamma, N);
+}
+
+void ph_free_image_features(ImageFeatures &features){
+    free(features.mh_hash);
+    free(features.digest.coeffs);
+    features.mh_hash = NULL;
+    features.mh_length = 0;
+    features.digest.coeffs = NULL;
+    features.digest.size = 0;
+    features.kinds = 0;
+}
 #endif
 
 char** ph_readfilenames(const char *dirname,int &count){
@@ -1108,7 +3002,7 @@ void ph_mvp_init(MVPFile *m)
 	#else
 		m->pgsize = getpagesize();
 	#endif
-		
+	m->nbcalcs = NULL;
 }	
 int ph_sizeof_dp(DP *dp,MVPFile *m){
     if (dp == NULL){
@@ -1163,28 +3057,385 @@ off_t ph_save_datapoint(DP *dp, MVPFile *m){
 }
 
 
-MVPRetCode _ph_map_mvpfile(uint8_t filenumber, off_t offset, MVPFile *m,MVPFile *m2){
+static bool keepStats = false;
+static ph_stats mvpStats;      /* avg_atime holds the total until read by ph_get_stats */
+
+/* index of the bin holding distance d, given the ascending pivots of a node -
+   the first pivot that d does not exceed, or nbpivots if d exceeds them all */
+static int ph_mvp_bin(const float *pivots, int nbpivots, float d){
+    int lo = 0, hi = nbpivots;
+    while (lo < hi){
+	int mid = (lo + hi) >> 1;
+	if (d <= pivots[mid])
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return lo;
+}
 
-    m2->filename = strdup(m->filename);
-    m2->branchfactor = m->branchfactor;
-    m2->leafcapacity = m->leafcapacity;
-    m2->pathlength = m->pathlength;
-    m2->hash_type = m->hash_type;
-    m2->hashdist = m->hashdist;
-    m2->pgsize = m->pgsize;
-    m2->nbdbfiles = m->nbdbfiles;
-    m2->file_pos = offset;
-    m2->filenumber = filenumber;
-    if (filenumber == m->filenumber){ /* advance to offset in same file */
-	off_t page_mask = ~(m->pgsize - 1);
-	off_t page_offset = offset & page_mask;
+/* page cache for tree traversal - keeps the pages mapped by queries around between
+   queries, up to a memory budget, and evicts unpinned pages with the CLOCK algorithm */
+typedef struct ph_page_entry {
+    char *filename;        /* key: tree filename, file number and page offset */
+    uint8_t filenumber;
+    off_t offset;
+    off_t pgsize;
+    char *buf;
+    int refs;              /* number of maps using the page */
+    int referenced;        /* CLOCK reference bit */
+    int pinned;            /* page of a top level node, never evicted */
+    int dead;              /* dropped while in use, unmapped by the last release */
+    int slot;              /* position in the CLOCK ring */
+    struct ph_page_entry *next;   /* key hash chain */
+    struct ph_page_entry *bnext;  /* buf hash chain */
+} PageEntry;
+
+/* file descriptor kept open for mapping pages of file filenumber of a tree */
+typedef struct ph_cache_file {
+    char *filename;
+    uint8_t filenumber;
+    int fd;
+} CacheFile;
+
+const int CacheBuckets = 1 << 16;
+
+static struct {
+    off_t budget;          /* bytes, 0 when the cache is off */
+    off_t used;
+    int pin_levels;
+    PageEntry **slots;
+    int nbslots, hand;
+    int *freeslots;
+    int nbfree;
+    PageEntry **keyhash;
+    PageEntry **bufhash;
+    CacheFile *files;
+    int nbfiles, capfiles;
+} pageCache = { 0, 0, 2, NULL, 0, 0, NULL, 0, NULL, NULL, NULL, 0, 0 };
+
+static int mvpPrefetch = 1;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t pageCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void ph_cache_lock(){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&pageCacheLock);
+#endif
+}
+
+static void ph_cache_unlock(){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&pageCacheLock);
+#endif
+}
+
+static int ph_cache_enabled(){
+    return (pageCache.budget > 0);
+}
+
+static uint32_t ph_cache_keyhash(const char *filename, uint8_t filenumber, off_t offset){
+    uint32_t h = 2166136261U;
+    for (;*filename;filename++){
+	h ^= (uint8_t)*filename;
+	h *= 16777619U;
+    }
+    h ^= filenumber;
+    h *= 16777619U;
+    h ^= (uint32_t)offset ^ (uint32_t)((ulong64)offset >> 32);
+    h *= 16777619U;
+    return h & (CacheBuckets - 1);
+}
+
+static uint32_t ph_cache_bufhash(const char *buf){
+    uintptr_t p = (uintptr_t)buf >> 12;
+    return (uint32_t)((p ^ (p >> 16)) & (CacheBuckets - 1));
+}
+
+/* take e out of the key hash, so it can no longer be found by ph_cache_get */
+static void ph_cache_unlink_key(PageEntry *e){
+    PageEntry **pe = &pageCache.keyhash[ph_cache_keyhash(e->filename, e->filenumber, e->offset)];
+    while (*pe && *pe != e){
+	pe = &(*pe)->next;
+    }
+    if (*pe){
+	*pe = e->next;
+    }
+}
+
+static void ph_cache_remove(PageEntry *e){
+    if (!e->dead){
+	ph_cache_unlink_key(e);
+    }
+    PageEntry **pe = &pageCache.bufhash[ph_cache_bufhash(e->buf)];
+    while (*pe && *pe != e){
+	pe = &(*pe)->bnext;
+    }
+    if (*pe){
+	*pe = e->bnext;
+    }
+    munmap(e->buf, e->pgsize);
+    pageCache.used -= e->pgsize;
+    pageCache.slots[e->slot] = NULL;
+    pageCache.freeslots[pageCache.nbfree++] = e->slot;
+    free(e->filename);
+    free(e);
+}
+
+/* evict unreferenced, unpinned pages until need more bytes fit in the budget */
+static void ph_cache_evict(off_t need){
+    int scanned = 0;
+    while ((pageCache.used + need > pageCache.budget) && (scanned < 2*pageCache.nbslots)){
+	PageEntry *e = pageCache.slots[pageCache.hand];
+	pageCache.hand = (pageCache.hand + 1) % pageCache.nbslots;
+	scanned++;
+	if (!e || (e->refs > 0) || e->pinned){
+	    continue;
+	}
+	if (e->referenced){
+	    e->referenced = 0;
+	    continue;
+	}
+	ph_cache_remove(e);
+    }
+}
+
+/* descriptor of file filenumber of the tree, opened on first use. Lock held. */
+static int ph_cache_fd(const char *filename, uint8_t filenumber){
+    for (int i=0;i<pageCache.nbfiles;i++){
+	if ((pageCache.files[i].filenumber == filenumber) && !strcmp(pageCache.files[i].filename, filename)){
+	    return pageCache.files[i].fd;
+	}
+    }
+    if (pageCache.nbfiles == pageCache.capfiles){
+	int capfiles = (pageCache.capfiles > 0) ? 2*pageCache.capfiles : 16;
+	CacheFile *files = (CacheFile*)realloc(pageCache.files, capfiles*sizeof(CacheFile));
+	if (!files){
+	    return -1;
+	}
+	pageCache.files = files;
+	pageCache.capfiles = capfiles;
+    }
+    char extfile[256];
+    if (filenumber == 0){
+	snprintf(extfile, sizeof(extfile), "%s.mvp", filename);
+    } else {
+	snprintf(extfile, sizeof(extfile), "%s%d.mvp", filename, filenumber);
+    }
+    int fd = open(extfile, O_RDONLY);
+    if (fd < 0){
+	return -1;
+    }
+    CacheFile *f = &pageCache.files[pageCache.nbfiles++];
+    f->filename = strdup(filename);
+    f->filenumber = filenumber;
+    f->fd = fd;
+    return fd;
+}
+
+static PageEntry* ph_cache_lookup(const char *filename, uint8_t filenumber, off_t page_offset){
+    if (!pageCache.keyhash){
+	return NULL;
+    }
+    uint32_t h = ph_cache_keyhash(filename, filenumber, page_offset);
+    for (PageEntry *e = pageCache.keyhash[h];e;e = e->next){
+	if ((e->filenumber == filenumber) && (e->offset == page_offset) && !strcmp(e->filename, filename)){
+	    return e;
+	}
+    }
+    return NULL;
+}
+
+/* drop all the pages of filename, or of all files if filename is NULL */
+static void ph_cache_drop(const char *filename){
+    for (int i=0;i<pageCache.nbfiles;){
+	if (filename && strcmp(pageCache.files[i].filename, filename)){
+	    i++;
+	    continue;
+	}
+	close(pageCache.files[i].fd);
+	free(pageCache.files[i].filename);
+	pageCache.files[i] = pageCache.files[--pageCache.nbfiles];
+    }
+    for (int i=0;i<pageCache.nbslots;i++){
+	PageEntry *e = pageCache.slots[i];
+	if (!e || e->dead || (filename && strcmp(e->filename, filename))){
+	    continue;
+	}
+	if (e->refs > 0){
+	    ph_cache_unlink_key(e);
+	    e->dead = 1;
+	} else {
+	    ph_cache_remove(e);
+	}
+    }
+}
+
+/* map the page at page_offset in file filenumber of the tree, from the cache if
+   possible. pgsize 0 reads the page size from the header of the main file.
+   Pages of nodes less than pin_levels deep stay in the cache. Lock held. */
+static char* ph_cache_get(const char *filename, uint8_t filenumber, off_t page_offset, off_t pgsize, int level){
+    if (!pageCache.keyhash){
+	pageCache.keyhash = (PageEntry**)calloc(CacheBuckets, sizeof(PageEntry*));
+	pageCache.bufhash = (PageEntry**)calloc(CacheBuckets, sizeof(PageEntry*));
+	if (!pageCache.keyhash || !pageCache.bufhash){
+	    free(pageCache.keyhash);
+	    free(pageCache.bufhash);
+	    pageCache.keyhash = pageCache.bufhash = NULL;
+	    return NULL;
+	}
+    }
+    PageEntry *e = ph_cache_lookup(filename, filenumber, page_offset);
+    if (e){
+	e->refs++;
+	e->referenced = 1;
+	if (keepStats)
+	    __sync_fetch_and_add(&mvpStats.cache_hits, 1);
+	return e->buf;
+    }
+
+    int fd = ph_cache_fd(filename, filenumber);
+    if (fd < 0){
+	return NULL;
+    }
+    if (pgsize == 0){ /* int_pgsize follows the tag and version in the header */
+	int int_pgsize = 0;
+	if (pread(fd, &int_pgsize, sizeof(int), 16 + sizeof(int)) != sizeof(int)
+	    || (int_pgsize <= 0) || (int_pgsize & (int_pgsize - 1))){
+	    return NULL;
+	}
+	pgsize = int_pgsize;
+    }
+
+    /* make room, growing the CLOCK ring if every slot is taken */
+    ph_cache_evict(pgsize);
+    if (pageCache.nbfree == 0){
+	int nbslots = (pageCache.nbslots > 0) ? 2*pageCache.nbslots : 1024;
+	PageEntry **slots = (PageEntry**)realloc(pageCache.slots, nbslots*sizeof(PageEntry*));
+	int *freeslots = (int*)realloc(pageCache.freeslots, nbslots*sizeof(int));
+	if (slots){
+	    pageCache.slots = slots;
+	}
+	if (freeslots){
+	    pageCache.freeslots = freeslots;
+	}
+	if (!slots || !freeslots){
+	    return NULL;
+	}
+	for (int i=nbslots-1;i>=pageCache.nbslots;i--){
+	    pageCache.slots[i] = NULL;
+	    pageCache.freeslots[pageCache.nbfree++] = i;
+	}
+	pageCache.nbslots = nbslots;
+    }
+
+    e = (PageEntry*)calloc(1, sizeof(PageEntry));
+    if (!e){
+	return NULL;
+    }
+    e->buf = (char*)mmap(NULL, pgsize, PROT_READ, MAP_SHARED, fd, page_offset);
+    if (e->buf == MAP_FAILED){
+	free(e);
+	return NULL;
+    }
+    madvise(e->buf, pgsize, MADV_RANDOM);
+    e->filename = strdup(filename);
+    e->filenumber = filenumber;
+    e->offset = page_offset;
+    e->pgsize = pgsize;
+    e->refs = 1;
+    e->referenced = 1;
+    e->pinned = (level >= 0) && (level/2 < pageCache.pin_levels);
+    e->slot = pageCache.freeslots[--pageCache.nbfree];
+    pageCache.slots[e->slot] = e;
+    uint32_t h = ph_cache_keyhash(filename, filenumber, page_offset);
+    e->next = pageCache.keyhash[h];
+    pageCache.keyhash[h] = e;
+    uint32_t bh = ph_cache_bufhash(e->buf);
+    e->bnext = pageCache.bufhash[bh];
+    pageCache.bufhash[bh] = e;
+    pageCache.used += pgsize;
+    return e->buf;
+}
+
+/* done with a page from ph_cache_get. Lock held. */
+static void ph_cache_release(char *buf){
+    PageEntry *e = pageCache.bufhash ? pageCache.bufhash[ph_cache_bufhash(buf)] : NULL;
+    while (e && (e->buf != buf)){
+	e = e->bnext;
+    }
+    if (!e){
+	return;
+    }
+    e->refs--;
+    if (e->dead && (e->refs == 0)){
+	ph_cache_remove(e);
+    } else if (pageCache.used > pageCache.budget){
+	ph_cache_evict(0);
+    }
+}
+
+/* start reading the pages of n child nodes in the background, through the descriptors
+   already open - of the query page cache, skipping the pages it holds, or of the node */
+static void ph_prefetch_pages(MVPFile *m, const uint8_t *files, const off_t *offsets, int n){
+#ifdef POSIX_FADV_WILLNEED
+    if (m->fd < 0){
+	ph_cache_lock();
+	for (int i=0;i<n;i++){
+	    off_t page_offset = offsets[i] & ~(m->pgsize - 1);
+	    if (!ph_cache_lookup(m->filename, files[i], page_offset)){
+		int fd = ph_cache_fd(m->filename, files[i]);
+		if (fd >= 0)
+		    posix_fadvise(fd, page_offset, m->pgsize, POSIX_FADV_WILLNEED);
+	    }
+	}
+	ph_cache_unlock();
+    } else {
+	/* children in other files are read when they are mapped */
+	for (int i=0;i<n;i++){
+	    if (files[i] == m->filenumber)
+		posix_fadvise(m->fd, offsets[i] & ~(m->pgsize - 1), m->pgsize, POSIX_FADV_WILLNEED);
+	}
+    }
+#endif
+}
+
+MVPRetCode _ph_map_mvpfile(uint8_t filenumber, off_t offset, MVPFile *m,MVPFile *m2, int level){
+    if (keepStats)
+	__sync_fetch_and_add(&mvpStats.reads, 1);
+
+    m2->filename = strdup(m->filename);
+    m2->branchfactor = m->branchfactor;
+    m2->leafcapacity = m->leafcapacity;
+    m2->pathlength = m->pathlength;
+    m2->hash_type = m->hash_type;
+    m2->hashdist = m->hashdist;
+    m2->nbcalcs = m->nbcalcs;
+    m2->pgsize = m->pgsize;
+    m2->nbdbfiles = m->nbdbfiles;
+    m2->file_pos = offset;
+    m2->filenumber = filenumber;
+    if ((level >= 0) && (m->fd < 0)){ /* parent came from the page cache, so does the child */
+	off_t page_offset = offset & ~(m->pgsize - 1);
+	m2->fd = -1;
+	ph_cache_lock();
+	m2->buf = ph_cache_get(m->filename, filenumber, page_offset, m->pgsize, level);
+	ph_cache_unlock();
+	if (m2->buf == NULL){
+	    free(m2->filename);
+	    return PH_ERRMMAP;
+	}
+    } else if (filenumber == m->filenumber){ /* advance to offset in same file */
+	off_t page_mask = ~(m->pgsize - 1);
+	off_t page_offset = offset & page_mask;
         m2->fd = m->fd;
 	m2->buf = (char*)mmap(NULL,m2->pgsize,PROT_WRITE|PROT_READ,MAP_SHARED,m2->fd, page_offset);
-	madvise(m2->buf,m2->pgsize,MADV_SEQUENTIAL);
 	if (m2->buf == MAP_FAILED){
 	    return PH_ERRMMAP;
 	}
-	
+	madvise(m2->buf,m2->pgsize,MADV_RANDOM);
     } else { /* open and map to new file denoted by m->filename and filenumber */
 	off_t page_mask = ~(m->pgsize - 1);
         char extfile[256];
@@ -1195,7 +3446,7 @@ MVPRetCode _ph_map_mvpfile(uint8_t filenumber, off_t offset, MVPFile *m,MVPFile
 	if (m2->buf == MAP_FAILED){
 	    return PH_ERRMMAP;
 	}
-	madvise(m2->buf, m2->pgsize, MADV_SEQUENTIAL);
+	madvise(m2->buf, m2->pgsize, MADV_RANDOM);
     }
     return PH_SUCCESS;
 }
@@ -1204,6 +3455,12 @@ MVPRetCode _ph_map_mvpfile(uint8_t filenumber, off_t offset, MVPFile *m,MVPFile
 
 MVPRetCode _ph_unmap_mvpfile(uint8_t filenumber, off_t orig_pos, MVPFile *m, MVPFile *m2){
     free(m2->filename);
+    if (m2->fd < 0){ /* page cache, no writes to sync */
+	ph_cache_lock();
+	ph_cache_release(m2->buf);
+	ph_cache_unlock();
+	return PH_SUCCESS;
+    }
     msync(m2->buf,m2->pgsize,MS_SYNC);
     munmap(m2->buf,m2->pgsize);
     if (m->filenumber != m2->filenumber){
@@ -1230,6 +3487,13 @@ float hammingdistance(DP *pntA, DP *pntB){
 }
 
 
+/* distance from the query to a point of the tree, counted in m->nbcalcs when it is set */
+static inline float ph_mvp_querydist(MVPFile *m, DP *query, DP *dp){
+    if (m->nbcalcs)
+	(*m->nbcalcs)++;
+    return m->hashdist(query, dp);
+}
+
 MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, float threshold,
                                               DP **results, int &nbfound, int level){
     MVPRetCode ret = PH_SUCCESS;
@@ -1243,6 +3507,14 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
     if (!hashdist)
 	return PH_ERRNULLARG;
 
+    if (keepStats){
+	/* shard queries run concurrently, so raise the maximum with a cas loop */
+	ulong64 h = level/2 + 1, cur;
+	while ((cur = mvpStats.height) < h
+	       && !__sync_bool_compare_and_swap(&mvpStats.height, cur, h))
+	    ;
+    }
+
     off_t offset_mask, page_mask;
 
     offset_mask = m->pgsize - 1;
@@ -1255,7 +3527,7 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
     if (ntype == 0){ /* leaf */
 	DP *sv1 = ph_read_datapoint(m);
 	DP *sv2 = ph_read_datapoint(m);
-	float d1 = hashdist(query,sv1);
+	float d1 = ph_mvp_querydist(m, query, sv1);
 	/* check if distance(sv1,query) <= radius  */
 	if (d1 <= threshold){
 	    results[nbfound++] = sv1;
@@ -1270,7 +3542,7 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
 	}
 	
 	if (sv2){
-	    float d2 = hashdist(query,sv2);
+	    float d2 = ph_mvp_querydist(m, query, sv2);
 	    /* check if distance(sv2,query) <= radius */
 	    if (d2 <= threshold){
 		results[nbfound++] = sv2;
@@ -1326,7 +3598,7 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
 			    }
 			}
 		    } 
-		    if (include && (hashdist(query,dp) <= threshold)){
+		    if (include && (ph_mvp_querydist(m, query, dp) <= threshold)){
 			results[nbfound++] = dp;
                         if (nbfound >= knearest){
 			    return PH_ERRCAP;
@@ -1363,8 +3635,8 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
 	memcpy(M2, &m->buf[m->file_pos & offset_mask], LengthM2*sizeof(float));
 	m->file_pos += LengthM2*sizeof(float);
 
-	float d1 = hashdist(query, sv1);
-	float d2 = hashdist(query, sv2);
+	float d1 = ph_mvp_querydist(m, query, sv1);
+	float d2 = ph_mvp_querydist(m, query, sv2);
 	
 	/* fill in path values in query */
 	if (level < m->pathlength)
@@ -1376,6 +3648,8 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
 	if (d1 <= threshold){
 	    results[nbfound++] = sv1;
 	    if (nbfound >= knearest){
+		free(M1);
+		free(M2);
 		return PH_ERRCAP;
 	    }
 	} else {
@@ -1388,6 +3662,8 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
 	if (d2 <= threshold){
 	    results[nbfound++] = sv2;
 	    if (nbfound >= knearest){
+		free(M1);
+		free(M2);
 		return PH_ERRCAP;
 	    }
 	} else {
@@ -1397,124 +3673,53 @@ MVPRetCode _ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius,
 	    ph_free_datapoint(sv2);
 	}
 
-	/* based on d1,d2 values, find appropriate child nodes to explore */
-	
-	int pivot1, pivot2;
-	uint8_t filenumber;
-	off_t child_pos, curr_pos;
+	/* based on d1,d2 values, find appropriate child nodes to explore - the
+	   bins from bin(d-radius) to bin(d+radius) in each tier of pivots */
+	uint8_t child_files[MaxBranchFactor*MaxBranchFactor];
+	off_t child_offsets[MaxBranchFactor*MaxBranchFactor];
+	int nbchildren = 0;
 	off_t start_pos = m->file_pos;
-	off_t orig_pos;
-        MVPFile m2;
-	/* check <= each M1 pivot */
-	for (pivot1=0;pivot1 < LengthM1;pivot1++){
-	    if (d1-radius <= M1[pivot1]){
-		/* check <= each M2 pivot */
-		for (pivot2=0;pivot2<LengthM1;pivot2++){
-		    if (d2 - radius <= M2[pivot2+pivot1*LengthM1]){
-			/*determine pos from which to read filenumber and offset */
-			curr_pos = start_pos + (pivot2+pivot1*(m->branchfactor))*(sizeof(uint8_t)+sizeof(off_t));
-			m->file_pos = curr_pos;
-			memcpy(&filenumber,&(m->buf[m->file_pos&offset_mask]),sizeof(uint8_t));
-                        m->file_pos++;
-			memcpy(&child_pos,&(m->buf[m->file_pos&offset_mask]),sizeof(off_t));
-                        m->file_pos += sizeof(off_t);
-
-                        if ((filenumber == 0) && (child_pos == 0)){
-                            continue;
-			}
-			/*save position and remap to new file/position  */
-			ret = _ph_map_mvpfile(filenumber,child_pos, m, &m2);
-			if (ret == PH_SUCCESS){
-			   ret = _ph_query_mvptree(&m2,query,knearest,radius,threshold,results,nbfound,level+2);
-			   /* unmap and remap to the origional file/position */
-			   ret = _ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-			} else {
-                            goto querycleanup;
-			}
-			
-		    }
-		}
-		/* check > last M2 */
-		if (d2+radius >= M2[LengthM1-1+pivot1*LengthM1]){
-
-		    /*determine position from which to read filenumber and offset */
-		    curr_pos = start_pos + (m->branchfactor-1+pivot1*(m->branchfactor))*(sizeof(uint8_t)+sizeof(off_t));
-		    m->file_pos = curr_pos;
-		    memcpy(&filenumber,&m->buf[m->file_pos&offset_mask],sizeof(uint8_t));
-		    m->file_pos++;
-		    memcpy(&child_pos,&m->buf[m->file_pos&offset_mask],sizeof(off_t));
-		    m->file_pos += sizeof(off_t);
-
-                    if ((filenumber == 0) && (child_pos == 0)){
-                        continue;
-		    }
+	int lo1 = ph_mvp_bin(M1, LengthM1, d1 - radius);
+	int hi1 = ph_mvp_bin(M1, LengthM1, d1 + radius);
+	for (int pivot1=lo1;pivot1 <= hi1;pivot1++){
+	    const float *row = M2 + pivot1*LengthM1;
+	    int lo2 = ph_mvp_bin(row, LengthM1, d2 - radius);
+	    int hi2 = ph_mvp_bin(row, LengthM1, d2 + radius);
+	    for (int pivot2=lo2;pivot2 <= hi2;pivot2++){
+		uint8_t filenumber;
+		off_t child_pos;
+		/*determine pos from which to read filenumber and offset */
+		m->file_pos = start_pos + (pivot2+pivot1*(m->branchfactor))*(sizeof(uint8_t)+sizeof(off_t));
+		memcpy(&filenumber,&(m->buf[m->file_pos&offset_mask]),sizeof(uint8_t));
+		m->file_pos++;
+		memcpy(&child_pos,&(m->buf[m->file_pos&offset_mask]),sizeof(off_t));
+		m->file_pos += sizeof(off_t);
 
-		    ret = _ph_map_mvpfile(filenumber, child_pos,m, &m2); 
-		    if (ret == PH_SUCCESS){
-			ret = _ph_query_mvptree(&m2,query,knearest,radius,threshold,results,nbfound,level+2);
-		        /*unmap and remap to original file/position  */
-			_ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-		    } else {
-			goto querycleanup;
-		    }
+		if ((filenumber == 0) && (child_pos == 0)){
+		    continue;
 		}
+		child_files[nbchildren] = filenumber;
+		child_offsets[nbchildren++] = child_pos;
 	    }
 	}
-	/* check >=  last M1 pivot */
-	if (d1+radius >= M1[LengthM1-1]){
-
-	    /* check <= each M2 pivot */
-	    for (pivot2=0;pivot2<LengthM1;pivot2++){
-		if (d2-radius <= M2[pivot2+LengthM1*LengthM1]){
-
-		    /*determine pos from which to read filenumber and position  */
-		    curr_pos = start_pos + (pivot2+LengthM1*(m->branchfactor))*(sizeof(uint8_t)+sizeof(off_t));
-		    m->file_pos = curr_pos;
-		    memcpy(&filenumber,&m->buf[m->file_pos&offset_mask],sizeof(uint8_t));
-		    m->file_pos++;
-		    memcpy(&child_pos,&m->buf[m->file_pos&offset_mask],sizeof(off_t));
-		    m->file_pos += sizeof(off_t);
 
+	/* queue reads of all the children before descending into the first, so the
+	   i/o of later siblings overlaps the work in the earlier ones */
+	if (mvpPrefetch && (nbchildren > 1)){
+	    ph_prefetch_pages(m, child_files, child_offsets, nbchildren);
+	}
 
-		    if ((filenumber == 0)&&(child_pos == 0)){
-                        continue;
-		    }
-		    /*save file position and remap to new filenumber/offset  */
-		    ret = _ph_map_mvpfile(filenumber, child_pos, m, &m2);
-		    if (ret == PH_SUCCESS){
-			ret = _ph_query_mvptree(&m2,query,knearest,radius,threshold,results,nbfound,level+2);
-		        /* unmap/remap to original filenumber/position */
-			_ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-		    } else {
-                        goto querycleanup;
-		    }
-		}
+	for (int i=0;i<nbchildren;i++){
+	    /* map to the child's file/position and query it */
+	    MVPFile m2;
+	    ret = _ph_map_mvpfile(child_files[i], child_offsets[i], m, &m2, level+2);
+	    if (ret != PH_SUCCESS){
+		goto querycleanup;
 	    }
-
-	    /* check >= last M2 pivot */
-	    if (d2+radius >= M2[LengthM1-1+LengthM1*LengthM1]){
-
-		/* determine position from which to read filenumber and child position */
-		curr_pos = start_pos + (m->branchfactor-1+LengthM1*(m->branchfactor))*(sizeof(uint8_t)+sizeof(off_t));
-		m->file_pos = curr_pos;
-		memcpy(&filenumber,&m->buf[m->file_pos&offset_mask],sizeof(uint8_t));
-		m->file_pos += sizeof(uint8_t);
-		memcpy(&child_pos,&m->buf[m->file_pos&offset_mask],sizeof(off_t));
-		m->file_pos += sizeof(off_t);
-
-		/* save position and remap to new filenumber/position */
-                if (!(filenumber == 0 && child_pos == 0)){
-		    ret = _ph_map_mvpfile(filenumber, child_pos, m, &m2);
-		    if (ret == PH_SUCCESS){
-			ret = _ph_query_mvptree(&m2,query,knearest,radius,threshold, results,nbfound,level+2);
-			/* return to original and remap to original filenumber/position */
-			ret = _ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-		    } else {
-			goto querycleanup;
-		    }
-		} else {
-                    goto querycleanup;
-		}
+	    ret = _ph_query_mvptree(&m2,query,knearest,radius,threshold,results,nbfound,level+2);
+	    _ph_unmap_mvpfile(child_files[i], start_pos, m, &m2);
+	    if (ret != PH_SUCCESS){ /* includes PH_ERRCAP, results is full */
+		goto querycleanup;
 	    }
 	}
     
@@ -1529,24 +3734,53 @@ querycleanup:
 }
 
 
-MVPRetCode ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, float threshold,
-                                               DP **results, int &nbfound){
+/* unmap the root page of a query, or hand it back to the page cache */
+static void ph_query_release_root(MVPFile *m, int cached){
+    if (cached){
+	ph_cache_lock();
+	ph_cache_release(m->buf);
+	ph_cache_unlock();
+    } else {
+	munmap(m->buf, m->pgsize);
+	close(m->fd);
+    }
+    m->buf = NULL;
+}
+
+/* query counting the distance calculations in nbcalcs, if not NULL */
+static MVPRetCode ph_query_mvptree_counted(MVPFile *m, DP *query, int knearest, float radius, float threshold,
+					   DP **results, int &nbfound, ulong64 *nbcalcs){
+    m->nbcalcs = nbcalcs;
     /*use host pg size until file pg size used can be determined  */
     m->pgsize = sysconf(_SC_PAGESIZE);
+    m->file_pos = 0;
 
-    char mainfile[256];
-    snprintf(mainfile, sizeof(mainfile),"%s.mvp", m->filename);
-    m->fd = open(mainfile, O_RDWR);
-    if (m->fd < 0){
-	return PH_ERRFILEOPEN;
-    }
+    /* the root page comes from the page cache if it is on, marked by fd = -1 */
+    int cached = ph_cache_enabled();
+    if (keepStats)
+	__sync_fetch_and_add(&mvpStats.reads, 1);
+    if (cached){
+	m->fd = -1;
+	ph_cache_lock();
+	m->buf = ph_cache_get(m->filename, 0, 0, 0, 0);
+	ph_cache_unlock();
+	if (m->buf == NULL){
+	    return PH_ERRMMAP;
+	}
+    } else {
+	char mainfile[256];
+	snprintf(mainfile, sizeof(mainfile),"%s.mvp", m->filename);
+	m->fd = open(mainfile, O_RDWR);
+	if (m->fd < 0){
+	    return PH_ERRFILEOPEN;
+	}
 
-    m->file_pos = 0;
-    m->buf=(char*)mmap(NULL,m->pgsize,PROT_READ|PROT_WRITE,MAP_SHARED,m->fd,m->file_pos);
-    if (m->buf == MAP_FAILED){
-	return PH_ERRMMAP;
+	m->buf=(char*)mmap(NULL,m->pgsize,PROT_READ|PROT_WRITE,MAP_SHARED,m->fd,m->file_pos);
+	if (m->buf == MAP_FAILED){
+	    return PH_ERRMMAP;
+	}
+	madvise(m->buf,m->pgsize,MADV_RANDOM);
     }
-    madvise(m->buf,m->pgsize,MADV_SEQUENTIAL);
 
     char tag[17];
     int version;
@@ -1576,8 +3810,14 @@ MVPRetCode ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, f
     
     memcpy(&type, &m->buf[m->file_pos++], 1);
 
+    if ((bf < MinBranchFactor) || (bf > MaxBranchFactor)){
+	ph_query_release_root(m, cached);
+	return PH_ERRFILETYPE;
+    }
+
     query->path = (float*)malloc(p*sizeof(float));
     if (query->path == NULL){
+	ph_query_release_root(m, cached);
         return PH_ERRMEMALLOC;
     }
     m->branchfactor = bf;
@@ -1586,16 +3826,19 @@ MVPRetCode ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, f
     m->hash_type = (HashType)type;
     m->nbdbfiles = nbdbfiles;
    
-    
+    if (!cached){ /* the cached root page is already int_pgsize long */
 #ifdef HAVE_MREMAP
-    m->buf = (char*)mremap(m->buf,m->pgsize,int_pgsize,MREMAP_MAYMOVE);
+	m->buf = (char*)mremap(m->buf,m->pgsize,int_pgsize,MREMAP_MAYMOVE);
 #else
-    munmap(m->buf, m->pgsize);
-    m->buf = (char*)mmap(m->buf,int_pgsize, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
+	munmap(m->buf, m->pgsize);
+	m->buf = (char*)mmap(m->buf,int_pgsize, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
 #endif
 
-    if (m->buf == MAP_FAILED){
-	return PH_ERRMMAP;
+	if (m->buf == MAP_FAILED){
+	    free(query->path);
+	    close(m->fd);
+	    return PH_ERRMMAP;
+	}
     }
 
     m->pgsize = int_pgsize;
@@ -1603,12 +3846,18 @@ MVPRetCode ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, f
     m->filenumber = 0;
     /* finish the query by calling the recursive auxiliary function */
     nbfound = 0;
+    struct timeval start, end;
+    if (keepStats)
+	gettimeofday(&start, NULL);
     MVPRetCode res = _ph_query_mvptree(m,query,knearest,radius,threshold, results,nbfound,0);
+    if (keepStats){
+	gettimeofday(&end, NULL);
+	__sync_fetch_and_add(&mvpStats.queries, 1);
+	__sync_fetch_and_add(&mvpStats.avg_atime, (ulong64)((end.tv_sec - start.tv_sec)*1000000
+							     + (end.tv_usec - start.tv_usec)));
+    }
 
-    munmap(m->buf, m->pgsize);
-    m->buf = NULL;
-
-    close(m->fd);
+    ph_query_release_root(m, cached);
     free(query->path);
 
     for (int i=0;i<nbfound;i++){
@@ -1617,10 +3866,16 @@ MVPRetCode ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, f
 
     m->fd = 0;
     m->file_pos = 0;
+    m->nbcalcs = NULL;
     
     return res;
 }
 
+MVPRetCode ph_query_mvptree(MVPFile *m, DP *query, int knearest, float radius, float threshold,
+                                               DP **results, int &nbfound){
+    return ph_query_mvptree_counted(m, query, knearest, radius, threshold, results, nbfound, NULL);
+}
+
 MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_flag, int level, FileIndex *pOffset){
     int Np = (nbpoints >= 2) ? nbpoints - 2 : 0; 
     int BranchFactor = m->branchfactor;
@@ -1709,13 +3964,13 @@ MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_f
         if (sv2_pos >= 0) sv2 = points[sv2_pos];
 
 	/* if file pos is beyond pg size*/
-	if ((m->file_pos & offset_mask) + ph_sizeof_dp(sv1,&m2) > m->pgsize)
+	if ((m2.file_pos & offset_mask) + ph_sizeof_dp(sv1,&m2) > m->pgsize)
 	    return PH_ERRSMPGSIZE;
 
 	ph_save_datapoint(sv1, &m2);
  
 	/*if file pos is beyond pg size */
-	if ((m->file_pos & offset_mask) + ph_sizeof_dp(sv2,&m2) > m->pgsize)
+	if ((m2.file_pos & offset_mask) + ph_sizeof_dp(sv2,&m2) > m->pgsize)
 	    return PH_ERRSMPGSIZE;
 
 	ph_save_datapoint(sv2, &m2);
@@ -1752,7 +4007,7 @@ MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_f
 	    m2.file_pos = last_pos;
 
 	    /* if file pos is beyond pg size */
-	    if ((m->file_pos & offset_mask) + ph_sizeof_dp(points[i],&m2) > m->pgsize)
+	    if ((m2.file_pos & offset_mask) + ph_sizeof_dp(points[i],&m2) > m->pgsize)
 		return PH_ERRSMPGSIZE;
 	    
 	    dp_pos = ph_save_datapoint(points[i], &m2);
@@ -1824,6 +4079,12 @@ MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_f
 
 	ph_save_datapoint(sv2, m);
 
+	/* check the pivots and child offsets fit in the rest of the page */
+	if ((m->file_pos & offset_mask) + (off_t)((LengthM1+LengthM2)*sizeof(float)
+	    + Fanout*(sizeof(uint8_t)+sizeof(off_t))) > m->pgsize){
+	    return PH_ERRSMPGSIZE;
+	}
+
         float max_distance = 0.0f, min_distance = (float)INT_MAX;
 	for (int i=0;i<nbpoints;i++){
             if (i != sv1_pos){
@@ -1894,19 +4155,8 @@ MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_f
 	    if (level < PathLength){
 		points[i]->path[level] = cur_dist;
 	    }
-	    /* check if <= M1[i] */
-	    for (int j=0;j < LengthM1;j++){
-		if (cur_dist <= M1[j]){
-		    bins[j][mlens[j]] = points[i];
-		    mlens[j]++;
-		    break;
-		}
-	    }
-	    /* check if > last M1[] pivot */
-	    if (cur_dist > M1[LengthM1-1]){
-		bins[BranchFactor-1][mlens[BranchFactor-1]] = points[i];
-		mlens[BranchFactor-1]++;
-	    }
+	    int bin = ph_mvp_bin(M1, LengthM1, cur_dist);
+	    bins[bin][mlens[bin]++] = points[i];
 	}
 
 	/* print 1st level sort bins 
@@ -1982,6 +4232,9 @@ MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_f
 		}
 	    }
 
+	    if (row_len == 0){ /* keep the pivots of an empty row ascending */
+		max_distance = min_distance = 0.0f;
+	    }
 	    step = (max_distance - min_distance)/BranchFactor;
 	    incr = step;
 	    
@@ -1994,20 +4247,8 @@ MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int saveall_f
 
 	    /* sort bins[i] into bins2 */
 	    for (int j=0;j < row_len; j++){
-		DP *current = bins[i][j];
-		/*check <= each M2 pivot  */
-		for (int k=0;k<LengthM1;k++){
-		    if (distance_vector[j] <= M2[k+i*LengthM1]){
-			bins2[k][mlens2[k]] = current;
-			mlens2[k]++;
-			break;
-		    }
-		}
-		/* check > last M2 pivot  */
-		if (distance_vector[j] > M2[LengthM1-1 + i*LengthM1]){
-		    bins2[BranchFactor-1][mlens2[BranchFactor-1]] = current;
-		    mlens2[BranchFactor-1]++;
-		}
+		int bin = ph_mvp_bin(M2 + i*LengthM1, LengthM1, distance_vector[j]);
+		bins2[bin][mlens2[bin]++] = bins[i][j];
 	    }
 	    
 	    /* print 2nd tier sort bins 
@@ -2087,6 +4328,9 @@ MVPRetCode ph_save_mvptree(MVPFile *m, DP **points, int nbpoints){
     if (nbpoints < m->leafcapacity + 2){
 	return PH_ERRARG;
     }
+    if ((m->branchfactor < MinBranchFactor) || (m->branchfactor > MaxBranchFactor)){
+	return PH_ERRARG;
+    }
 
     for (int i=0;i<nbpoints;i++){
 	points[i]->path = (float*)malloc((m->pathlength)*sizeof(float));
@@ -2095,6 +4339,11 @@ MVPRetCode ph_save_mvptree(MVPFile *m, DP **points, int nbpoints){
 	}
     }
 
+    /* cached pages of a previous tree of this name are stale */
+    ph_cache_lock();
+    ph_cache_drop(m->filename);
+    ph_cache_unlock();
+
     /* open main file */
     char mainfile[256];
     snprintf(mainfile, sizeof(mainfile),"%s.mvp", m->filename);
@@ -2281,7 +4530,7 @@ MVPRetCode _ph_add_mvptree(MVPFile *m, DP *new_dp, int level){
 		    points[Np+2] = new_dp;
 		    m->file_pos = start_pos;
                     FileIndex ChildIndex;
-		    ret = _ph_save_mvptree(m, points, Np+3, 0, level+2, &ChildIndex);
+		    ret = _ph_save_mvptree(m, points, Np+3, 0, level, &ChildIndex);
 		    for (int i=2;i<Np+2;i++){
                         free(points[i]->id);
                         free(points[i]->path);
@@ -2345,281 +4594,1847 @@ MVPRetCode _ph_add_mvptree(MVPFile *m, DP *new_dp, int level){
 	    return PH_ERRMEMALLOC;
 	}
 
-	memcpy(M1, &m->buf[m->file_pos & offset_mask], LengthM1*sizeof(float));
-	m->file_pos += LengthM1*sizeof(float);
+	memcpy(M1, &m->buf[m->file_pos & offset_mask], LengthM1*sizeof(float));
+	m->file_pos += LengthM1*sizeof(float);
+
+	memcpy(M2, &m->buf[m->file_pos & offset_mask], LengthM2*sizeof(float));
+	m->file_pos += LengthM2*sizeof(float);
+
+	if (level < m->pathlength)
+	    new_dp->path[level] = d1;
+	if (level+1 < m->pathlength)
+	    new_dp->path[level+1] = d2;
+
+	free(sv1->id);
+        free(sv1->path);
+        free(sv1->hash);
+	ph_free_datapoint(sv1);
+
+        free(sv2->id);
+        free(sv2->path);
+        free(sv2->hash);
+	ph_free_datapoint(sv2);
+
+	/* descend into the child whose bins hold d1 and d2 */
+	int pivot1 = ph_mvp_bin(M1, LengthM1, d1);
+	int pivot2 = ph_mvp_bin(M2 + pivot1*LengthM1, LengthM1, d2);
+	uint8_t filenumber;
+	off_t child_pos;
+	off_t curr_pos = m->file_pos + (pivot2+pivot1*m->branchfactor)*(sizeof(uint8_t)+sizeof(off_t));
+	m->file_pos = curr_pos;
+	memcpy(&filenumber,&m->buf[m->file_pos & offset_mask],sizeof(uint8_t));
+	m->file_pos++;
+	memcpy(&child_pos,&m->buf[m->file_pos & offset_mask], sizeof(off_t));
+	m->file_pos += sizeof(off_t);
+
+	if ((filenumber == 0) && (child_pos == 0)){ /* empty child, start a new leaf */
+	    FileIndex child_offset;
+	    ret = _ph_save_mvptree(m, &new_dp, 1, 0, level+2, &child_offset);
+	    if (ret == PH_SUCCESS){
+		memcpy(&m->buf[curr_pos++ & offset_mask], &(child_offset.fileno), sizeof(uint8_t));
+		memcpy(&m->buf[curr_pos   & offset_mask], &(child_offset.offset), sizeof(off_t));
+	    }
+	} else {
+	    /* map to the child's file/position and add to it */
+	    MVPFile m2;
+	    ret = _ph_map_mvpfile(filenumber,child_pos,m,&m2);
+	    if (ret == PH_SUCCESS){
+		ret = _ph_add_mvptree(&m2, new_dp, level+2);
+		_ph_unmap_mvpfile(filenumber, curr_pos, m, &m2);
+	    }
+	}
+
+	free(M1);
+	free(M2);
+    } else {
+	ret = PH_ERRNTYPE;
+    }
+    return ret;
+}
+
+
+
+MVPRetCode ph_add_mvptree(MVPFile *m, DP **points, int nbpoints, int &nbsaved){
+    nbsaved = 0;
+    /* nodes may be rewritten, drop the cached pages of the tree */
+    ph_cache_lock();
+    ph_cache_drop(m->filename);
+    ph_cache_unlock();
+
+    /* open main file */
+    char mainfile[256];
+    snprintf(mainfile, sizeof(mainfile),"%s.mvp", m->filename);
+
+    m->fd = open(mainfile, O_RDWR);
+    if (m->fd < 0){
+	return PH_ERRFILEOPEN;
+    }
+
+    /*use host pg size until pg size of file can be read  */ 
+    m->pgsize = sysconf(_SC_PAGESIZE);
+
+    /* map to first page */
+    m->file_pos = 0;
+    m->buf  = (char*)mmap(NULL,m->pgsize,PROT_READ|PROT_WRITE,MAP_SHARED,m->fd,m->file_pos);
+    if (m->buf == MAP_FAILED){
+	return PH_ERRMMAP;
+    }
+    madvise(m->buf, m->pgsize,MADV_SEQUENTIAL);
+
+    /* read header within first HeaderSize bytes */
+    char tag[17];
+    int version;;
+    int int_pgsize;
+    int leaf_pgsize;
+    
+    memcpy(tag, &m->buf[m->file_pos], 16);
+    tag[16] = '\0';
+    m->file_pos += 16;
+    
+    memcpy(&version, &m->buf[m->file_pos], sizeof(int));
+    m->file_pos += sizeof(int);
+
+    memcpy(&int_pgsize, &m->buf[m->file_pos], sizeof(int));
+    m->file_pos += sizeof(int);
+
+    memcpy(&leaf_pgsize, &m->buf[m->file_pos], sizeof(int));
+    m->file_pos += sizeof(int);
+
+    off_t nb_pos = m->file_pos;
+    memcpy(&m->nbdbfiles, &m->buf[m->file_pos++], 1);
+
+    memcpy(&m->branchfactor, &m->buf[m->file_pos++], 1);
+
+    memcpy(&m->pathlength, &m->buf[m->file_pos++], 1);
+
+    memcpy(&m->leafcapacity, &m->buf[m->file_pos++], 1);
+
+    uint8_t type;
+    memcpy(&type, &m->buf[m->file_pos++], 1);
+    m->hash_type = (HashType)type;
+
+    if ((m->branchfactor < MinBranchFactor) || (m->branchfactor > MaxBranchFactor)){
+	munmap(m->buf, m->pgsize);
+	close(m->fd);
+	return PH_ERRFILETYPE;
+    }
+
+    m->file_pos = HeaderSize;
+
+    m->filenumber = 0;
+
+    for (int i=0;i < nbpoints;i++){
+	points[i]->path = (float*)malloc((m->pathlength)*sizeof(float));
+        if (points[i]->path == NULL){
+            return PH_ERRMEMALLOC;
+	}
+    }
+
+    /* remap to true pg size used in making file */
+#ifdef HAVE_REMAP
+    m->buf = (char*)mremap(m->buf, m->pgsize, int_pgsize, MREMAP_MAYMOVE);
+#else
+    munmap(m->buf, m->pgsize);
+    m->buf = (char*)mmap(m->buf, int_pgsize, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
+#endif
+    if (m->buf == MAP_FAILED){
+	return PH_ERRMMAP;
+    }
+
+    m->pgsize = int_pgsize;
+
+    MVPRetCode retval = PH_SUCCESS;
+    for (int i=0;i<nbpoints;i++){
+        m->file_pos = HeaderSize;
+	retval = _ph_add_mvptree(m, points[i], 0);
+	if (retval != PH_SUCCESS){
+            fprintf(stderr,"unable to add %d, retcode %d\n", i, retval);
+	    continue;
+	}
+	nbsaved++;
+    }
+
+    /* save new nbdbfiles if new files added */
+    memcpy(&m->buf[nb_pos], &m->nbdbfiles, 1);
+
+    if (msync(m->buf, m->pgsize, MS_SYNC) < 0){
+	return PH_ERRMSYNC;
+    }
+
+    munmap(m->buf, m->pgsize);
+    close(m->fd);
+
+    for (int i=0;i<nbpoints;i++){
+	free(points[i]->path);
+    }
+
+
+    return retval;
+}
+
+static void ph_tune_remove_files(const char *filename, int nbdbfiles){
+    char extfile[256];
+    snprintf(extfile, sizeof(extfile), "%s.mvp", filename);
+    unlink(extfile);
+    for (int i=1;i<=nbdbfiles;i++){
+	snprintf(extfile, sizeof(extfile), "%s%d.mvp", filename, i);
+	unlink(extfile);
+    }
+}
+
+static int ph_tune_cmp(const void *a, const void *b){
+    const MVPTuneResult *ra = (const MVPTuneResult*)a;
+    const MVPTuneResult *rb = (const MVPTuneResult*)b;
+    if (ra->retcode != rb->retcode){
+	return (ra->retcode == PH_SUCCESS) ? -1 : 1;
+    }
+    if (ra->avg_msecs != rb->avg_msecs){
+	return (ra->avg_msecs < rb->avg_msecs) ? -1 : 1;
+    }
+    if (ra->avg_calcs != rb->avg_calcs){
+	return (ra->avg_calcs < rb->avg_calcs) ? -1 : 1;
+    }
+    return 0;
+}
+
+/* build and query one candidate tree named tunefile, filling in the measurements of r */
+static MVPRetCode ph_tune_candidate(MVPFile *m, char *tunefile, DP **points, int nbpoints, DP **queries,
+				    int nbqueries, float radius, float threshold, int knearest, DP **found,
+				    MVPTuneResult *r){
+    MVPFile mt;
+    ph_mvp_init(&mt);
+    mt.filename = tunefile;
+    mt.hashdist = m->hashdist;
+    mt.hash_type = m->hash_type;
+    mt.branchfactor = r->branchfactor;
+    mt.pathlength = r->pathlength;
+    mt.leafcapacity = r->leafcapacity;
+    mt.pgsize = r->pgsize;
+    mt.nbdbfiles = 1;
+
+    MVPRetCode ret = ph_save_mvptree(&mt, points, nbpoints);
+    if (ret != PH_SUCCESS){
+	ph_tune_remove_files(tunefile, mt.nbdbfiles);
+	return ret;
+    }
+
+    ulong64 nbcalcs = 0;
+    double msecs = 0.0;
+    struct timeval start, end;
+    for (int i=0;i<nbqueries;i++){
+	int nbfound = 0;
+	MVPFile mq;
+	ph_mvp_init(&mq);
+	mq.filename = tunefile;
+	mq.hashdist = m->hashdist;
+	mq.hash_type = m->hash_type;
+
+	/* the query fills in its own path array */
+	DP query = *queries[i];
+	query.path = NULL;
+	gettimeofday(&start, NULL);
+	ret = ph_query_mvptree_counted(&mq, &query, knearest, radius, threshold, found, nbfound, &nbcalcs);
+	gettimeofday(&end, NULL);
+	msecs += (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+
+	for (int j=0;j<nbfound;j++){
+	    free(found[j]->id);
+	    free(found[j]->hash);
+	    ph_free_datapoint(found[j]);
+	}
+	if (ret == PH_ERRCAP){
+	    ret = PH_SUCCESS;
+	}
+	if (ret != PH_SUCCESS){
+	    break;
+	}
+    }
+    ph_tune_remove_files(tunefile, mt.nbdbfiles);
+
+    r->avg_calcs = (float)nbcalcs/(float)nbqueries;
+    r->avg_msecs = msecs/nbqueries;
+    return ret;
+}
+
+MVPRetCode ph_mvp_tune(MVPFile *m, DP **points, int nbpoints, DP **queries, int nbqueries,
+		       float radius, float threshold, int knearest, const MVPTuneParams *params,
+		       MVPTuneResult **results, int &nbresults, int apply){
+    nbresults = 0;
+    if (!m || !m->filename || !m->hashdist || !points || !queries || !results){
+	return PH_ERRNULLARG;
+    }
+    if ((nbpoints <= 0) || (nbqueries <= 0) || (knearest <= 0)){
+	return PH_ERRARG;
+    }
+    *results = NULL;
+
+    off_t host_pgsize = sysconf(_SC_PAGE_SIZE);
+    const uint8_t def_branchfactors[] = { 2, 3, 4 };
+    const uint8_t def_pathlengths[] = { 3, 5, 8 };
+    const uint8_t def_leafcapacities[] = { 8, 16, 23, 32, 64, 128 };
+    const off_t def_pgsizes[] = { host_pgsize, 2*host_pgsize, 4*host_pgsize, 8*host_pgsize };
+
+    MVPTuneParams p;
+    p.branchfactors = def_branchfactors;
+    p.nb_branchfactors = sizeof(def_branchfactors)/sizeof(uint8_t);
+    p.pathlengths = def_pathlengths;
+    p.nb_pathlengths = sizeof(def_pathlengths)/sizeof(uint8_t);
+    p.leafcapacities = def_leafcapacities;
+    p.nb_leafcapacities = sizeof(def_leafcapacities)/sizeof(uint8_t);
+    p.pgsizes = def_pgsizes;
+    p.nb_pgsizes = sizeof(def_pgsizes)/sizeof(off_t);
+    if (params){
+	if (params->branchfactors && params->nb_branchfactors > 0){
+	    p.branchfactors = params->branchfactors;
+	    p.nb_branchfactors = params->nb_branchfactors;
+	}
+	if (params->pathlengths && params->nb_pathlengths > 0){
+	    p.pathlengths = params->pathlengths;
+	    p.nb_pathlengths = params->nb_pathlengths;
+	}
+	if (params->leafcapacities && params->nb_leafcapacities > 0){
+	    p.leafcapacities = params->leafcapacities;
+	    p.nb_leafcapacities = params->nb_leafcapacities;
+	}
+	if (params->pgsizes && params->nb_pgsizes > 0){
+	    p.pgsizes = params->pgsizes;
+	    p.nb_pgsizes = params->nb_pgsizes;
+	}
+    }
+
+    int maxresults = p.nb_branchfactors*p.nb_pathlengths*p.nb_leafcapacities*p.nb_pgsizes;
+    MVPTuneResult *res = (MVPTuneResult*)malloc(maxresults*sizeof(MVPTuneResult));
+    DP **found = (DP**)malloc(knearest*sizeof(DP*));
+    if (!res || !found){
+	free(res);
+	free(found);
+	return PH_ERRMEMALLOC;
+    }
+
+    /* the candidate trees take a fresh name, so that no file of the caller is overwritten
+       or removed, and each candidate removes the files it made */
+    char tunefile[256];
+    snprintf(tunefile, sizeof(tunefile), "%s_tuneXXXXXX", m->filename);
+    int fd = mkstemp(tunefile);
+    if (fd < 0){
+	free(res);
+	free(found);
+	return PH_ERRFILEOPEN;
+    }
+    close(fd);
+
+    for (int b=0;b<p.nb_branchfactors;b++){
+	for (int l=0;l<p.nb_pathlengths;l++){
+	    /* largest datapoint in the sample for this path length */
+	    MVPFile msize;
+	    msize.pathlength = p.pathlengths[l];
+	    msize.hash_type = m->hash_type;
+	    int dpsize = 0;
+	    for (int i=0;i<nbpoints;i++){
+		int sz = ph_sizeof_dp(points[i], &msize);
+		if (sz > dpsize)
+		    dpsize = sz;
+	    }
+	    for (int k=0;k<p.nb_leafcapacities;k++){
+		for (int s=0;s<p.nb_pgsizes;s++){
+		    int BranchFactor = p.branchfactors[b];
+		    int LeafCapacity = p.leafcapacities[k];
+		    off_t pgsize = p.pgsizes[s];
+		    /* skip candidates whose nodes cannot fit in a page */
+		    off_t leafsize = 2 + 2*dpsize + LeafCapacity*(2*sizeof(float) + sizeof(off_t) + dpsize);
+		    off_t nodesize = HeaderSize + 1 + 2*dpsize
+			+ BranchFactor*BranchFactor*(sizeof(float) + sizeof(uint8_t) + sizeof(off_t));
+		    if ((BranchFactor < 2) || (LeafCapacity <= 0) || (nbpoints < LeafCapacity + 2)
+			|| (leafsize > pgsize) || (nodesize > pgsize)){
+			continue;
+		    }
+		    MVPTuneResult *r = &res[nbresults++];
+		    r->branchfactor = BranchFactor;
+		    r->pathlength = p.pathlengths[l];
+		    r->leafcapacity = LeafCapacity;
+		    r->pgsize = pgsize;
+		    r->avg_calcs = 0.0f;
+		    r->avg_msecs = 0.0;
+		    r->retcode = ph_tune_candidate(m, tunefile, points, nbpoints, queries, nbqueries,
+						   radius, threshold, knearest, found, r);
+		}
+	    }
+	}
+    }
+    free(found);
+    unlink(tunefile);
+
+    if (nbresults == 0){
+	free(res);
+	return PH_ERRARG;
+    }
+    qsort(res, nbresults, sizeof(MVPTuneResult), ph_tune_cmp);
+    *results = res;
+
+    if (res[0].retcode != PH_SUCCESS){
+	return res[0].retcode;
+    }
+    if (apply){
+	m->branchfactor = res[0].branchfactor;
+	m->pathlength = res[0].pathlength;
+	m->leafcapacity = res[0].leafcapacity;
+	m->pgsize = res[0].pgsize;
+    }
+    return PH_SUCCESS;
+}
+
+
+MVPRetCode ph_mvp_shards_init(MVPShards *s, const char *basename, int nbshards, const MVPFile *params,
+			      ShardRoute route){
+    if (!s || !basename || !params){
+	return PH_ERRNULLARG;
+    }
+    if (nbshards <= 0){
+	return PH_ERRARG;
+    }
+    s->shards = (MVPFile*)calloc(nbshards, sizeof(MVPFile));
+    s->basename = strdup(basename);
+    if (!s->shards || !s->basename){
+	free(s->shards);
+	free(s->basename);
+	return PH_ERRMEMALLOC;
+    }
+    s->nbshards = nbshards;
+    s->route = route;
+    s->next_shard = 0;
+    for (int i=0;i<nbshards;i++){
+	char shardname[256];
+	snprintf(shardname, sizeof(shardname), "%s_%d", basename, i);
+	s->shards[i] = *params;
+	s->shards[i].filename = strdup(shardname);
+	s->shards[i].buf = NULL;
+	s->shards[i].fd = 0;
+	s->shards[i].file_pos = 0;
+	s->shards[i].filenumber = 0;
+	s->shards[i].nbdbfiles = 1;
+    }
+    return PH_SUCCESS;
+}
+
+void ph_mvp_shards_free(MVPShards *s){
+    if (!s){
+	return;
+    }
+    for (int i=0;i<s->nbshards;i++){
+	free(s->shards[i].filename);
+    }
+    free(s->shards);
+    free(s->basename);
+    s->shards = NULL;
+    s->basename = NULL;
+    s->nbshards = 0;
+}
+
+/* FNV-1a hash of a datapoint id */
+static uint32_t ph_shard_idhash(const char *id){
+    uint32_t h = 2166136261U;
+    for (;id && *id;id++){
+	h ^= (uint8_t)*id;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+/* split points into a list per shard, lists[i] holds counts[i] points, free lists[0] when done */
+static MVPRetCode ph_shard_partition(MVPShards *s, DP **points, int nbpoints, DP ***lists, int *counts){
+    DP **sorted = (DP**)malloc((nbpoints > 0 ? nbpoints : 1)*sizeof(DP*));
+    int *dest = (int*)malloc((nbpoints > 0 ? nbpoints : 1)*sizeof(int));
+    if (!sorted || !dest){
+	free(sorted);
+	free(dest);
+	return PH_ERRMEMALLOC;
+    }
+    for (int i=0;i<s->nbshards;i++){
+	counts[i] = 0;
+    }
+    for (int i=0;i<nbpoints;i++){
+	if (s->route == PH_ROUTE_ROUNDROBIN){
+	    dest[i] = s->next_shard;
+	    s->next_shard = (s->next_shard + 1) % s->nbshards;
+	} else {
+	    dest[i] = ph_shard_idhash(points[i]->id) % s->nbshards;
+	}
+	counts[dest[i]]++;
+    }
+    int start = 0;
+    for (int i=0;i<s->nbshards;i++){
+	lists[i] = sorted + start;
+	start += counts[i];
+	counts[i] = 0;
+    }
+    for (int i=0;i<nbpoints;i++){
+	lists[dest[i]][counts[dest[i]]++] = points[i];
+    }
+    free(dest);
+    return PH_SUCCESS;
+}
+
+typedef enum ph_shard_op {
+    PH_SHARD_SAVE,
+    PH_SHARD_ADD,
+    PH_SHARD_QUERY,
+} ShardOp;
+
+/* work for one thread - the shards from first up to last */
+typedef struct ph_shard_job {
+    MVPShards *s;
+    int first, last;
+    ShardOp op;
+    DP ***lists;          /* save/add: points of each shard */
+    int *counts;
+    int *nbsaved;         /* add: points added to each shard */
+    DP *query;            /* query parameters */
+    int knearest;
+    float radius, threshold;
+    DP ***results;        /* query: results of each shard */
+    int *nbfound;
+    MVPRetCode *rets;     /* return code of each shard */
+} ShardJob;
+
+static void *ph_shard_thread(void *p){
+    ShardJob *job = (ShardJob*)p;
+    for (int i=job->first;i<job->last;i++){
+	MVPFile m = job->s->shards[i];
+	switch (job->op){
+	case PH_SHARD_SAVE:
+	    job->rets[i] = ph_save_mvptree(&m, job->lists[i], job->counts[i]);
+	    break;
+	case PH_SHARD_ADD:
+	    job->nbsaved[i] = 0;
+	    job->rets[i] = PH_SUCCESS;
+	    if (job->counts[i] > 0){
+		job->rets[i] = ph_add_mvptree(&m, job->lists[i], job->counts[i], job->nbsaved[i]);
+	    }
+	    break;
+	case PH_SHARD_QUERY: {
+	    /* each shard query fills in its own path array */
+	    DP query = *(job->query);
+	    query.path = NULL;
+	    job->nbfound[i] = 0;
+	    job->rets[i] = ph_query_mvptree(&m, &query, job->knearest, job->radius, job->threshold,
+					    job->results[i], job->nbfound[i]);
+	    break;
+	}
+	}
+    }
+    return NULL;
+}
+
+/* run the job over all the shards, split into slices of shards across threads */
+static void ph_shard_run(ShardJob *job, int threads){
+    int nbshards = job->s->nbshards;
+    int num_threads = 1;
+#ifdef HAVE_PTHREAD
+    num_threads = (threads > 0) ? threads : ph_num_threads();
+#endif
+    if (num_threads > nbshards){
+	num_threads = nbshards;
+    }
+#ifdef HAVE_PTHREAD
+    if (num_threads > 1){
+	pthread_t thds[num_threads];
+	int started[num_threads];
+	ShardJob *jobs = new ShardJob[num_threads];
+	for (int n=0;n<num_threads;n++){
+	    jobs[n] = *job;
+	    jobs[n].first = n*nbshards/num_threads;
+	    jobs[n].last = (n+1)*nbshards/num_threads;
+	    started[n] = (pthread_create(&thds[n], NULL, ph_shard_thread, &jobs[n]) == 0);
+	    if (!started[n]){
+		ph_shard_thread(&jobs[n]);
+	    }
+	}
+	for (int n=0;n<num_threads;n++){
+	    if (started[n]){
+		pthread_join(thds[n], NULL);
+	    }
+	}
+	delete[] jobs;
+	return;
+    }
+#endif
+    job->first = 0;
+    job->last = nbshards;
+    ph_shard_thread(job);
+}
+
+static MVPRetCode ph_shard_first_error(MVPRetCode *rets, int nbshards){
+    for (int i=0;i<nbshards;i++){
+	if ((rets[i] != PH_SUCCESS) && (rets[i] != PH_ERRCAP)){
+	    return rets[i];
+	}
+    }
+    return PH_SUCCESS;
+}
+
+static MVPRetCode ph_shard_update(MVPShards *s, DP **points, int nbpoints, ShardOp op, int &nbsaved, int threads){
+    nbsaved = 0;
+    if (!s || !s->shards || !points){
+	return PH_ERRNULLARG;
+    }
+    DP ***lists = (DP***)malloc(s->nbshards*sizeof(DP**));
+    int *counts = (int*)malloc(s->nbshards*sizeof(int));
+    int *saved = (int*)calloc(s->nbshards, sizeof(int));
+    MVPRetCode *rets = (MVPRetCode*)malloc(s->nbshards*sizeof(MVPRetCode));
+    MVPRetCode ret = PH_ERRMEMALLOC;
+    if (lists && counts && saved && rets){
+	ret = ph_shard_partition(s, points, nbpoints, lists, counts);
+    }
+    if (ret == PH_SUCCESS){
+	ShardJob job;
+	memset(&job, 0, sizeof(job));
+	job.s = s;
+	job.op = op;
+	job.lists = lists;
+	job.counts = counts;
+	job.nbsaved = saved;
+	job.rets = rets;
+	ph_shard_run(&job, threads);
+
+	ret = ph_shard_first_error(rets, s->nbshards);
+	for (int i=0;i<s->nbshards;i++){
+	    nbsaved += (op == PH_SHARD_SAVE) ? ((rets[i] == PH_SUCCESS) ? counts[i] : 0) : saved[i];
+	}
+	free(lists[0]);
+    }
+    free(lists);
+    free(counts);
+    free(saved);
+    free(rets);
+    return ret;
+}
+
+MVPRetCode ph_save_mvpshards(MVPShards *s, DP **points, int nbpoints, int threads){
+    int nbsaved;
+    return ph_shard_update(s, points, nbpoints, PH_SHARD_SAVE, nbsaved, threads);
+}
+
+MVPRetCode ph_add_mvpshards(MVPShards *s, DP **points, int nbpoints, int &nbsaved, int threads){
+    return ph_shard_update(s, points, nbpoints, PH_SHARD_ADD, nbsaved, threads);
+}
+
+/* a shard result and its distance from the query */
+typedef struct ph_shard_hit {
+    float dist;
+    DP *dp;
+} ShardHit;
+
+static int ph_shard_hit_cmp(const void *a, const void *b){
+    float da = ((const ShardHit*)a)->dist;
+    float db = ((const ShardHit*)b)->dist;
+    return (da < db) ? -1 : ((da > db) ? 1 : 0);
+}
+
+/* restore the min heap property of heap[] (shard numbers keyed by the distance
+   of the next hit of each shard) downward from position i */
+static void ph_shard_sift_down(int *heap, int n, int i, ShardHit **hits, int *next){
+    for (;;){
+	int smallest = i, l = 2*i+1, r = 2*i+2;
+	if ((l < n) && (hits[heap[l]][next[heap[l]]].dist < hits[heap[smallest]][next[heap[smallest]]].dist))
+	    smallest = l;
+	if ((r < n) && (hits[heap[r]][next[heap[r]]].dist < hits[heap[smallest]][next[heap[smallest]]].dist))
+	    smallest = r;
+	if (smallest == i)
+	    break;
+	int tmp = heap[i];
+	heap[i] = heap[smallest];
+	heap[smallest] = tmp;
+	i = smallest;
+    }
+}
+
+MVPRetCode ph_query_mvpshards(MVPShards *s, DP *query, int knearest, float radius, float threshold,
+			      DP **results, int &nbfound, int threads){
+    nbfound = 0;
+    if (!s || !s->shards || !query || !results || (s->nbshards > 0 && !s->shards[0].hashdist)){
+	return PH_ERRNULLARG;
+    }
+    if (knearest <= 0){
+	return PH_ERRARG;
+    }
+    int nbshards = s->nbshards;
+    DP ***shard_results = (DP***)calloc(nbshards, sizeof(DP**));
+    ShardHit **hits = (ShardHit**)calloc(nbshards, sizeof(ShardHit*));
+    int *shard_found = (int*)calloc(nbshards, sizeof(int));
+    int *next = (int*)calloc(nbshards, sizeof(int));
+    int *heap = (int*)malloc(nbshards*sizeof(int));
+    MVPRetCode *rets = (MVPRetCode*)malloc(nbshards*sizeof(MVPRetCode));
+    DP **buf = (DP**)malloc(nbshards*knearest*sizeof(DP*));
+    ShardHit *hitbuf = (ShardHit*)malloc(nbshards*knearest*sizeof(ShardHit));
+    if (!shard_results || !hits || !shard_found || !next || !heap || !rets || !buf || !hitbuf){
+	free(shard_results);
+	free(hits);
+	free(shard_found);
+	free(next);
+	free(heap);
+	free(rets);
+	free(buf);
+	free(hitbuf);
+	return PH_ERRMEMALLOC;
+    }
+    for (int i=0;i<nbshards;i++){
+	shard_results[i] = buf + i*knearest;
+	hits[i] = hitbuf + i*knearest;
+    }
+
+    ShardJob job;
+    memset(&job, 0, sizeof(job));
+    job.s = s;
+    job.op = PH_SHARD_QUERY;
+    job.query = query;
+    job.knearest = knearest;
+    job.radius = radius;
+    job.threshold = threshold;
+    job.results = shard_results;
+    job.nbfound = shard_found;
+    job.rets = rets;
+    ph_shard_run(&job, threads);
+
+    /* sort the results of each shard by distance and merge them, nearest first - a capped
+       shard holds the first results it found, not its nearest */
+    hash_compareCB hashdist = s->shards[0].hashdist;
+    int total = 0, heapsize = 0;
+    for (int i=0;i<nbshards;i++){
+	for (int j=0;j<shard_found[i];j++){
+	    hits[i][j].dp = shard_results[i][j];
+	    hits[i][j].dist = hashdist(query, shard_results[i][j]);
+	}
+	qsort(hits[i], shard_found[i], sizeof(ShardHit), ph_shard_hit_cmp);
+	total += shard_found[i];
+	if (shard_found[i] > 0){
+	    heap[heapsize++] = i;
+	}
+    }
+    for (int i=heapsize/2-1;i>=0;i--){
+	ph_shard_sift_down(heap, heapsize, i, hits, next);
+    }
+    while ((heapsize > 0) && (nbfound < knearest)){
+	int shard = heap[0];
+	results[nbfound++] = hits[shard][next[shard]++].dp;
+	if (next[shard] >= shard_found[shard]){
+	    heap[0] = heap[--heapsize];
+	}
+	ph_shard_sift_down(heap, heapsize, 0, hits, next);
+    }
+
+    /* free the results that did not make the cut */
+    for (int i=0;i<nbshards;i++){
+	for (int j=next[i];j<shard_found[i];j++){
+	    free(hits[i][j].dp->id);
+	    free(hits[i][j].dp->hash);
+	    ph_free_datapoint(hits[i][j].dp);
+	}
+    }
+
+    MVPRetCode ret = ph_shard_first_error(rets, nbshards);
+    if ((ret == PH_SUCCESS) && (total >= knearest)){
+	ret = PH_ERRCAP;
+    }
+
+    free(shard_results);
+    free(hits);
+    free(shard_found);
+    free(next);
+    free(heap);
+    free(rets);
+    free(buf);
+    free(hitbuf);
+    return ret;
+}
+
+
+static off_t ph_phx_align(off_t off){
+    return (off + 63) & ~(off_t)63;
+}
+
+static int ph_phx_write(FILE *pfile, const void *buf, size_t len){
+    return (len == 0 || fwrite(buf, 1, len, pfile) == len) ? 0 : -1;
+}
+
+static int ph_phx_pad(FILE *pfile, off_t to){
+    static const char zeros[64] = {0};
+    off_t pos = ftello(pfile);
+    if (pos < 0 || pos > to)
+	return -1;
+    return ph_phx_write(pfile, zeros, (size_t)(to - pos));
+}
+
+int ph_phx_save(const char *filename, const void *hashes, int hash_width, const ulong64 *ids,
+                const char *const *strings, ulong64 count){
+    if (!filename || hash_width <= 0 || (count > 0 && !hashes))
+	return -1;
+
+    off_t hash_offset = PHXHeaderSize;
+    off_t id_offset = ph_phx_align(hash_offset + (off_t)(count*hash_width));
+    off_t str_offset = ph_phx_align(id_offset + (off_t)(count*sizeof(ulong64)));
+
+    FILE *pfile = fopen(filename, "wb");
+    if (!pfile)
+	return -1;
+
+    uint32_t version = PHXVersion;
+    uint32_t width = (uint32_t)hash_width;
+    ulong64 has_strings = (strings) ? 1 : 0;
+    ulong64 header[5] = { count, (ulong64)hash_offset, (ulong64)id_offset,
+			  (ulong64)((strings) ? str_offset : 0), has_strings };
+
+    int err = ph_phx_write(pfile, phxtag, 16);
+    if (!err) err = ph_phx_write(pfile, &version, sizeof(version));
+    if (!err) err = ph_phx_write(pfile, &width, sizeof(width));
+    if (!err) err = ph_phx_write(pfile, header, sizeof(header));
+    if (!err) err = ph_phx_pad(pfile, hash_offset);
+
+    if (!err) err = ph_phx_write(pfile, hashes, (size_t)(count*hash_width));
+    if (!err) err = ph_phx_pad(pfile, id_offset);
+
+    if (!err){
+	if (ids){
+	    err = ph_phx_write(pfile, ids, (size_t)(count*sizeof(ulong64)));
+	} else {
+	    for (ulong64 i=0;i<count && !err;i++)
+		err = ph_phx_write(pfile, &i, sizeof(i));
+	}
+    }
+
+    if (!err && strings){
+	err = ph_phx_pad(pfile, str_offset);
+	ulong64 off = 0;
+	for (ulong64 i=0;i<count && !err;i++){
+	    err = ph_phx_write(pfile, &off, sizeof(off));
+	    off += ((strings[i]) ? strlen(strings[i]) : 0) + 1;
+	}
+	if (!err) err = ph_phx_write(pfile, &off, sizeof(off));
+	for (ulong64 i=0;i<count && !err;i++){
+	    const char *str = (strings[i]) ? strings[i] : "";
+	    err = ph_phx_write(pfile, str, strlen(str)+1);
+	}
+    }
+
+    if (fclose(pfile) != 0)
+	err = -1;
+    if (err)
+	unlink(filename);
+
+    return err;
+}
+
+int ph_phx_open(const char *filename, PHXFile *phx){
+    if (!filename || !phx)
+	return -1;
+    memset(phx, 0, sizeof(PHXFile));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < PHXHeaderSize){
+	close(fd);
+	return -1;
+    }
+    char *buf = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+	return -1;
+
+    uint32_t version, width;
+    ulong64 header[5];
+    memcpy(&version, buf+16, sizeof(version));
+    memcpy(&width, buf+20, sizeof(width));
+    memcpy(header, buf+24, sizeof(header));
+    ulong64 count = header[0];
+    ulong64 size = (ulong64)st.st_size;
+
+    /* every column has to lie inside the file and not overflow on the way */
+    bool ok = (memcmp(buf, phxtag, 16) == 0 && version == PHXVersion && width > 0
+	       && header[1] == (ulong64)PHXHeaderSize
+	       && header[2] % 64 == 0 && header[3] % 64 == 0
+	       && count <= (size - header[1])/width
+	       && header[2] >= header[1] + count*width
+	       && header[2] <= size && count <= (size - header[2])/sizeof(ulong64));
+    if (ok && header[4]){
+	ok = (header[3] >= header[2] + count*sizeof(ulong64) && header[3] <= size
+	      && count < (size - header[3])/sizeof(ulong64));
+	if (ok){
+	    const ulong64 *offs = (const ulong64*)(buf + header[3]);
+	    ulong64 blob = header[3] + (count+1)*sizeof(ulong64);
+	    ok = (offs[0] == 0 && offs[count] <= size - blob
+		  && (count == 0 || buf[blob + offs[count] - 1] == '\0'));
+	    /* the strings follow one another, so no offset may step back or past the end */
+	    for (ulong64 i = 1; ok && i <= count; i++)
+		ok = (offs[i] >= offs[i-1]);
+	    phx->str_offsets = offs;
+	    phx->strings = buf + blob;
+	}
+    }
+    if (!ok){
+	munmap(buf, st.st_size);
+	memset(phx, 0, sizeof(PHXFile));
+	return -1;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    phx->buf = buf;
+    phx->size = st.st_size;
+    phx->hash_width = width;
+    phx->count = count;
+    phx->hashes = (const uint8_t*)(buf + header[1]);
+    phx->ids = (const ulong64*)(buf + header[2]);
+
+    return 0;
+}
+
+void ph_phx_close(PHXFile *phx){
+    if (!phx)
+	return;
+    if (phx->buf)
+	munmap(phx->buf, phx->size);
+    memset(phx, 0, sizeof(PHXFile));
+}
+
+/* near duplicate clustering - identical hashes are merged first, then every pair of
+   distinct hashes within the threshold is found through multi-index tables. The 64
+   bits are split into nbblocks blocks; two hashes within threshold bits of each
+   other differ in at most threshold blocks, so they agree exactly on the other
+   nbblocks-threshold blocks. There is one table for every choice of threshold
+   blocks to leave out, keyed on the blocks kept, and only hashes sharing a key
+   are compared. Below full recall, the tables can instead be bands keyed on random
+   samples of the bits, which miss some pairs but are far fewer for large thresholds. */
+
+typedef struct ph_cluster_entry {
+    ulong64 hash;       /* hash permuted so that the table key is in the high bits */
+    uint32_t idx;       /* index of the first point with this hash */
+} ClusterEntry;
+
+typedef enum ph_cluster_op {
+    PH_CLUSTER_HIST,    /* count the entries of each partition */
+    PH_CLUSTER_SCATTER, /* write the entries to their partitions */
+    PH_CLUSTER_DEDUP,   /* sort partitions, merge identical hashes */
+    PH_CLUSTER_PAIRS,   /* sort partitions, merge hashes within the threshold */
+    PH_CLUSTER_LEADERS, /* assign each point of a component to a leader */
+} ClusterOp;
+
+typedef struct ph_cluster_ctx {
+    const ulong64 *hashes;
+    int count;
+    int threshold;
+    uint32_t *parent;       /* union-find forest, each root is the lowest index of its set */
+    ClusterEntry *src;      /* unique hashes, NULL to read hashes directly */
+    int nbsrc;
+    ClusterEntry *dst;      /* entries grouped by partition */
+    int nbblocks;
+    int block_start[64];
+    int block_width[64];
+    int order[64];          /* key blocks first */
+    ulong64 perm[8][256];   /* permuted bits of each byte value at each byte position */
+    int keybits;
+    int pbits;              /* partition on the top pbits of the permuted hash */
+    int nbparts;
+    int *offsets;           /* nbthreads x nbparts counts, then scatter positions */
+    int *part_start;        /* nbparts+1 */
+    int *part_unique;       /* dedup: unique entries left at the start of each partition */
+    int next;               /* next partition or component to process */
+    int *members;           /* leader: points grouped by component, in index order */
+    int *comp_start;        /* nbcomps+1 */
+    int nbcomps;
+} ClusterCtx;
+
+/* work for one thread - a slice of the entries or partitions/components taken in turn */
+typedef struct ph_cluster_job {
+    ClusterCtx *c;
+    ClusterOp op;
+    int thread;
+    int first, last;
+} ClusterJob;
+
+static uint32_t ph_uf_find(uint32_t *parent, uint32_t x){
+    while (1){
+	uint32_t p = __atomic_load_n(&parent[x], __ATOMIC_RELAXED);
+	if (p == x)
+	    return x;
+	uint32_t gp = __atomic_load_n(&parent[p], __ATOMIC_RELAXED);
+	if (gp != p)
+	    __sync_bool_compare_and_swap(&parent[x], p, gp);   /* path halving */
+	x = gp;
+    }
+}
+
+/* lock free union - the higher root is always linked under the lower one */
+static void ph_uf_union(uint32_t *parent, uint32_t a, uint32_t b){
+    while (1){
+	a = ph_uf_find(parent, a);
+	b = ph_uf_find(parent, b);
+	if (a == b)
+	    return;
+	if (a < b){
+	    uint32_t tmp = a;
+	    a = b;
+	    b = tmp;
+	}
+	if (__sync_bool_compare_and_swap(&parent[a], a, b))
+	    return;
+    }
+}
+
+/* fill in the byte lookup tables moving the blocks of c->order to the top, in turn */
+static void ph_cluster_perm_init(ClusterCtx *c){
+    int dest[64];
+    int pos = 64;
+    for (int i=0;i<c->nbblocks;i++){
+	int b = c->order[i];
+	pos -= c->block_width[b];
+	for (int k=0;k<c->block_width[b];k++)
+	    dest[c->block_start[b] + k] = pos + k;
+    }
+    for (int byte=0;byte<8;byte++){
+	for (int v=0;v<256;v++){
+	    ulong64 p = 0;
+	    for (int k=0;k<8;k++){
+		if (v & (1 << k))
+		    p |= 1ULL << dest[8*byte + k];
+	    }
+	    c->perm[byte][v] = p;
+	}
+    }
+}
+
+static inline ulong64 ph_cluster_permute(const ClusterCtx *c, ulong64 h){
+    if (c->nbblocks == 1)
+	return h;
+    return c->perm[0][h & 0xff] | c->perm[1][(h >> 8) & 0xff]
+	| c->perm[2][(h >> 16) & 0xff] | c->perm[3][(h >> 24) & 0xff]
+	| c->perm[4][(h >> 32) & 0xff] | c->perm[5][(h >> 40) & 0xff]
+	| c->perm[6][(h >> 48) & 0xff] | c->perm[7][h >> 56];
+}
+
+static inline ClusterEntry ph_cluster_entry(const ClusterCtx *c, int i){
+    if (c->src)
+	return c->src[i];
+    ClusterEntry e = { c->hashes[i], (uint32_t)i };
+    return e;
+}
+
+static int ph_cluster_cmp(const void *a, const void *b){
+    const ClusterEntry *ea = (const ClusterEntry*)a;
+    const ClusterEntry *eb = (const ClusterEntry*)b;
+    if (ea->hash != eb->hash)
+	return (ea->hash < eb->hash) ? -1 : 1;
+    return (ea->idx < eb->idx) ? -1 : (ea->idx > eb->idx);
+}
+
+static void ph_cluster_partition(ClusterCtx *c, int part){
+    ClusterEntry *e = c->dst + c->part_start[part];
+    int n = c->part_start[part+1] - c->part_start[part];
+    if (n > 1)
+	qsort(e, n, sizeof(ClusterEntry), ph_cluster_cmp);
+
+    if (c->nbblocks == 1){
+	/* the first of a run of identical hashes has the lowest index */
+	int u = 0;
+	for (int i=0;i<n;i++){
+	    if (u > 0 && e[i].hash == e[u-1].hash){
+		c->parent[e[i].idx] = e[u-1].idx;
+	    } else {
+		e[u++] = e[i];
+	    }
+	}
+	c->part_unique[part] = u;
+	return;
+    }
+
+    int shift = 64 - c->keybits;
+    for (int i=0;i<n;){
+	ulong64 key = e[i].hash >> shift;
+	int j = i+1;
+	while (j < n && (e[j].hash >> shift) == key)
+	    j++;
+	for (int a=i;a<j;a++){
+	    for (int b=a+1;b<j;b++){
+		if (ph_hamming_distance(e[a].hash, e[b].hash) <= c->threshold)
+		    ph_uf_union(c->parent, e[a].idx, e[b].idx);
+	    }
+	}
+	i = j;
+    }
+}
+
+/* first fit leader clustering of one component - leaders are tried in the order they were made */
+static void ph_cluster_leaders(ClusterCtx *c, int comp){
+    int *m = c->members + c->comp_start[comp];
+    int n = c->comp_start[comp+1] - c->comp_start[comp];
+    if (n == 1){
+	c->parent[m[0]] = m[0];
+	return;
+    }
+    int *leaders = (int*)malloc(n*sizeof(int));
+    int nbleaders = 0;
+    for (int i=0;i<n;i++){
+	ulong64 h = c->hashes[m[i]];
+	int l = 0;
+	while (l < nbleaders && ph_hamming_distance(h, c->hashes[leaders[l]]) > c->threshold)
+	    l++;
+	if (l == nbleaders)
+	    leaders[nbleaders++] = m[i];
+	c->parent[m[i]] = leaders[l];
+    }
+    free(leaders);
+}
+
+static void *ph_cluster_thread(void *p){
+    ClusterJob *job = (ClusterJob*)p;
+    ClusterCtx *c = job->c;
+    switch (job->op){
+    case PH_CLUSTER_HIST: {
+	int *counts = c->offsets + job->thread*c->nbparts;
+	memset(counts, 0, c->nbparts*sizeof(int));
+	for (int i=job->first;i<job->last;i++){
+	    counts[ph_cluster_permute(c, ph_cluster_entry(c, i).hash) >> (64 - c->pbits)]++;
+	}
+	break;
+    }
+    case PH_CLUSTER_SCATTER: {
+	int *pos = c->offsets + job->thread*c->nbparts;
+	for (int i=job->first;i<job->last;i++){
+	    ClusterEntry e = ph_cluster_entry(c, i);
+	    e.hash = ph_cluster_permute(c, e.hash);
+	    c->dst[pos[e.hash >> (64 - c->pbits)]++] = e;
+	}
+	break;
+    }
+    case PH_CLUSTER_DEDUP:
+    case PH_CLUSTER_PAIRS: {
+	int part;
+	while ((part = __sync_fetch_and_add(&c->next, 1)) < c->nbparts)
+	    ph_cluster_partition(c, part);
+	break;
+    }
+    case PH_CLUSTER_LEADERS: {
+	int comp;
+	while ((comp = __sync_fetch_and_add(&c->next, 1)) < c->nbcomps)
+	    ph_cluster_leaders(c, comp);
+	break;
+    }
+    }
+    return NULL;
+}
+
+/* run one step over the entries, split into slices across threads */
+static void ph_cluster_run(ClusterCtx *c, ClusterOp op, int num_threads){
+    c->next = 0;
+    ClusterJob jobs[num_threads];
+    for (int n=0;n<num_threads;n++){
+	jobs[n].c = c;
+	jobs[n].op = op;
+	jobs[n].thread = n;
+	jobs[n].first = (int)((long long)n*c->nbsrc/num_threads);
+	jobs[n].last = (int)((long long)(n+1)*c->nbsrc/num_threads);
+    }
+#ifdef HAVE_PTHREAD
+    if (num_threads > 1){
+	pthread_t thds[num_threads];
+	int started[num_threads];
+	for (int n=0;n<num_threads;n++){
+	    started[n] = (pthread_create(&thds[n], NULL, ph_cluster_thread, &jobs[n]) == 0);
+	}
+	/* slices of threads that could not be started are done here */
+	for (int n=0;n<num_threads;n++){
+	    if (started[n]){
+		pthread_join(thds[n], NULL);
+	    } else {
+		ph_cluster_thread(&jobs[n]);
+	    }
+	}
+	return;
+    }
+#endif
+    for (int n=0;n<num_threads;n++){
+	ph_cluster_thread(&jobs[n]);
+    }
+}
+
+/* group the entries by the top bits of their permuted hash and process each group */
+static int ph_cluster_pass(ClusterCtx *c, ClusterOp op, int num_threads){
+    c->nbparts = 1 << c->pbits;
+    c->offsets = (int*)malloc((size_t)num_threads*c->nbparts*sizeof(int));
+    c->part_start = (int*)malloc((c->nbparts+1)*sizeof(int));
+    if (!c->offsets || !c->part_start){
+	free(c->offsets);
+	free(c->part_start);
+	return -1;
+    }
+    ph_cluster_run(c, PH_CLUSTER_HIST, num_threads);
+    int pos = 0;
+    for (int part=0;part<c->nbparts;part++){
+	c->part_start[part] = pos;
+	for (int n=0;n<num_threads;n++){
+	    int cnt = c->offsets[n*c->nbparts + part];
+	    c->offsets[n*c->nbparts + part] = pos;
+	    pos += cnt;
+	}
+    }
+    c->part_start[c->nbparts] = pos;
+    ph_cluster_run(c, PH_CLUSTER_SCATTER, num_threads);
+    ph_cluster_run(c, op, num_threads);
+    free(c->offsets);
+    c->offsets = NULL;
+    return 0;
+}
 
-	memcpy(M2, &m->buf[m->file_pos & offset_mask], LengthM2*sizeof(float));
-	m->file_pos += LengthM2*sizeof(float);
+static int ph_cluster_pbits(int keybits, int n){
+    int pbits = 1;
+    while (pbits < 16 && pbits < keybits && (1 << pbits) < n)
+	pbits++;
+    return pbits;
+}
 
-	if (level < m->pathlength)
-	    new_dp->path[level] = d1;
-	if (level+1 < m->pathlength)
-	    new_dp->path[level+1] = d2;
+/* number of blocks giving the least work - tables x (entries + expected pairs compared),
+   placing an entry in a table costs a few dozen pair comparisons. Returns the cost. */
+static double ph_cluster_blocks(int threshold, int n, int &nbblocks){
+    nbblocks = threshold+1;
+    double bestcost = -1;
+    for (int b=threshold+1;b<=64;b++){
+	double tables = 1;
+	for (int i=0;i<threshold;i++)
+	    tables = tables*(b-i)/(i+1);
+	if (tables > 4096)
+	    break;
+	int keybits = (b-threshold)*(64/b);
+	double cost = tables*(32.0*n + (double)n*n*pow(2.0, -keybits));
+	if (bestcost < 0 || cost < bestcost){
+	    nbblocks = b;
+	    bestcost = cost;
+	}
+    }
+    return bestcost;
+}
 
-	free(sv1->id);
-        free(sv1->path);
-        free(sv1->hash);
-	ph_free_datapoint(sv1);
+/* bands of rows sampled bits giving the least work, with the same cost model, such that a
+   pair at the threshold shares a band with probability recall. Returns the cost, < 0 if
+   no choice of at most 4096 bands reaches recall. */
+static double ph_cluster_bands(int threshold, int n, double recall, int &rows, int &nbbands){
+    double bestcost = -1;
+    for (int r=1;r<=64-threshold;r++){
+	/* probability that r bits sampled without replacement miss all threshold differing bits */
+	double p = 1;
+	for (int i=0;i<r;i++)
+	    p = p*(64-threshold-i)/(64-i);
+	double bands = (p >= 1.0) ? 1 : ceil(log(1.0 - recall)/log(1.0 - p));
+	if (bands > 4096)
+	    continue;
+	double cost = bands*(32.0*n + (double)n*n*pow(2.0, -r));
+	if (bestcost < 0 || cost < bestcost){
+	    rows = r;
+	    nbbands = (int)bands;
+	    bestcost = cost;
+	}
+    }
+    return bestcost;
+}
 
-        free(sv2->id);
-        free(sv2->path);
-        free(sv2->hash);
-	ph_free_datapoint(sv2);
+/* bucket the entries on the key blocks of c->order and merge the pairs within the threshold */
+static int ph_cluster_table(ClusterCtx *c, int num_threads){
+    ph_cluster_perm_init(c);
+    c->pbits = ph_cluster_pbits(c->keybits, c->nbsrc);
+    int ret = ph_cluster_pass(c, PH_CLUSTER_PAIRS, num_threads);
+    free(c->part_start);
+    c->part_start = NULL;
+    return ret;
+}
 
-	int pivot1, pivot2;
-	uint8_t filenumber;
-	off_t child_pos, curr_pos;
-	off_t start_pos = m->file_pos;
-	off_t orig_pos;
-        MVPFile m2;
-	/* check <= each M1 pivot */
-	for (pivot1=0;pivot1 < LengthM1;pivot1++){
-	    if (d1 <= M1[pivot1]){
-		/* check <= each M2 pivot */
-
-		for (pivot2 = 0; pivot2 < LengthM1;pivot2++){
-		    if (d2 <= M2[pivot2+pivot1*LengthM1]){
-			/* determine pos from which to read filenumber and offset */
-			curr_pos = start_pos + (pivot2+pivot1*m->branchfactor)*(sizeof(uint8_t)+sizeof(off_t));
-			m->file_pos = curr_pos;
-			memcpy(&filenumber,&m->buf[m->file_pos & offset_mask],sizeof(uint8_t));
-			m->file_pos++;
-			memcpy(&child_pos,&m->buf[m->file_pos & offset_mask], sizeof(off_t));
-			m->file_pos += sizeof(off_t);
-			
-                        if ((filenumber == 0) && (child_pos == 0)){
-                            FileIndex child_offset;
-			    ret = _ph_save_mvptree(m, &new_dp, 1, 0, level+2, &child_offset);
-			    if (ret == PH_SUCCESS){
-				memcpy(&m->buf[curr_pos++ & offset_mask], &(child_offset.fileno), sizeof(uint8_t));
-                                memcpy(&m->buf[curr_pos   & offset_mask], &(child_offset.offset), sizeof(off_t));
-			    }
-			}  else {
-			    /* save position and remap to new file/position */
-			    ret = _ph_map_mvpfile(filenumber,child_pos,m,&m2);
-			    if (ret == PH_SUCCESS){
-				ret = _ph_add_mvptree(&m2, new_dp, level+2);
-				if (ret != PH_SUCCESS){
-                                    goto addcleanup;
-				}
-				ret = _ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-			    } 
-			}
-                        goto addcleanup;
-		    }
+int ph_cluster_hashes(const ulong64 *hashes, int count, int threshold, int *labels,
+		      ClusterMode mode, int threads, double recall){
+    if (!hashes || !labels || count < 0 || threshold < 0 || recall <= 0.0 || recall > 1.0)
+	return -1;
+    if (count == 0)
+	return 0;
+    if (threshold >= 64){
+	for (int i=0;i<count;i++)
+	    labels[i] = 0;
+	return 1;
+    }
 
-		    /* check > last M2 pivot */
-		    if (d2 > M2[LengthM1-1+pivot1*LengthM1]){
-			curr_pos = start_pos + (m->branchfactor-1+pivot1*m->branchfactor)*(sizeof(uint8_t)+sizeof(off_t));
-			m->file_pos = curr_pos;
-			memcpy(&filenumber,&m->buf[m->file_pos & offset_mask], sizeof(uint8_t));
-			m->file_pos++;
-			memcpy(&child_pos,&m->buf[m->file_pos & offset_mask], sizeof(off_t));
-			m->file_pos += sizeof(off_t);
-		    
-			if ((filenumber == 0) && (child_pos == 0)){
-			    FileIndex child_offset;
-			    ret = _ph_save_mvptree(m, &new_dp, 1, 0, level+2, &child_offset);
-			    if (ret == PH_SUCCESS){
-				memcpy(&m->buf[curr_pos++ & offset_mask], &child_offset.fileno, sizeof(uint8_t));
-				memcpy(&m->buf[curr_pos & offset_mask], &child_offset.offset, sizeof(off_t));
-			    }
-			} else {
-			    ret = _ph_map_mvpfile(filenumber, child_pos, m, &m2);
-			    if (ret == PH_SUCCESS){
-				ret = _ph_add_mvptree(&m2, new_dp, level+2);
-				if (ret != PH_SUCCESS){
-				    goto addcleanup;
-				}
-				ret = _ph_unmap_mvpfile(filenumber,orig_pos, m, &m2);
-			    } 
-			}
-			goto addcleanup;
-		    }
+    int num_threads = 1;
+#ifdef HAVE_PTHREAD
+    num_threads = (threads > 0) ? threads : ph_num_threads();
+#endif
+    if (num_threads > count/4096 + 1)
+	num_threads = count/4096 + 1;
+
+    ClusterCtx c;
+    memset(&c, 0, sizeof(c));
+    c.hashes = hashes;
+    c.count = count;
+    c.threshold = threshold;
+    c.parent = (uint32_t*)malloc(count*sizeof(uint32_t));
+    c.dst = (ClusterEntry*)malloc(count*sizeof(ClusterEntry));
+    if (!c.parent || !c.dst){
+	free(c.parent);
+	free(c.dst);
+	return -1;
+    }
+    for (int i=0;i<count;i++)
+	c.parent[i] = i;
+
+    /* merge identical hashes and keep one entry for each */
+    c.nbsrc = count;
+    c.nbblocks = 1;
+    c.keybits = 64;
+    c.pbits = ph_cluster_pbits(64, count);
+    c.part_unique = (int*)malloc((1 << c.pbits)*sizeof(int));
+    int ret = (c.part_unique) ? ph_cluster_pass(&c, PH_CLUSTER_DEDUP, num_threads) : -1;
+    int nbunique = 0;
+    if (ret == 0){
+	for (int part=0;part<c.nbparts;part++){
+	    memmove(c.dst + nbunique, c.dst + c.part_start[part], c.part_unique[part]*sizeof(ClusterEntry));
+	    nbunique += c.part_unique[part];
+	}
+    }
+    free(c.part_unique);
+    free(c.part_start);
+    c.part_start = NULL;
+
+    if (ret == 0 && threshold > 0 && nbunique > 1){
+	c.src = c.dst;
+	c.nbsrc = nbunique;
+	c.dst = (ClusterEntry*)malloc(nbunique*sizeof(ClusterEntry));
+	if (!c.dst)
+	    ret = -1;
+	if (num_threads > nbunique/4096 + 1)
+	    num_threads = nbunique/4096 + 1;
+
+	int nbblocks, rows = 0, nbbands = 0;
+	double blockcost = ph_cluster_blocks(threshold, nbunique, nbblocks);
+	double bandcost = (recall < 1.0) ? ph_cluster_bands(threshold, nbunique, recall, rows, nbbands) : -1;
+	if (bandcost >= 0 && bandcost < blockcost){
+	    /* each band keys on rows bits drawn by a partial shuffle, as in ph_lsh_init */
+	    c.nbblocks = 64;
+	    for (int b=0;b<64;b++){
+		c.block_start[b] = b;
+		c.block_width[b] = 1;
+		c.order[b] = b;
+	    }
+	    c.keybits = rows;
+	    uint32_t x = 0x9e3779b9;
+	    for (int band=0;band<nbbands && ret == 0;band++){
+		for (int r=0;r<rows;r++){
+		    x ^= x << 13;
+		    x ^= x >> 17;
+		    x ^= x << 5;
+		    int j = r + x%(64 - r);
+		    int tmp = c.order[r];
+		    c.order[r] = c.order[j];
+		    c.order[j] = tmp;
 		}
+		ret = ph_cluster_table(&c, num_threads);
 	    }
+	    nbblocks = 0;
 	}
-	/* check > last M1 pivot */
-	if (d1 > M1[LengthM1-1]){
-	    /*check <= each M2 pivot */
-	    for (pivot2=0;pivot2 < LengthM1; pivot2++){
-		if (d2 <= M2[pivot2+LengthM1*LengthM1]){
-		    curr_pos = start_pos + (pivot2+LengthM1*m->branchfactor)*(sizeof(uint8_t)+sizeof(off_t));
-		    m->file_pos = curr_pos;
-		    memcpy(&filenumber, &m->buf[m->file_pos & offset_mask], sizeof(uint8_t));
-		    m->file_pos++;
-		    memcpy(&child_pos,&m->buf[m->file_pos & offset_mask], sizeof(off_t));
-		    m->file_pos += sizeof(off_t);
-  
-		    if ((filenumber == 0) && (child_pos == 0)){
-			FileIndex child_offset;
-			ret = _ph_save_mvptree(m, &new_dp, 1, 0, level+2, &child_offset);
-			if (ret == PH_SUCCESS){
-			    memcpy(&m->buf[curr_pos++ & offset_mask],&child_offset.fileno,sizeof(uint8_t));
-			    memcpy(&m->buf[curr_pos & offset_mask],&child_offset.offset,sizeof(off_t));
-			}
-		    } else {
-			ret = _ph_map_mvpfile(filenumber,child_pos,m, &m2);
-			if (ret == PH_SUCCESS){
-			    ret = _ph_add_mvptree(&m2,new_dp,level+2);
-			    if (ret != PH_SUCCESS){
-				goto addcleanup;
-			    }
-			    ret = _ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-			}
-		    }
-		    goto addcleanup;
-		}
+
+	if (nbblocks > 0){
+	    c.nbblocks = nbblocks;
+	    for (int b=0, start=0;b<c.nbblocks;b++){
+		c.block_start[b] = start;
+		c.block_width[b] = 64/c.nbblocks + ((b < 64%c.nbblocks) ? 1 : 0);
+		start += c.block_width[b];
 	    }
-	    
-	    /* check > last M2 pivot */
-	    if (d2 > M2[LengthM1-1+LengthM1*LengthM1]){
-		curr_pos = start_pos + (m->branchfactor- 1+LengthM1*m->branchfactor)*(sizeof(uint8_t) + sizeof(off_t));
-		m->file_pos = curr_pos;
-		memcpy(&filenumber, &m->buf[m->file_pos & offset_mask], sizeof(uint8_t));
-		m->file_pos++;
-		memcpy(&child_pos, &m->buf[m->file_pos & offset_mask], sizeof(off_t));
-		m->file_pos += sizeof(off_t);
-		
-                if ((filenumber == 0)&&(child_pos == 0)){
-		    FileIndex child_offset;
-                    ret = _ph_save_mvptree(m, &new_dp, 1, 0, level+2, &child_offset);
-                    if (ret == PH_SUCCESS){
-			memcpy(&m->buf[curr_pos++ & offset_mask],&child_offset.fileno,sizeof(uint8_t));
-                        memcpy(&m->buf[curr_pos & offset_mask],&child_offset.offset,sizeof(off_t));
-		    }
+	}
+
+	/* one table for each set of threshold blocks left out of the key */
+	int out[64];
+	for (int i=0;i<threshold;i++)
+	    out[i] = i;
+	while (ret == 0 && nbblocks > 0){
+	    int k = 0, nbout = 0;
+	    c.keybits = 0;
+	    for (int b=0;b<c.nbblocks;b++){
+		if (nbout < threshold && out[nbout] == b){
+		    nbout++;
 		} else {
-		    ret = _ph_map_mvpfile(filenumber, child_pos, m, &m2);
-		    if (ret == PH_SUCCESS){
-			ret = _ph_add_mvptree(&m2, new_dp, level+2);
-			if (ret != PH_SUCCESS){
-			    goto addcleanup;
-			}
-			ret =  _ph_unmap_mvpfile(filenumber, orig_pos, m, &m2);
-		    }
-		
+		    c.order[k++] = b;
+		    c.keybits += c.block_width[b];
 		}
-                goto addcleanup;
 	    }
+	    for (int i=0;i<threshold;i++)
+		c.order[k++] = out[i];
+	    ret = ph_cluster_table(&c, num_threads);
+
+	    /* next combination of blocks */
+	    int i = threshold-1;
+	    while (i >= 0 && out[i] == c.nbblocks - threshold + i)
+		i--;
+	    if (i < 0)
+		break;
+	    out[i]++;
+	    for (int j=i+1;j<threshold;j++)
+		out[j] = out[j-1]+1;
 	}
+	free(c.src);
+	c.src = NULL;
+    }
+    free(c.dst);
+    c.dst = NULL;
+    if (ret < 0){
+	free(c.parent);
+	return -1;
+    }
 
-addcleanup:
-	free(M1);
-	free(M2);
-    } else {
-	ret = PH_ERRNTYPE;
+    /* number the components in order of their lowest index */
+    int nbclusters = 0;
+    for (int i=0;i<count;i++){
+	uint32_t r = ph_uf_find(c.parent, i);
+	labels[i] = (r == (uint32_t)i) ? nbclusters++ : labels[r];
     }
-    return ret;
-}
 
+    if (mode == PH_CLUSTER_LEADER && threshold > 0 && nbclusters < count){
+	c.nbcomps = nbclusters;
+	c.members = (int*)malloc(count*sizeof(int));
+	c.comp_start = (int*)calloc(nbclusters+1, sizeof(int));
+	if (!c.members || !c.comp_start){
+	    free(c.members);
+	    free(c.comp_start);
+	    free(c.parent);
+	    return -1;
+	}
+	for (int i=0;i<count;i++)
+	    c.comp_start[labels[i]+1]++;
+	for (int comp=0;comp<nbclusters;comp++)
+	    c.comp_start[comp+1] += c.comp_start[comp];
+	for (int i=0;i<count;i++)
+	    c.members[c.comp_start[labels[i]]++] = i;
+	for (int comp=nbclusters;comp>0;comp--)
+	    c.comp_start[comp] = c.comp_start[comp-1];
+	c.comp_start[0] = 0;
+
+	if (num_threads > nbclusters)
+	    num_threads = nbclusters;
+	ph_cluster_run(&c, PH_CLUSTER_LEADERS, num_threads);
+	free(c.members);
+	free(c.comp_start);
+
+	/* a leader is the lowest index of its cluster */
+	nbclusters = 0;
+	for (int i=0;i<count;i++)
+	    labels[i] = (c.parent[i] == (uint32_t)i) ? nbclusters++ : labels[c.parent[i]];
+    }
+    free(c.parent);
 
+    return nbclusters;
+}
 
-MVPRetCode ph_add_mvptree(MVPFile *m, DP **points, int nbpoints, int &nbsaved){
-    nbsaved = 0;
-    /* open main file */
-    char mainfile[256];
-    snprintf(mainfile, sizeof(mainfile),"%s.mvp", m->filename);
+static int ph_lsh_cmp(const void *a, const void *b){
+    const LSHEntry *ea = (const LSHEntry*)a;
+    const LSHEntry *eb = (const LSHEntry*)b;
+    if (ea->key != eb->key)
+	return (ea->key < eb->key) ? -1 : 1;
+    return (ea->idx < eb->idx) ? -1 : (ea->idx > eb->idx);
+}
 
-    m->fd = open(mainfile, O_RDWR);
-    if (m->fd < 0){
-	return PH_ERRFILEOPEN;
+/* the sampled bits of band b of a hash, first sampled bit highest */
+static inline ulong64 ph_lsh_key(const LSHIndex *idx, int b, const uint8_t *hash){
+    const uint16_t *bits = idx->bits + b*idx->rows;
+    ulong64 key = 0;
+    for (int r=0;r<idx->rows;r++){
+	key = (key << 1) | ((hash[bits[r] >> 3] >> (bits[r] & 7)) & 1);
     }
+    return key;
+}
 
-    /*use host pg size until pg size of file can be read  */ 
-    m->pgsize = sysconf(_SC_PAGESIZE);
+int ph_lsh_init(LSHIndex *idx, int hash_len, int nbbands, int rows, uint32_t seed){
+    if (!idx || hash_len <= 0 || hash_len > 8192 || nbbands <= 0 || rows <= 0 || rows > 64
+	|| rows > 8*hash_len)
+	return -1;
+    memset(idx, 0, sizeof(LSHIndex));
+    idx->hash_len = hash_len;
+    idx->nbbands = nbbands;
+    idx->rows = rows;
+    idx->seed = seed;
+    idx->bits = (uint16_t*)malloc(nbbands*rows*sizeof(uint16_t));
+    int nbits = 8*hash_len;
+    uint16_t *positions = (uint16_t*)malloc(nbits*sizeof(uint16_t));
+    if (!idx->bits || !positions){
+	free(idx->bits);
+	free(positions);
+	idx->bits = NULL;
+	return -1;
+    }
 
-    /* map to first page */
-    m->file_pos = 0;
-    m->buf  = (char*)mmap(NULL,m->pgsize,PROT_READ|PROT_WRITE,MAP_SHARED,m->fd,m->file_pos);
-    if (m->buf == MAP_FAILED){
-	return PH_ERRMMAP;
+    /* each band samples rows distinct bits - a partial shuffle driven by xorshift */
+    uint32_t x = (seed) ? seed : 0x9e3779b9;
+    for (int b=0;b<nbbands;b++){
+	for (int i=0;i<nbits;i++)
+	    positions[i] = i;
+	for (int r=0;r<rows;r++){
+	    x ^= x << 13;
+	    x ^= x >> 17;
+	    x ^= x << 5;
+	    int j = r + x%(nbits - r);
+	    uint16_t tmp = positions[r];
+	    positions[r] = positions[j];
+	    positions[j] = tmp;
+	    idx->bits[b*rows + r] = positions[r];
+	}
     }
-    madvise(m->buf, m->pgsize,MADV_SEQUENTIAL);
+    free(positions);
+    return 0;
+}
 
-    /* read header within first HeaderSize bytes */
-    char tag[17];
-    int version;;
-    int int_pgsize;
-    int leaf_pgsize;
-    
-    memcpy(tag, &m->buf[m->file_pos], 16);
-    tag[16] = '\0';
-    m->file_pos += 16;
-    
-    memcpy(&version, &m->buf[m->file_pos], sizeof(int));
-    m->file_pos += sizeof(int);
+void ph_lsh_free(LSHIndex *idx){
+    if (!idx)
+	return;
+    free(idx->bits);
+    free(idx->hashes);
+    free(idx->ids);
+    free(idx->tables);
+    memset(idx, 0, sizeof(LSHIndex));
+}
 
-    memcpy(&int_pgsize, &m->buf[m->file_pos], sizeof(int));
-    m->file_pos += sizeof(int);
+static int ph_lsh_reserve(LSHIndex *idx, int count){
+    if (count <= idx->capacity)
+	return 0;
+    int capacity = (idx->capacity > 0) ? idx->capacity : 1024;
+    while (capacity < count)
+	capacity = (capacity > INT_MAX/2) ? count : 2*capacity;
+    uint8_t *hashes = (uint8_t*)realloc(idx->hashes, (size_t)capacity*idx->hash_len);
+    if (!hashes)
+	return -1;
+    idx->hashes = hashes;
+    ulong64 *ids = (ulong64*)realloc(idx->ids, (size_t)capacity*sizeof(ulong64));
+    if (!ids)
+	return -1;
+    idx->ids = ids;
+    idx->capacity = capacity;
+    return 0;
+}
 
-    memcpy(&leaf_pgsize, &m->buf[m->file_pos], sizeof(int));
-    m->file_pos += sizeof(int);
+int ph_lsh_add(LSHIndex *idx, const uint8_t *hashes, const ulong64 *ids, int count){
+    if (!idx || !idx->bits || count < 0 || (count > 0 && !hashes) || count > INT_MAX - idx->count)
+	return -1;
+    if (ph_lsh_reserve(idx, idx->count + count) < 0)
+	return -1;
+    memcpy(idx->hashes + (size_t)idx->count*idx->hash_len, hashes, (size_t)count*idx->hash_len);
+    for (int i=0;i<count;i++){
+	idx->ids[idx->count + i] = (ids) ? ids[i] : (ulong64)(idx->count + i);
+    }
+    idx->count += count;
+    return 0;
+}
 
-    off_t nb_pos = m->file_pos;
-    memcpy(&m->nbdbfiles, &m->buf[m->file_pos++], 1);
+/* merge the sorted runs a and b of a band into out */
+static void ph_lsh_merge_band(const LSHEntry *a, int na, const LSHEntry *b, int nb, LSHEntry *out){
+    int i = 0, j = 0, k = 0;
+    while (i < na && j < nb){
+	out[k++] = (ph_lsh_cmp(&b[j], &a[i]) < 0) ? b[j++] : a[i++];
+    }
+    while (i < na)
+	out[k++] = a[i++];
+    while (j < nb)
+	out[k++] = b[j++];
+}
 
-    memcpy(&m->branchfactor, &m->buf[m->file_pos++], 1);
+/* work for one thread - building the bands from first up to last */
+typedef struct ph_lsh_job {
+    LSHIndex *idx;
+    LSHEntry *tables;   /* new tables, nbbands x count */
+    int first, last;
+} LSHJob;
+
+static void *ph_lsh_build_thread(void *p){
+    LSHJob *job = (LSHJob*)p;
+    LSHIndex *idx = job->idx;
+    int nbold = idx->nbindexed;
+    int nbnew = idx->count - nbold;
+    LSHEntry *tail = (LSHEntry*)malloc((size_t)nbnew*sizeof(LSHEntry));
+    for (int b=job->first;b<job->last;b++){
+	LSHEntry *out = job->tables + (size_t)b*idx->count;
+	LSHEntry *sorted = (tail) ? tail : out + nbold;
+	for (int i=0;i<nbnew;i++){
+	    sorted[i].key = ph_lsh_key(idx, b, idx->hashes + (size_t)(nbold + i)*idx->hash_len);
+	    sorted[i].idx = nbold + i;
+	}
+	qsort(sorted, nbnew, sizeof(LSHEntry), ph_lsh_cmp);
+	if (tail){
+	    ph_lsh_merge_band(idx->tables + (size_t)b*nbold, nbold, tail, nbnew, out);
+	} else {
+	    /* no room for the tail - fall back to sorting the whole band in place */
+	    memcpy(out, idx->tables + (size_t)b*nbold, nbold*sizeof(LSHEntry));
+	    qsort(out, idx->count, sizeof(LSHEntry), ph_lsh_cmp);
+	}
+    }
+    free(tail);
+    return NULL;
+}
 
-    memcpy(&m->pathlength, &m->buf[m->file_pos++], 1);
+int ph_lsh_build(LSHIndex *idx, int threads){
+    if (!idx || !idx->bits)
+	return -1;
+    if (idx->nbindexed == idx->count)
+	return 0;
+    LSHEntry *tables = (LSHEntry*)malloc((size_t)idx->nbbands*idx->count*sizeof(LSHEntry));
+    if (!tables)
+	return -1;
 
-    memcpy(&m->leafcapacity, &m->buf[m->file_pos++], 1);
+    int num_threads = 1;
+#ifdef HAVE_PTHREAD
+    num_threads = (threads > 0) ? threads : ph_num_threads();
+#endif
+    if (num_threads > idx->nbbands)
+	num_threads = idx->nbbands;
+    LSHJob jobs[num_threads];
+    for (int n=0;n<num_threads;n++){
+	jobs[n].idx = idx;
+	jobs[n].tables = tables;
+	jobs[n].first = n*idx->nbbands/num_threads;
+	jobs[n].last = (n+1)*idx->nbbands/num_threads;
+    }
+#ifdef HAVE_PTHREAD
+    if (num_threads > 1){
+	pthread_t thds[num_threads];
+	int started[num_threads];
+	for (int n=0;n<num_threads;n++){
+	    started[n] = (pthread_create(&thds[n], NULL, ph_lsh_build_thread, &jobs[n]) == 0);
+	}
+	for (int n=0;n<num_threads;n++){
+	    if (started[n]){
+		pthread_join(thds[n], NULL);
+	    } else {
+		ph_lsh_build_thread(&jobs[n]);
+	    }
+	}
+    } else
+#endif
+    {
+	for (int n=0;n<num_threads;n++)
+	    ph_lsh_build_thread(&jobs[n]);
+    }
 
-    memcpy(&m->hash_type, &m->buf[m->file_pos++], 1);
+    free(idx->tables);
+    idx->tables = tables;
+    idx->nbindexed = idx->count;
+    return 0;
+}
 
-    m->file_pos = HeaderSize;
+static int ph_lsh_result_cmp(const void *a, const void *b){
+    const LSHResult *ra = (const LSHResult*)a;
+    const LSHResult *rb = (const LSHResult*)b;
+    if (ra->distance != rb->distance)
+	return (ra->distance < rb->distance) ? -1 : 1;
+    return (ra->id < rb->id) ? -1 : (ra->id > rb->id);
+}
 
-    m->filenumber = 0;
+static int ph_lsh_idx_cmp(const void *a, const void *b){
+    uint32_t ia = *(const uint32_t*)a, ib = *(const uint32_t*)b;
+    return (ia < ib) ? -1 : (ia > ib);
+}
 
-    for (int i=0;i < nbpoints;i++){
-	points[i]->path = (float*)malloc((m->pathlength)*sizeof(float));
-        if (points[i]->path == NULL){
-            return PH_ERRMEMALLOC;
-	}
+/* append point j to found if it is within threshold of hash */
+static int ph_lsh_check(const LSHIndex *idx, const uint8_t *hash, int j, double threshold,
+			LSHResult *&found, int &nbresults, int &capacity){
+    double d = ph_hammingdistance2((uint8_t*)hash, idx->hash_len,
+				   idx->hashes + (size_t)j*idx->hash_len, idx->hash_len);
+    if (d > threshold)
+	return 0;
+    if (nbresults == capacity){
+	LSHResult *tmp = (LSHResult*)realloc(found, 2*capacity*sizeof(LSHResult));
+	if (!tmp)
+	    return -1;
+	found = tmp;
+	capacity *= 2;
     }
+    found[nbresults].id = idx->ids[j];
+    found[nbresults].distance = d;
+    nbresults++;
+    return 0;
+}
 
-    /* remap to true pg size used in making file */
-#ifdef HAVE_REMAP
-    m->buf = (char*)mremap(m->buf, m->pgsize, int_pgsize, MREMAP_MAYMOVE);
-#else
-    munmap(m->buf, m->pgsize);
-    m->buf = (char*)mmap(m->buf, int_pgsize, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
-#endif
-    if (m->buf == MAP_FAILED){
-	return PH_ERRMMAP;
+int ph_lsh_query(const LSHIndex *idx, const uint8_t *hash, double threshold,
+		 LSHResult *results, int maxresults){
+    if (!idx || !idx->bits || !hash || !results || maxresults <= 0)
+	return -1;
+
+    /* candidates from the band tables, then every hash added since the last build */
+    int nbcands = 0, capacity = 256;
+    uint32_t *cands = (uint32_t*)malloc(capacity*sizeof(uint32_t));
+    if (!cands)
+	return -1;
+    for (int b=0;b<idx->nbbands;b++){
+	const LSHEntry *table = idx->tables + (size_t)b*idx->nbindexed;
+	ulong64 key = ph_lsh_key(idx, b, hash);
+	int lo = 0, hi = idx->nbindexed;
+	while (lo < hi){
+	    int mid = lo + (hi - lo)/2;
+	    if (table[mid].key < key)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	for (int i=lo;i<idx->nbindexed && table[i].key == key;i++){
+	    if (nbcands == capacity){
+		capacity *= 2;
+		uint32_t *tmp = (uint32_t*)realloc(cands, capacity*sizeof(uint32_t));
+		if (!tmp){
+		    free(cands);
+		    return -1;
+		}
+		cands = tmp;
+	    }
+	    cands[nbcands++] = table[i].idx;
+	}
+    }
+    qsort(cands, nbcands, sizeof(uint32_t), ph_lsh_idx_cmp);
+
+    /* verify the deduplicated candidates, then every hash added since the last build */
+    int nbresults = 0, rescapacity = 64;
+    LSHResult *found = (LSHResult*)malloc(rescapacity*sizeof(LSHResult));
+    int err = (found == NULL);
+    for (int i=0;i<nbcands && !err;i++){
+	if (i == 0 || cands[i] != cands[i-1])
+	    err = ph_lsh_check(idx, hash, cands[i], threshold, found, nbresults, rescapacity);
+    }
+    for (int j=idx->nbindexed;j<idx->count && !err;j++){
+	err = ph_lsh_check(idx, hash, j, threshold, found, nbresults, rescapacity);
+    }
+    if (err){
+	free(found);
+	free(cands);
+	return -1;
     }
+    free(cands);
+
+    qsort(found, nbresults, sizeof(LSHResult), ph_lsh_result_cmp);
+    if (nbresults > maxresults)
+	nbresults = maxresults;
+    memcpy(results, found, nbresults*sizeof(LSHResult));
+    free(found);
+    return nbresults;
+}
 
-    m->pgsize = int_pgsize;
+int ph_lsh_merge(LSHIndex *dst, const LSHIndex *src){
+    if (!dst || !src || !dst->bits || !src->bits || dst == src)
+	return -1;
+    if (dst->hash_len != src->hash_len || dst->nbbands != src->nbbands || dst->rows != src->rows
+	|| memcmp(dst->bits, src->bits, dst->nbbands*dst->rows*sizeof(uint16_t)) != 0)
+	return -1;
 
-    MVPRetCode retval = PH_SUCCESS;
-    for (int i=0;i<nbpoints;i++){
-        m->file_pos = HeaderSize;
-	retval = _ph_add_mvptree(m, points[i], 0);
-	if (retval != PH_SUCCESS){
-            fprintf(stderr,"unable to add %d, retcode %d\n", i, retval);
-	    continue;
+    int nbold = dst->count;
+    bool built = (dst->nbindexed == nbold && src->nbindexed == src->count);
+    LSHEntry *tables = NULL;
+    if (built && src->count > 0){
+	tables = (LSHEntry*)malloc((size_t)dst->nbbands*(nbold + src->count)*sizeof(LSHEntry));
+	if (!tables)
+	    return -1;
+    }
+    if (ph_lsh_add(dst, src->hashes, src->ids, src->count) < 0){
+	free(tables);
+	return -1;
+    }
+    if (!tables)
+	return 0;
+
+    /* both sides are built, merge the bands with src renumbered after dst */
+    LSHEntry *shifted = (LSHEntry*)malloc((size_t)src->count*sizeof(LSHEntry));
+    for (int b=0;b<dst->nbbands && shifted;b++){
+	const LSHEntry *s = src->tables + (size_t)b*src->count;
+	for (int i=0;i<src->count;i++){
+	    shifted[i].key = s[i].key;
+	    shifted[i].idx = s[i].idx + nbold;
 	}
-	nbsaved++;
+	ph_lsh_merge_band(dst->tables + (size_t)b*nbold, nbold, shifted, src->count,
+			  tables + (size_t)b*dst->count);
+    }
+    if (!shifted){
+	/* the merged points stay unindexed until the next build */
+	free(tables);
+	return 0;
     }
+    free(shifted);
+    free(dst->tables);
+    dst->tables = tables;
+    dst->nbindexed = dst->count;
+    return 0;
+}
 
-    /* save new nbdbfiles if new files added */
-    memcpy(&m->buf[nb_pos], &m->nbdbfiles, 1);
+int ph_lsh_save(const LSHIndex *idx, const char *filename){
+    if (!idx || !idx->bits || !filename)
+	return -1;
+    FILE *pfile = fopen(filename, "wb");
+    if (!pfile)
+	return -1;
 
-    if (msync(m->buf, m->pgsize, MS_SYNC) < 0){
-	return PH_ERRMSYNC;
+    char header[LSHHeaderSize];
+    memset(header, 0, LSHHeaderSize);
+    int32_t fields[7] = { LSHVersion, idx->hash_len, idx->nbbands, idx->rows, (int32_t)idx->seed,
+			  idx->count, idx->nbindexed };
+    memcpy(header, lshtag, 16);
+    memcpy(header + 16, fields, sizeof(fields));
+
+    size_t nbbits = (size_t)idx->nbbands*idx->rows;
+    size_t nbentries = (size_t)idx->nbbands*idx->nbindexed;
+    int err = (fwrite(header, 1, LSHHeaderSize, pfile) != LSHHeaderSize
+	       || fwrite(idx->bits, sizeof(uint16_t), nbbits, pfile) != nbbits
+	       || fwrite(idx->hashes, idx->hash_len, idx->count, pfile) != (size_t)idx->count
+	       || fwrite(idx->ids, sizeof(ulong64), idx->count, pfile) != (size_t)idx->count
+	       || fwrite(idx->tables, sizeof(LSHEntry), nbentries, pfile) != nbentries);
+    if (fclose(pfile) != 0)
+	err = 1;
+    if (err){
+	unlink(filename);
+	return -1;
     }
+    return 0;
+}
 
-    munmap(m->buf, m->pgsize);
-    close(m->fd);
+int ph_lsh_load(LSHIndex *idx, const char *filename){
+    if (!idx || !filename)
+	return -1;
+    memset(idx, 0, sizeof(LSHIndex));
+    FILE *pfile = fopen(filename, "rb");
+    if (!pfile)
+	return -1;
 
-    for (int i=0;i<nbpoints;i++){
-	free(points[i]->path);
+    char header[LSHHeaderSize];
+    int32_t fields[7];
+    if (fread(header, 1, LSHHeaderSize, pfile) != LSHHeaderSize || memcmp(header, lshtag, 16) != 0){
+	fclose(pfile);
+	return -1;
+    }
+    memcpy(fields, header + 16, sizeof(fields));
+    int count = fields[5], nbindexed = fields[6];
+    if (fields[0] != LSHVersion || count < 0 || nbindexed < 0 || nbindexed > count
+	|| ph_lsh_init(idx, fields[1], fields[2], fields[3], (uint32_t)fields[4]) < 0){
+	fclose(pfile);
+	return -1;
     }
 
-
-    return retval;
+    size_t nbbits = (size_t)idx->nbbands*idx->rows;
+    size_t nbentries = (size_t)idx->nbbands*nbindexed;
+    int err = (fread(idx->bits, sizeof(uint16_t), nbbits, pfile) != nbbits
+	       || ph_lsh_reserve(idx, count) < 0
+	       || fread(idx->hashes, idx->hash_len, count, pfile) != (size_t)count
+	       || fread(idx->ids, sizeof(ulong64), count, pfile) != (size_t)count);
+    if (!err && nbentries > 0){
+	idx->tables = (LSHEntry*)malloc(nbentries*sizeof(LSHEntry));
+	err = (!idx->tables || fread(idx->tables, sizeof(LSHEntry), nbentries, pfile) != nbentries);
+    }
+    fclose(pfile);
+    if (!err){
+	for (size_t i=0;i<nbbits;i++)
+	    err |= (idx->bits[i] >= 8*idx->hash_len);
+	for (size_t i=0;i<nbentries;i++)
+	    err |= (idx->tables[i].idx >= (uint32_t)nbindexed);
+    }
+    if (err){
+	ph_lsh_free(idx);
+	return -1;
+    }
+    idx->count = count;
+    idx->nbindexed = nbindexed;
+    return 0;
 }
 
-
 TxtHashPoint* ph_texthash(const char *filename,int *nbpoints){
     int count;
     TxtHashPoint *TxtHash = NULL;
@@ -2756,24 +6571,16 @@ TxtMatch* ph_compare_text_hashes(TxtHashPoint *hash1, int N1, TxtHashPoint *hash
     return found_matches;
 }
 
-static bool keepStats = false;
-struct ph_stats
-{
-	ulong64 reads;
-	ulong64 avg_atime, height;
-	
-};
-enum ph_option
-{
-	PH_STATS
-};
-
 const ph_stats ph_get_stats(MVPFile *m)
 {
+	ph_stats stats = { 0, 0, 0, 0, 0 };
 	if(keepStats)
 	{
-	
+		stats = mvpStats;
+		if (stats.queries > 0)
+			stats.avg_atime /= stats.queries;
 	}
+	return stats;
 }
 void ph_set_option(ph_option opt, int val)
 {
@@ -2781,6 +6588,21 @@ void ph_set_option(ph_option opt, int val)
 	{
 		case PH_STATS:
 			keepStats = (bool)val;
+			memset(&mvpStats, 0, sizeof(mvpStats));
+			break;
+		case PH_CACHE_SIZE:
+			ph_cache_lock();
+			ph_cache_drop(NULL);
+			pageCache.budget = (val > 0) ? (off_t)val << 20 : 0;
+			ph_cache_unlock();
+			break;
+		case PH_PREFETCH:
+			mvpPrefetch = val;
+			break;
+		case PH_CACHE_PIN_LEVELS:
+			ph_cache_lock();
+			pageCache.pin_levels = (val > 0) ? val : 0;
+			ph_cache_unlock();
 			break;
 		default:
 			break;
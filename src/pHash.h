@@ -86,6 +86,8 @@ extern "C" {
 
 const int MaxFileSize = (1<<30); /* 1GB file size limit (for mvp files) */
 const off_t HeaderSize = 64;     /* header size for mvp file */
+const int MinBranchFactor = 2;   /* range of branch factors supported by the mvp tree */
+const int MaxBranchFactor = 8;
 
 const char mvptag[] = "pHashMVPfile2009";
 
@@ -149,7 +151,7 @@ typedef struct ph_mvp_file {
     int fd;
     uint8_t filenumber;
     uint8_t nbdbfiles;
-    uint8_t branchfactor; /*branch factor of tree, M(=2)*/
+    uint8_t branchfactor; /*branch factor of tree, M (MinBranchFactor to MaxBranchFactor)*/
 
     /*length of path to store distances from vantage points in the struct data_point. 
       used when querying or constructing the tree, P(=5) */
@@ -167,6 +169,10 @@ typedef struct ph_mvp_file {
     /*callback function to use to calculate the distance between 2 datapoints */
     hash_compareCB hashdist;
 
+    /* if not NULL, counts the hashdist calls of a query - set by ph_mvp_tune while it
+       measures the candidate trees, and cleared by ph_query_mvptree */
+    ulong64 *nbcalcs;
+
 } MVPFile ;
 
 
@@ -198,6 +204,16 @@ typedef struct ph_digest {
     int size;                   //the size of the coeff array
 } Digest;
 
+/* most dct coefficients a digest can have */
+const int MaxDigestCoeffs = 1024;
+
+/*! /brief Digest prepared for comparisons
+ */
+typedef struct ph_prepared_digest {
+    const float *coeffs;        //mean centered coefficients with unit norm
+    int size;                   //the number of coefficients
+} PreparedDigest;
+
 
 /* variables for textual hash */
 const int KgramLength = 50;
@@ -235,6 +251,28 @@ void ph_free_datapoint(DP *dp);
  */
 const char* ph_about();
 
+/* kinds of precomputed kernel held by ph_kernel_get, with the parameters that key them */
+typedef enum ph_kernel_kind {
+    PH_KERNEL_DCT_TABLE = 0,  /* ph_dct cosines, p0 = N, p1 = number of coefficients */
+    PH_KERNEL_DCT_MATRIX,     /* dct matrix and its transpose, p0 = size */
+    PH_KERNEL_MH,             /* marr-hildreth taps, p0 = alpha, p1 = level */
+    PH_KERNEL_HAMMING,        /* hamming window, p0 = length */
+    PH_KERNEL_BARK,           /* bark filter weights, p0 = sample rate */
+} KernelKind;
+
+typedef void* (*ph_kernel_builder)(double p0, double p1);
+
+/*! /brief shared precomputed kernel
+ *  The kernel of a kind and parameters is built once with build, a malloc'd array, and
+ *  reused by every later call from any thread. Lookups of built kernels take no lock.
+ *  /param kind - KernelKind
+ *  /param p0, p1 - double parameters of the kernel
+ *  /param build - ph_kernel_builder called with p0 and p1 when the kernel is not yet built
+ *  /param owned - (out) set when the cache is full for this kind and the caller has to free the kernel
+ *  /return pointer to the kernel, NULL for error
+ */
+const void* ph_kernel_get(KernelKind kind, double p0, double p1, ph_kernel_builder build, bool &owned);
+
 /*! /brief radon function
  *  Find radon projections of N lines running through the image center for lines angled 0
  *  to 180 degrees from horizontal.
@@ -258,9 +296,10 @@ int ph_feature_vector(const Projections &projs,Features &fv);
  *  Compute the dct of a given vector
  *  /param R - vector of input series
  *  /param D - (out) the dct of R
+ *  /param nb_coeffs - int number of coefficients to keep (1 to MaxDigestCoeffs)
  *  /return  int value - less than 0 for error
 */
-int ph_dct(const Features &fv, Digest &digest);
+int ph_dct(const Features &fv, Digest &digest, int nb_coeffs = 40);
 
 /*! /brief cross correlation for 2 series
  *  Compute the cross correlation of two series vectors
@@ -274,26 +313,74 @@ int ph_dct(const Features &fv, Digest &digest);
 
 int ph_crosscorr(const Digest &x,const Digest &y,double &pcc, double threshold = 0.90);
 
+/*! /brief cross correlation of one digest against many
+ *  x is centered once and every digest of ys is compared with it as ph_crosscorr does
+ *  /param x - Digest struct
+ *  /param ys - array of Digest structs
+ *  /param count - int number of digests in ys
+ *  /param pcc - (out) double array of count peaks, 0 for digests not the size of x
+ *  /param threshold - double value above which 2 images are considered the same
+ *  /return - int number of digests of ys the same as x, < 0 for error
+ */
+int ph_crosscorr_many(const Digest &x, const Digest *ys, int count, double *pcc, double threshold = 0.90);
+
+/*! /brief prepare a digest for repeated comparisons
+ *  The coefficients are mean centered and scaled to unit norm once, so that comparing
+ *  two prepared digests is a dot product at each lag. Digests with all coefficients
+ *  equal are prepared as zeros, and peak at 0 against anything.
+ *  /param digest - Digest struct
+ *  /param prepared - (out) PreparedDigest, free with ph_free_prepared_digest
+ *  /return - int value - 0 for success, < 0 for error
+ */
+int ph_prepare_digest(const Digest &digest, PreparedDigest &prepared);
+
+/*! /brief free the coefficients of a digest made by ph_prepare_digest
+ */
+void ph_free_prepared_digest(PreparedDigest &prepared);
+
+/*! /brief cross correlation for 2 prepared digests, as ph_crosscorr (to within float rounding)
+ *  /param x - PreparedDigest struct
+ *  /param y - PreparedDigest struct
+ *  /param pcc - (out) double value the peak of cross correlation
+ *  /param threshold - double value above which 2 images are considered the same
+ *  /return - int value - 1 (true) for same, 0 (false) for different, < 0 for error
+ */
+int ph_crosscorr_prepared(const PreparedDigest &x, const PreparedDigest &y, double &pcc, double threshold = 0.90);
+
+/*! /brief cross correlation of a prepared digest against many packed one after another,
+ *         such as the hash column of a .phx file of prepared digests
+ *  /param x - PreparedDigest struct
+ *  /param coeffs - count x x.size floats
+ *  /param count - int number of digests
+ *  /param pcc - (out) double array of count peaks
+ *  /param threshold - double value above which 2 images are considered the same
+ *  /return - int number of digests the same as x, < 0 for error
+ */
+int ph_crosscorr_prepared_many(const PreparedDigest &x, const float *coeffs, int count, double *pcc,
+                               double threshold = 0.90);
+
 /*! /brief image digest
  *  Compute the image digest for an image given the input image
  *  /param img - CImg object representing an input image
  *  /param sigma - double value for the deviation for a gaussian filter function 
- *  /param gamma - double value for gamma correction on the input image
+ *  /param gamma - double, has no effect (the gamma correction was never applied to the digest)
  *  /param digest - (out) Digest struct
  *  /param N      - int value for the number of angles to consider. 
+ *  /param nb_coeffs - int number of dct coefficients in the digest
  *  /return       - less than 0 for error
  */
-int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double gamma,Digest &digest,int N=180);
+int _ph_image_digest(const CImg<uint8_t> &img,double sigma, double gamma,Digest &digest,int N=180,int nb_coeffs=40);
 
 /*! /brief image digest
  *  Compute the image digest given the file name.
  *  /param file - string value for file name of input image.
  *  /param sigma - double value for the deviation for gaussian filter
- *  /param gamma - double value for gamma correction on the input image.
+ *  /param gamma - double, has no effect, as for _ph_image_digest
  *  /param digest - Digest struct
  *  /param N      - int value for number of angles to consider
+ *  /param nb_coeffs - int number of dct coefficients in the digest
  */
-int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest,int N=180);
+int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest,int N=180,int nb_coeffs=40);
 
 
 /*! /brief compare 2 images
@@ -301,7 +388,7 @@ int ph_image_digest(const char *file, double sigma, double gamma, Digest &digest
  *  /param imB - CImg object of second image
  *  /param pcc   - (out) double value for peak of cross correlation
  *  /param sigma - double value for the deviation of gaussian filter
- *  /param gamma - double value for gamma correction of images
+ *  /param gamma - double, has no effect, as for ph_image_digest
  *  /param N     - int number for the number of angles of radon projections
  *  /param theshold - double value for the threshold
  *  /return int 0 (false) for different images, 1 (true) for same image, less than 0 for error
@@ -314,12 +401,91 @@ int _ph_compare_images(const CImg<uint8_t> &imA,const CImg<uint8_t> &imB,double
  *  /param file2 - char string of second image file
  *  /param pcc   - (out) double value for peak of cross correlation
  *  /param sigma - double value for deviation of gaussian filter
- *  /param gamma - double value for gamma correction of images
+ *  /param gamma - double, has no effect, as for ph_image_digest
  *  /param N     - int number for number of angles
  *  /return int 0 (false) for different image, 1 (true) for same images, less than 0 for error
  */
 int ph_compare_images(const char *file1, const char *file2,double &pcc, double sigma = 3.5, double gamma=1.0, int N=180,double threshold=0.90);
 
+/*! /brief callback for the digests of ph_image_digests
+ *  called for one image at a time, in the order the images are done
+ *  /param index - int index of the image in the files array
+ *  /param digest - Digest of the image, NULL when it could not be digested
+ *  /param arg - the arg given to ph_image_digests
+ */
+typedef void (*ph_digest_callback)(int index, const Digest *digest, void *arg);
+
+/*! /brief radon digests of many image files
+ *  The images are shared out among threads as each thread becomes free.
+ *  /param files - array of image file names
+ *  /param count - int number of files
+ *  /param digests - (out) array of count Digests, the id is the file name, size 0 for images
+ *                   that could not be digested; NULL to only stream the digests to callback
+ *  /param callback - ph_digest_callback given each digest as it is made, may be NULL
+ *  /param arg - passed through to callback
+ *  /param sigma - double value for deviation of gaussian filter
+ *  /param gamma - double, has no effect, as for ph_image_digest
+ *  /param N - int number of angles
+ *  /param threads - int number of threads, 0 for the number of cpus
+ *  /return int number of images digested, < 0 for error
+ */
+int ph_image_digests(char *files[], int count, Digest *digests, ph_digest_callback callback = NULL, void *arg = NULL,
+		     double sigma = 3.5, double gamma = 1.0, int N = 180, int threads = 0);
+
+/* prepared digests of image files, so each file is digested once however often it is compared */
+typedef struct ph_digest_cache {
+    double sigma;
+    double gamma;
+    int N;
+    int count;
+    int capacity;
+    char **files;
+    PreparedDigest *digests;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} DigestCache;
+
+/*! /brief initialize an empty digest cache
+ *  /param cache - DigestCache to initialize, release with ph_digest_cache_free
+ *  /param sigma, gamma, N - digest parameters, as for ph_image_digest
+ *  /return int 0 for success, < 0 for error
+ */
+int ph_digest_cache_init(DigestCache *cache, double sigma = 3.5, double gamma = 1.0, int N = 180);
+
+/*! /brief free the digests held by the cache
+ */
+void ph_digest_cache_free(DigestCache *cache);
+
+/*! /brief prepared digest of an image file, digested on the first request only
+ *  Safe to call from several threads at once.
+ *  /param cache - DigestCache
+ *  /param file - image file name
+ *  /param prepared - (out) PreparedDigest owned by the cache, valid until ph_digest_cache_free
+ *  /return int 0 for success, < 0 for error
+ */
+int ph_digest_cache_get(DigestCache *cache, const char *file, PreparedDigest &prepared);
+
+/*! /brief compare 2 images through a digest cache
+ *  /return int 0 (false) for different image, 1 (true) for same images, less than 0 for error
+ */
+int ph_compare_images_cached(DigestCache *cache, const char *file1, const char *file2, double &pcc,
+			     double threshold = 0.90);
+
+/*! /brief compare one image against many through a digest cache
+ *  file is digested once; files not yet in the cache are digested in parallel.
+ *  /param cache - DigestCache
+ *  /param file - image file name
+ *  /param files - array of image file names to compare with
+ *  /param count - int number of files
+ *  /param pcc - (out) double array of count peaks, 0 for images that could not be digested
+ *  /param threshold - double value above which 2 images are considered the same
+ *  /param threads - int number of threads, 0 for the number of cpus
+ *  /return int number of files the same as file, < 0 for error
+ */
+int ph_compare_image_many(DigestCache *cache, const char *file, char *files[], int count, double *pcc,
+			  double threshold = 0.90, int threads = 0);
+
 /*! /brief return dct matrix, C
  *  Return DCT matrix of sqare size, N
  *  /param N - int denoting the size of the square matrix to create.
@@ -333,20 +499,197 @@ static CImg<float>* ph_dct_matrix(const int N);
  *  /return int value - -1 for failure, 0 for success
  */
 int ph_dct_imagehash(const char* file,ulong64 &hash);
+
+/*! /brief compute dct robust image hash of an image
+ *  /param src - CImg src image
+ *  /param hash - (out) ulong64 hash value
+ *  /return int value - -1 for failure, 0 for success
+ */
+int _ph_dct_imagehash(const CImg<uint8_t> &src,ulong64 &hash);
 #endif
 
 #ifdef HAVE_PTHREAD
 DP** ph_dct_image_hashes(char *files[], int count, int threads = 0);
+
+/** /brief dct hash image files in parallel and save the hashes in a .phx file
+ *  The ids are the indexes into files[] and the string table holds the filenames.
+ *  Files that cannot be hashed are left out.
+ *  /param files - list of image file names
+ *  /param count - int number of files
+ *  /param phxfile - name of the .phx file to write
+ *  /param threads - int number of threads (0 for the number of cpus)
+ *  /return int - number of hashes saved, -1 for error
+ **/
+int ph_dct_image_hashes_phx(char *files[], int count, const char *phxfile, int threads = 0);
 #endif
 
 #ifdef HAVE_VIDEO_HASH
-static CImgList<uint8_t>* ph_getKeyFramesFromVideo(const char *filename);
+/* frames decoded for the keyframes of a video, from the most accurate to the fastest.
+   A frame is sampled every half second; the faster modes do not decode the frames in
+   between, and move each sample to the next frame they do decode. */
+typedef enum ph_video_sampling {
+    PH_VIDEO_EXACT = 0,      /* decode every frame */
+    PH_VIDEO_NONREF,         /* skip the frames no other frame refers to, mostly B-frames */
+    PH_VIDEO_KEYFRAMES,      /* decode one keyframe per sample, seeking past the others;
+                                for keyframes further apart than half a second, samples merge */
+} VideoSampling;
+
+static CImgList<uint8_t>* ph_getKeyFramesFromVideo(const char *filename, int threads = 0,
+						   VideoSampling sampling = PH_VIDEO_EXACT);
+
+/*! /brief dct video robust hash
+ *  /param filename - string name of the video file
+ *  /param Length - (out) int number of hashes, one per keyframe
+ *  /param threads - int number of decoder threads, 0 for the number of cpus
+ *  /param sampling - frames decoded, trading accuracy for speed on long videos
+ *  /return ulong64 array of Length hashes, NULL for error
+ */
+ulong64* ph_dct_videohash(const char *filename, int &Length, int threads = 0,
+			  VideoSampling sampling = PH_VIDEO_EXACT);
 
-ulong64* ph_dct_videohash(const char *filename, int &Length);
+DP** ph_dct_video_hashes(char *files[], int count, int threads = 0, VideoSampling sampling = PH_VIDEO_EXACT);
 
-DP** ph_dct_video_hashes(char *files[], int count, int threads = 0);
+/* called with each keyframe hash of a video as soon as its shot has ended, index counting
+   the keyframes from 0; stops the hashing by returning < 0 */
+typedef int (*ph_video_hash_callback)(int index, ulong64 hash, void *arg);
+
+/* incremental dct video hash, holding a fixed number of 32x32 thumbnails whatever the
+   length of the video */
+typedef struct ph_video_hash_stream VideoHashStream;
+
+/*! /brief start a streaming dct video hash
+ *  /param callback - called with each keyframe hash
+ *  /param arg - passed to callback
+ *  /return VideoHashStream*, NULL for error
+ */
+VideoHashStream* ph_video_hash_stream_new(ph_video_hash_callback callback, void *arg);
+
+/*! /brief add the next sampled frame, one every half second of video
+ *  The frame may be of any size, gray or rgb. Works for live or growing inputs, as
+ *  keyframe hashes are passed to the callback about 25 seconds after their shot ends.
+ *  /param stream - VideoHashStream*
+ *  /param frame - the frame
+ *  /return int - < 0 for error or when the callback stopped the hashing
+ */
+int ph_video_hash_stream_push(VideoHashStream *stream, const CImg<uint8_t> &frame);
+
+/*! /brief end of the video, the hashes of the last shots are passed to the callback
+ *  /param stream - VideoHashStream*
+ *  /return int - number of hashes passed in all, < 0 for error or no frames
+ */
+int ph_video_hash_stream_end(VideoHashStream *stream);
+
+void ph_video_hash_stream_free(VideoHashStream *stream);
+
+/*! /brief dct video hash of a file or stream url, passing each hash to callback as it is found
+ *  The memory used does not grow with the length of the video, unlike ph_dct_videohash.
+ *  /param filename - string name of the video file, or any input ffmpeg opens
+ *  /param callback - called with each keyframe hash
+ *  /param arg - passed to callback
+ *  /param threads - int number of decoder threads, 0 for the number of cpus
+ *  /param sampling - frames decoded, trading accuracy for speed
+ *  /return int - number of hashes, < 0 for error
+ */
+int ph_dct_videohash_stream(const char *filename, ph_video_hash_callback callback, void *arg,
+			    int threads = 0, VideoSampling sampling = PH_VIDEO_EXACT);
 
 double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int threshold=21);
+
+/*! /brief similarity of two dct video hashes
+ *  The length of the longest common subsequence of keyframe hashes within threshold bits
+ *  of each other, over the shorter length. Takes N1*N2 hamming distances, N1*N2/64 word
+ *  operations and 2*N2/64 words of memory, or less with a band.
+ *  /param hashA - ulong64 array of N1 keyframe hashes
+ *  /param hashB - ulong64 array of N2 keyframe hashes
+ *  /param threshold - int max bits between matching keyframes
+ *  /param band - int Sakoe-Chiba band, keyframe i of A only matches those of B within band
+ *                of i*N2/N1, < 0 for no band
+ *  /param min_similarity - stop as soon as the similarity cannot reach it, returning an
+ *                          upper bound below it
+ *  /return double - similarity in [0,1], < 0 for error
+ */
+double ph_dct_videohash_dist2(const ulong64 *hashA, int N1, const ulong64 *hashB, int N2, int threshold = 21,
+			      int band = -1, double min_similarity = 0.0);
+
+/*! /brief ph_dct_videohash_dist2 of one video hash against many, in parallel
+ *  /param query - ulong64 array of N keyframe hashes
+ *  /param hashes - count video hashes
+ *  /param lengths - number of keyframe hashes of each
+ *  /param similarities - (out) count similarities, the same as ph_dct_videohash_dist2(query,N,hashes[i],lengths[i],..)
+ *  /param threads - int number of threads, 0 for the number of cpus
+ *  /return int - 0 for success, -1 for error
+ */
+int ph_dct_videohash_dist_many(const ulong64 *query, int N, const ulong64 **hashes, const int *lengths, int count,
+			       double *similarities, int threshold = 21, int band = -1, double min_similarity = 0.0,
+			       int threads = 0);
+
+/* inverted index over the keyframe hashes of many videos. Each 64 bit keyframe hash is
+   split into VideoIndexBlocks blocks of 16 bits, and each block value has a posting list
+   of the keyframes holding it. A query looks up each block value and, for thresholds
+   above 3, the 16 values one bit away, so keyframes within 7 bits of a query keyframe
+   are always found; one 10 bits away is found with probability 0.74, 15 bits 0.22 and
+   21 bits 0.03. A video is still found when enough of its keyframes are. A query keyframe
+   votes for a video along the diagonal (stored position - query position) of each match;
+   the videos with the most votes on one stretch of diagonals are then aligned in full
+   with ph_dct_videohash_dist2. */
+const int VideoIndexBlocks = 4;
+const int VideoIndexDiagonal = 8;   /* width of the diagonal stretch counting the votes */
+
+typedef struct ph_video_index {
+    int nbvideos;
+    int capacity;
+    ulong64 *ids;          /* id of each video */
+    uint32_t *starts;      /* nbvideos+1, first keyframe of each video */
+    int nbhashes;          /* keyframes of all videos */
+    int hash_capacity;
+    ulong64 *hashes;       /* keyframe hashes, video after video */
+    uint32_t *owner;       /* video of each keyframe */
+    int nbindexed;         /* videos in the posting lists, the rest are aligned by every query */
+    uint32_t *offsets;     /* VideoIndexBlocks x 65537 starts of the posting lists */
+    uint32_t *postings;    /* VideoIndexBlocks x keyframes of the indexed videos, by block value */
+} VideoIndex;
+
+typedef struct ph_video_result {
+    ulong64 id;
+    double similarity;     /* ph_dct_videohash_dist2 */
+    int votes;             /* keyframe matches along the best diagonals */
+} VideoResult;
+
+/** /brief set up an empty video index
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_video_index_init(VideoIndex *idx);
+
+void ph_video_index_free(VideoIndex *idx);
+
+/** /brief add the dct hash of a video, found by queries at once but only through the
+ *         posting lists after the next ph_video_index_build
+ *  /param idx - VideoIndex
+ *  /param hashes - ulong64 array of N keyframe hashes
+ *  /param N - int number of keyframe hashes
+ *  /param id - ulong64 id of the video
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_video_index_add(VideoIndex *idx, const ulong64 *hashes, int N, ulong64 id);
+
+/** /brief rebuild the posting lists over all the videos added
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_video_index_build(VideoIndex *idx);
+
+/** /brief find the videos similar to a video hash
+ *  /param idx - VideoIndex
+ *  /param hashes - ulong64 array of N keyframe hashes of the query video
+ *  /param results - (out) VideoResult array, the most similar first
+ *  /param maxresults - int size of results
+ *  /param threshold - int max bits between matching keyframes
+ *  /param nbcandidates - int number of the most voted videos aligned in full
+ *  /param min_similarity - double least similarity of the results
+ *  /param band - int Sakoe-Chiba band of the alignment, < 0 for none
+ *  /return int - number of results, -1 for error
+ **/
+int ph_video_index_query(const VideoIndex *idx, const ulong64 *hashes, int N, VideoResult *results, int maxresults,
+			 int threshold = 21, int nbcandidates = 32, double min_similarity = 0.1, int band = -1);
 #endif
 
 /* ! /brief dct video robust hash
@@ -355,9 +698,10 @@ double ph_dct_videohash_dist(ulong64 *hashA, int N1, ulong64 *hashB, int N2, int
  *   /param hash ulong64 value for hash value
  *   /return int value - less than 0 for error
  */
-#ifdef HAVE_IMAGE_HASH
 int ph_hamming_distance(const ulong64 hash1,const ulong64 hash2);
 
+#ifdef HAVE_IMAGE_HASH
+
 /** /brief create a list of datapoint's directly from a directory of image files
  *  /param dirname - path and name of directory containg all image file names
  *  /param capacity - int value for upper limit on number of hashes
@@ -367,6 +711,15 @@ int ph_hamming_distance(const ulong64 hash1,const ulong64 hash2);
 
 DP** ph_read_imagehashes(const char *dirname,int capacity, int &count);
 
+/** /brief create MH image hash for an image
+*   /param src - CImg src image
+*   /param N - (out) int value for length of image hash returned
+*   /param alpha - int scale factor for marr wavelet (default=2)
+*   /param lvl   - int level of scale factor (default = 1)
+*   /return uint8_t array, NULL for error
+**/
+uint8_t* _ph_mh_imagehash(const CImg<uint8_t> &src, int &N, float alpha=2.0f, float lvl = 1.0f);
+
 /** /brief create MH image hash for filename image
 *   /param filename - string name of image file
 *   /param N - (out) int value for length of image hash returned
@@ -375,6 +728,61 @@ DP** ph_read_imagehashes(const char *dirname,int capacity, int &count);
 *   /return uint8_t array
 **/
 uint8_t* ph_mh_imagehash(const char *filename, int &N, float alpha=2.0f, float lvl = 1.0f);
+
+/** /brief create MH image hashes of an image at several scales
+*   The image is preprocessed once and the scales are filtered in parallel.
+*   /param src - CImg src image
+*   /param alphas - float array of nbscales scale factors
+*   /param levels - float array of nbscales levels
+*   /param nbscales - int number of scales
+*   /param N - (out) int value for length of each image hash
+*   /param threads - int number of threads, 0 for the number of cpus
+*   /return uint8_t array of nbscales hashes of N bytes each, in the order of the scales; NULL for error
+**/
+uint8_t* _ph_mh_imagehashes(const CImg<uint8_t> &src, const float *alphas, const float *levels, int nbscales,
+			    int &N, int threads = 0);
+
+/** /brief create MH image hashes of an image file at several scales, as _ph_mh_imagehashes
+**/
+uint8_t* ph_mh_imagehashes(const char *filename, const float *alphas, const float *levels, int nbscales,
+			   int &N, int threads = 0);
+
+/* hashes ph_image_features can compute, or'd together */
+typedef enum ph_image_hash_kind {
+    PH_HASH_DCT = 1,     /* ph_dct_imagehash */
+    PH_HASH_MH = 2,      /* ph_mh_imagehash */
+    PH_HASH_RADON = 4,   /* ph_image_digest */
+} ImageHashKind;
+
+typedef struct ph_image_features {
+    int kinds;          /* the hashes computed */
+    ulong64 dct_hash;
+    uint8_t *mh_hash;
+    int mh_length;
+    Digest digest;      /* coeffs only, id is not set */
+} ImageFeatures;
+
+/*! /brief compute several hashes of an image
+ *  The hashes share the luma plane, so a color image is converted once.
+ *  Each hash is the same as from its own function.
+ *  /param src - CImg src image
+ *  /param kinds - int of ImageHashKind values or'd together
+ *  /param features - (out) ImageFeatures, free with ph_free_image_features
+ *  /param alpha, lvl - MH scale, as for ph_mh_imagehash
+ *  /param sigma, gamma, N - digest parameters, as for ph_image_digest
+ *  /return int 0 when all the hashes of kinds are computed, < 0 otherwise
+ */
+int _ph_image_features(const CImg<uint8_t> &src, int kinds, ImageFeatures &features, float alpha = 2.0f,
+		       float lvl = 1.0f, double sigma = 3.5, double gamma = 1.0, int N = 180);
+
+/*! /brief compute several hashes of an image file from one decode, as _ph_image_features
+ */
+int ph_image_features(const char *file, int kinds, ImageFeatures &features, float alpha = 2.0f,
+		      float lvl = 1.0f, double sigma = 3.5, double gamma = 1.0, int N = 180);
+
+/*! /brief free the hashes held by features
+ */
+void ph_free_image_features(ImageFeatures &features);
 #endif
 /** /brief count number bits set in given byte
 *   /param val - uint8_t byte value
@@ -424,9 +832,11 @@ off_t ph_save_datapoint(DP *new_dp, MVPFile *m);
  *  /param filenumber - uint8_t number of file to map
  *  /param offset - off_t offset into new file
  *  /param m - MVPFile
+ *  /param level - int query recursion level of the node, if m came from the page cache
+ *                 the page is taken from the cache too (-1 never uses the cache)
  *  /return MVPFile - ptr to new struct containing the mmap info
  **/
-MVPRetCode _ph_map_mvpfile(uint8_t filenumber, off_t offset, MVPFile *m, MVPFile *m2);
+MVPRetCode _ph_map_mvpfile(uint8_t filenumber, off_t offset, MVPFile *m, MVPFile *m2, int level = -1);
 
 /** /brief unmap/map from m2 to m
  *  /param filenumber - uint8_t filenumber of m2
@@ -478,7 +888,8 @@ static MVPRetCode _ph_save_mvptree(MVPFile *m, DP **points, int nbpoints, int sa
  *  /param m - MVPFile state info of file
  *  /param points - DP** list of points to add
  *  /param nbpoints - int number of points
- *  /return MVPRetCode - ret code 
+ *  /return MVPRetCode - ret code, PH_ERRARG for a branchfactor outside
+ *                       MinBranchFactor to MaxBranchFactor
 **/
 
 MVPRetCode ph_save_mvptree(MVPFile *m, DP **points, int nbpoints);
@@ -499,6 +910,352 @@ static MVPRetCode _ph_add_mvptree(MVPFile *m, DP *new_dp, int level);
 **/
 MVPRetCode ph_add_mvptree(MVPFile *m, DP **points, int nbpoints, int &nbsaved);
 
+/* candidate values to try when tuning the mvp tree parameters, NULL lists use defaults */
+typedef struct ph_mvp_tune_params {
+    const uint8_t *branchfactors;
+    int nb_branchfactors;
+    const uint8_t *pathlengths;
+    int nb_pathlengths;
+    const uint8_t *leafcapacities;
+    int nb_leafcapacities;
+    const off_t *pgsizes;
+    int nb_pgsizes;
+} MVPTuneParams;
+
+/* measurements for one candidate tree configuration */
+typedef struct ph_mvp_tune_result {
+    uint8_t branchfactor;
+    uint8_t pathlength;
+    uint8_t leafcapacity;
+    off_t pgsize;
+    float avg_calcs;      /* ave. distance calculations per query */
+    double avg_msecs;     /* ave. query time in milliseconds */
+    MVPRetCode retcode;   /* PH_SUCCESS if the candidate could be built and queried */
+} MVPTuneResult;
+
+/** /brief tune branchfactor, pathlength, leafcapacity and pgsize for a data sample
+ *  Builds a temporary tree (m->filename with "_tune" and a unique suffix appended)
+ *  for each candidate configuration that fits the sample, runs the query workload
+ *  against it and ranks the candidates by average query time.
+ *  /param m - MVPFile with filename, hashdist and hash_type set
+ *  /param points - DP** sample of the data to be indexed
+ *  /param nbpoints - int number of sample points
+ *  /param queries - DP** representative queries
+ *  /param nbqueries - int number of queries
+ *  /param radius - float radius used for the queries
+ *  /param threshold - float threshold used for the queries
+ *  /param knearest - int capacity of the results array used for the queries
+ *  /param params - MVPTuneParams* candidate values (NULL for defaults)
+ *  /param results - (out) MVPTuneResult* list of candidates, best first (caller frees)
+ *  /param nbresults - (out) int number of candidates in results
+ *  /param apply - int 1 to set the parameters of the best candidate in m
+ *  /return MVPRetCode - PH_ERRARG if no candidate could be built
+ **/
+MVPRetCode ph_mvp_tune(MVPFile *m, DP **points, int nbpoints, DP **queries, int nbqueries,
+                       float radius, float threshold, int knearest, const MVPTuneParams *params,
+                       MVPTuneResult **results, int &nbresults, int apply = 0);
+
+/* mvp tree access statistics, collected while the PH_STATS option is on */
+struct ph_stats
+{
+    ulong64 queries;    /* nb. of queries run */
+    ulong64 reads;      /* nb. of node pages mapped */
+    ulong64 avg_atime;  /* ave. query time in microseconds */
+    ulong64 height;     /* deepest tree level visited */
+    ulong64 cache_hits; /* node pages found in the page cache */
+};
+
+enum ph_option
+{
+    PH_STATS,           /* 1 to reset and start collecting ph_stats, 0 to stop */
+    PH_CACHE_SIZE,      /* memory budget of the query page cache in MB, 0 (default) for no cache */
+    PH_CACHE_PIN_LEVELS, /* nodes this many levels from the root are never evicted (default 2) */
+    PH_PREFETCH         /* 1 (default) to read ahead all the children a query visits, 0 not to */
+};
+
+/** /brief statistics collected since the PH_STATS option was turned on
+ *  /param m - MVPFile (unused, the statistics are global)
+ *  /return ph_stats - all zero if PH_STATS is off
+ **/
+const ph_stats ph_get_stats(MVPFile *m);
+
+/** /brief set a global option of the mvp tree functions, not thread safe
+ *  Setting PH_CACHE_SIZE empties the page cache. The page cache holds the node pages
+ *  mapped by queries between queries, it is emptied of a tree's pages when the tree
+ *  is saved or added to. Pinned pages are kept even over budget.
+ *  /param opt - ph_option to set
+ *  /param val - int value of the option
+ **/
+void ph_set_option(ph_option opt, int val);
+
+/* how datapoints are assigned to the shards of a sharded index */
+typedef enum ph_shard_route {
+    PH_ROUTE_IDHASH = 0,   /* by a hash of the datapoint id */
+    PH_ROUTE_ROUNDROBIN,   /* dealt to each shard in turn */
+} ShardRoute;
+
+/* an index split over nbshards independent mvp trees, named basename_0 .. basename_<nbshards-1> */
+typedef struct ph_mvp_shards {
+    char *basename;
+    int nbshards;
+    ShardRoute route;
+    int next_shard;        /* next shard for round robin routing */
+    MVPFile *shards;       /* tree parameters and filename of each shard */
+} MVPShards;
+
+/** /brief set up a sharded index
+ *  /param s - MVPShards to initialize
+ *  /param basename - name the shard filenames are derived from
+ *  /param nbshards - int number of shards, the same number must be used to open the index again
+ *  /param params - MVPFile with the tree parameters, hashdist and hash_type used for every shard
+ *  /param route - ShardRoute used by ph_save_mvpshards and ph_add_mvpshards
+ *  /return MVPRetCode
+ **/
+MVPRetCode ph_mvp_shards_init(MVPShards *s, const char *basename, int nbshards, const MVPFile *params,
+                              ShardRoute route = PH_ROUTE_IDHASH);
+
+/** /brief free the memory held by a sharded index (the files are kept)
+ *  /param s - MVPShards
+ **/
+void ph_mvp_shards_free(MVPShards *s);
+
+/** /brief partition points over the shards and save each shard, in parallel
+ *  Each shard must receive at least leafcapacity+2 points. hashdist must be thread safe.
+ *  /param s - MVPShards
+ *  /param points - DP** list of points to save
+ *  /param nbpoints - int number of points
+ *  /param threads - int number of threads (0 for the number of cpus)
+ *  /return MVPRetCode - first error of any shard
+ **/
+MVPRetCode ph_save_mvpshards(MVPShards *s, DP **points, int nbpoints, int threads = 0);
+
+/** /brief route points to the shards and add them to each shard, in parallel
+ *  /param s - MVPShards
+ *  /param points - DP** list of points to add
+ *  /param nbpoints - int number of points
+ *  /param nbsaved - (out) int number of points added
+ *  /param threads - int number of threads (0 for the number of cpus)
+ *  /return MVPRetCode - first error of any shard
+ **/
+MVPRetCode ph_add_mvpshards(MVPShards *s, DP **points, int nbpoints, int &nbsaved, int threads = 0);
+
+/** /brief query every shard in parallel and merge the results, sorted nearest first
+ *  Each shard stops at knearest results as ph_query_mvptree does, keeping the first it
+ *  finds, so once any shard is capped (PH_ERRCAP) the merged results are knearest points
+ *  within the threshold but not necessarily the knearest nearest ones.
+ *  /param s - MVPShards
+ *  /param query - DP* item to query for
+ *  /param knearest - int capacity of results array
+ *  /param radius - float radius to consider in query
+ *  /param threshold - float threshold of the results
+ *  /param results - DP** list of pointers to results found (caller frees as for ph_query_mvptree)
+ *  /param nbfound - (out) int number of results found
+ *  /param threads - int number of threads (0 for the number of cpus)
+ *  /return MVPRetCode - PH_ERRCAP if the results array is full, else first error of any shard
+ **/
+MVPRetCode ph_query_mvpshards(MVPShards *s, DP *query, int knearest, float radius, float threshold,
+                              DP **results, int &nbfound, int threads = 0);
+
+/* .phx hash collection file - a 64 byte header (tag, uint32 version, uint32 hash_width,
+   ulong64 count, hash, id and string table offsets, has strings flag) followed by
+   columns, each starting on a 64 byte boundary, in host byte order:
+     hashes      count x hash_width bytes (ulong64 values for hash_width 8)
+     ids         count x ulong64
+     strings     optional, (count+1) x ulong64 offsets into the blob that follows,
+                 string i runs from offset[i] to offset[i+1] (nul terminated)     */
+const char phxtag[] = "pHashPHXfile0001";
+const int PHXVersion = 1;
+const int PHXHeaderSize = 64;
+
+typedef struct ph_phx_file {
+    char *buf;                  /* mapping of the whole file */
+    off_t size;
+    uint32_t hash_width;        /* bytes per hash */
+    ulong64 count;              /* number of hashes */
+    const uint8_t *hashes;      /* hash column, 64 byte aligned */
+    const ulong64 *ids;         /* id column */
+    const ulong64 *str_offsets; /* string table, NULL if none */
+    const char *strings;
+} PHXFile;
+
+/** /brief write a hash collection to a .phx file
+ *  /param filename - name of the file to write
+ *  /param hashes - count x hash_width bytes of hashes (a ulong64 array for hash_width 8)
+ *  /param hash_width - int bytes per hash
+ *  /param ids - ulong64 id of each hash (NULL for 0 .. count-1)
+ *  /param strings - string for each hash, e.g. filenames (NULL for no string table)
+ *  /param count - ulong64 number of hashes
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_phx_save(const char *filename, const void *hashes, int hash_width, const ulong64 *ids,
+                const char *const *strings, ulong64 count);
+
+/** /brief map a .phx file, the columns are used in place without parsing
+ *  /param filename - name of the file
+ *  /param phx - (out) PHXFile pointing into the mapping
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_phx_open(const char *filename, PHXFile *phx);
+
+/** /brief unmap a file opened with ph_phx_open
+ *  /param phx - PHXFile
+ **/
+void ph_phx_close(PHXFile *phx);
+
+/** /brief hash i of a .phx file with 8 byte hashes **/
+static inline ulong64 ph_phx_hash64(const PHXFile *phx, ulong64 i){
+    return ((const ulong64*)phx->hashes)[i];
+}
+
+/** /brief string i of a .phx file, NULL if it has no string table **/
+static inline const char* ph_phx_string(const PHXFile *phx, ulong64 i){
+    return (phx->str_offsets) ? phx->strings + phx->str_offsets[i] : NULL;
+}
+
+#ifdef HAVE_IMAGE_HASH
+/*! /brief save prepared digests of the same size to a .phx file, each digest is a hash of
+ *         size*sizeof(float) bytes, so that the file can be mapped with ph_phx_open
+ *  /param filename - string name of the file
+ *  /param digests - PreparedDigest array
+ *  /param count - int number of digests
+ *  /param ids - ulong64 id of each digest (NULL for 0 .. count-1)
+ *  /param names - string of each digest, e.g. its file name (NULL for none)
+ *  /return - int value - 0 for success, < 0 for error
+ */
+int ph_save_prepared_digests(const char *filename, const PreparedDigest *digests, int count,
+                             const ulong64 *ids = NULL, const char *const *names = NULL);
+
+/*! /brief prepared digest i of a mapped .phx file, pointing into the mapping (do not free)
+ *  /param phx - PHXFile opened with ph_phx_open
+ *  /param i - ulong64 index of the digest
+ *  /param prepared - (out) PreparedDigest
+ *  /return - int value - 0 for success, < 0 for error (incl. hashes of more than MaxDigestCoeffs floats)
+ */
+int ph_phx_prepared_digest(const PHXFile *phx, ulong64 i, PreparedDigest &prepared);
+#endif
+
+/* how ph_cluster_hashes groups hashes */
+typedef enum ph_cluster_mode {
+    PH_CLUSTER_COMPONENTS = 0, /* connected components of hashes within the threshold of each other */
+    PH_CLUSTER_LEADER,         /* in index order, each hash joins the first leader within the
+                                  threshold, or becomes a new leader */
+} ClusterMode;
+
+/** /brief cluster near duplicate dct hashes
+ *  Candidate pairs come from multi-index tables over blocks of the hash bits, so every
+ *  pair within the threshold is found without comparing all pairs. The tables stay
+ *  selective for small thresholds only - on one core 10M hashes take 20s at threshold 4
+ *  and 2 minutes at 6, but 3003 tables are needed from threshold 8 on. For larger ones, a
+ *  recall below 1 takes candidates from banded LSH instead - random samples of the hash
+ *  bits, enough of them that a pair at the threshold shares a sample with at least that
+ *  probability (10M hashes at threshold 10 and recall 0.9 take 3.5 minutes on one core).
+ *  The exact tables are still used when the cost estimate favours them.
+ *  /param hashes - ulong64 array of hashes
+ *  /param count - int number of hashes
+ *  /param threshold - int max hamming distance between hashes of a cluster
+ *  /param labels - (out) int array of count cluster numbers, clusters are numbered from 0 in
+ *                  order of their lowest index, which is the leader in PH_CLUSTER_LEADER mode
+ *  /param mode - ClusterMode
+ *  /param threads - int number of threads (0 for the number of cpus)
+ *  /param recall - double min. probability of finding a pair at the threshold, 1 for exact
+ *  /return int - number of clusters, -1 for error
+ **/
+int ph_cluster_hashes(const ulong64 *hashes, int count, int threshold, int *labels,
+                      ClusterMode mode = PH_CLUSTER_COMPONENTS, int threads = 0, double recall = 1.0);
+
+/* banded LSH index over fixed length byte array hashes, such as the 72 byte MH image
+   hashes. Each of nbbands bands samples rows bits of the hash at positions drawn from
+   seed, and hashes with the same bits in any one band are candidates, checked with
+   ph_hammingdistance2. A hash at normalized distance d is a candidate with probability
+   1-(1-(1-d)^rows)^nbbands - e.g. 40 bands of 16 bits find 95% of MH hashes at 0.15. */
+const char lshtag[] = "pHashLSHfile0001";
+const int LSHVersion = 1;
+const int LSHHeaderSize = 64;
+
+typedef struct ph_lsh_entry {
+    ulong64 key;        /* sampled bits */
+    uint32_t idx;       /* index of the hash in the index */
+} LSHEntry;
+
+typedef struct ph_lsh_index {
+    int hash_len;       /* bytes per hash */
+    int nbbands;
+    int rows;           /* bits sampled by each band, at most 64 */
+    uint32_t seed;
+    uint16_t *bits;     /* nbbands x rows sampled bit positions */
+    int count;          /* hashes in the index */
+    int capacity;
+    int nbindexed;      /* hashes in the band tables, the rest are scanned by queries */
+    uint8_t *hashes;    /* count x hash_len */
+    ulong64 *ids;
+    LSHEntry *tables;   /* nbbands x nbindexed, each band sorted by key */
+} LSHIndex;
+
+typedef struct ph_lsh_result {
+    ulong64 id;
+    double distance;    /* normalized hamming distance */
+} LSHResult;
+
+/** /brief set up an empty LSH index
+ *  /param idx - LSHIndex to initialize
+ *  /param hash_len - int bytes per hash
+ *  /param nbbands - int number of bands
+ *  /param rows - int bits sampled by each band (1 to 64)
+ *  /param seed - uint32_t seed for the sampled bits, indexes can only be merged with the same seed
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_lsh_init(LSHIndex *idx, int hash_len, int nbbands = 40, int rows = 16, uint32_t seed = 1);
+
+/** /brief free the memory held by an LSH index
+ *  /param idx - LSHIndex
+ **/
+void ph_lsh_free(LSHIndex *idx);
+
+/** /brief add hashes to an LSH index, they are found by queries at once but only
+ *         looked up through the band tables after the next ph_lsh_build
+ *  /param idx - LSHIndex
+ *  /param hashes - count x hash_len bytes
+ *  /param ids - ulong64 id of each hash (NULL to number them from the current count)
+ *  /param count - int number of hashes
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_lsh_add(LSHIndex *idx, const uint8_t *hashes, const ulong64 *ids, int count);
+
+/** /brief build the band tables for the hashes added since the last build
+ *  /param idx - LSHIndex
+ *  /param threads - int number of threads (0 for the number of cpus)
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_lsh_build(LSHIndex *idx, int threads = 0);
+
+/** /brief find the hashes within threshold of hash
+ *  /param idx - LSHIndex
+ *  /param hash - hash_len bytes
+ *  /param threshold - double max normalized hamming distance
+ *  /param results - (out) LSHResult array, the closest first
+ *  /param maxresults - int size of results
+ *  /return int - number of results, -1 for error
+ **/
+int ph_lsh_query(const LSHIndex *idx, const uint8_t *hash, double threshold,
+                 LSHResult *results, int maxresults);
+
+/** /brief append the hashes of src to dst, merging the band tables when both are built
+ *  /param dst - LSHIndex
+ *  /param src - LSHIndex with the same hash_len, bands, rows and seed
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_lsh_merge(LSHIndex *dst, const LSHIndex *src);
+
+/** /brief save an LSH index, with its band tables, to a file
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_lsh_save(const LSHIndex *idx, const char *filename);
+
+/** /brief load an LSH index saved with ph_lsh_save
+ *  /return int - 0 for success, -1 for error
+ **/
+int ph_lsh_load(LSHIndex *idx, const char *filename);
+
 /** /brief textual hash for file
  *  /param filename - char* name of file
  *  /param nbpoints - int length of array of return value (out)